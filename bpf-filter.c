@@ -0,0 +1,582 @@
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "bpf-filter.h"
+
+#define FALSE                   0
+#define TRUE                    1
+#define MAX_TOKEN_SIZE          64
+
+/**
+ * The label of the instruction that follows the jump.
+ */
+#define LABEL_NEXT              -1
+
+/**
+ * Offsets of fields in Ethernet frames with an IPv4 header.
+ */
+#define OFFSET_ETHER_TYPE       12
+#define OFFSET_IP_HEADER        14
+#define OFFSET_IP_FRAGMENT      (OFFSET_IP_HEADER + 6)
+#define OFFSET_IP_PROTOCOL      (OFFSET_IP_HEADER + 9)
+#define OFFSET_IP_SOURCE        (OFFSET_IP_HEADER + 12)
+#define OFFSET_IP_DESTINATION   (OFFSET_IP_HEADER + 16)
+#define IP_FRAGMENT_OFFSET_MASK 0x1FFF
+
+/**
+ * The number of bytes of a packet accepted by the filter, i.e. the whole packet.
+ * The kernel truncates accepted packets to the value returned by the program.
+ */
+#define ACCEPTED_PACKET_SIZE    0x40000
+
+/**
+ * Directions of host and port primitives.
+ */
+#define DIRECTION_ANY           0
+#define DIRECTION_SOURCE        1
+#define DIRECTION_DESTINATION   2
+
+/**
+ * The state of compiling a filter expression.
+ *
+ * The expression is compiled in one pass by recursive descent. Each rule
+ * is given the labels to jump to when it's true or false. Since it isn't
+ * known whether an operand is followed by "and"/"or" until it's compiled,
+ * a label can be bound to a position or be an alias of another label, and
+ * all labels are resolved to jump offsets at the end.
+ */
+struct BpfFilterCompiler {
+    const char* input;
+    char token[MAX_TOKEN_SIZE];
+    struct sock_filter instructions[BPF_FILTER_MAX_INSTRUCTIONS];
+    int trueLabels[BPF_FILTER_MAX_INSTRUCTIONS];
+    int falseLabels[BPF_FILTER_MAX_INSTRUCTIONS];
+    int numberOfInstructions;
+    int labelPositions[BPF_FILTER_MAX_LABELS];
+    int labelAliases[BPF_FILTER_MAX_LABELS];
+    int numberOfLabels;
+    char* errorMessage;
+    size_t errorMessageSize;
+};
+
+/**
+ * Prototypes of functions.
+ */
+static int compileOrExpression(struct BpfFilterCompiler* compiler, int trueLabel, int falseLabel);
+static int compileAndExpression(struct BpfFilterCompiler* compiler, int trueLabel, int falseLabel);
+static int compileNotExpression(struct BpfFilterCompiler* compiler, int trueLabel, int falseLabel);
+static int compilePrimitive(struct BpfFilterCompiler* compiler, int trueLabel, int falseLabel);
+static void compileIpCheck(struct BpfFilterCompiler* compiler, int falseLabel);
+static void compileHostCheck(struct BpfFilterCompiler* compiler, int direction, unsigned int address, int trueLabel, int falseLabel);
+static void compilePortCheck(struct BpfFilterCompiler* compiler, int protocol, int direction, unsigned int port, int trueLabel, int falseLabel);
+static void readToken(struct BpfFilterCompiler* compiler);
+static int isToken(struct BpfFilterCompiler* compiler, const char* token);
+static int getProtocolNumber(const char* token);
+static int createLabel(struct BpfFilterCompiler* compiler);
+static void placeLabel(struct BpfFilterCompiler* compiler, int label);
+static void aliasLabel(struct BpfFilterCompiler* compiler, int label, int targetLabel);
+static int resolveLabel(struct BpfFilterCompiler* compiler, int label, int instructionIndex);
+static void emitStatement(struct BpfFilterCompiler* compiler, unsigned short code, unsigned int k);
+static void emitJump(struct BpfFilterCompiler* compiler, unsigned short code, unsigned int k, int trueLabel, int falseLabel);
+static int reportError(struct BpfFilterCompiler* compiler, const char* format, ...);
+
+/**
+ * Compile a filter expression into a classic BPF program.
+ *
+ * The grammar of expressions is a subset of pcap-filter(7):
+ *
+ *   expression := and-expr { ("or" | "||") and-expr }
+ *   and-expr   := not-expr { ("and" | "&&") not-expr }
+ *   not-expr   := ("not" | "!") not-expr | "(" expression ")" | primitive
+ *   primitive  := "ip" | "tcp" | "udp" | "icmp" | "igmp"
+ *               | [ "tcp" | "udp" ] [ "src" | "dst" ] "port" <number>
+ *               | [ "src" | "dst" ] "host" <IPv4 address>
+ *
+ * For example, "tcp port 80 and not host 10.0.0.1".
+ *
+ * @param  expression   the filter expression, NULL for accepting all packets
+ * @param  snapLength   the number of bytes kept of each accepted packet, 0 for the whole packet
+ * @param  program      the compiled program, which should be released by releaseBpfFilter
+ * @param  errorMessage the buffer for the error message
+ * @param  n            the size of the buffer for the error message
+ * @return -1 if the expression is invalid
+ */
+int compileBpfFilter(const char* expression, unsigned int snapLength, struct sock_fprog* program, 
+        char* errorMessage, size_t n) {
+    struct BpfFilterCompiler* compiler = calloc(1, sizeof(struct BpfFilterCompiler));
+    if ( compiler == NULL ) {
+        snprintf(errorMessage, n, "%s", strerror(errno));
+        return -1;
+    }
+    compiler->input = expression;
+    compiler->errorMessage = errorMessage;
+    compiler->errorMessageSize = n;
+
+    int acceptLabel = createLabel(compiler);
+    int rejectLabel = createLabel(compiler);
+    int exitCode = 0;
+    if ( expression != NULL ) {
+        readToken(compiler);
+        if ( compiler->token[0] == 0 ) {
+            free(compiler);
+            snprintf(errorMessage, n, "The filter expression is empty");
+            return -1;
+        }
+        exitCode = compileOrExpression(compiler, acceptLabel, rejectLabel);
+        if ( exitCode == 0 && compiler->token[0] != 0 ) {
+            exitCode = reportError(compiler, "Unexpected \"%s\"", compiler->token);
+        }
+    }
+
+    // The program returns the number of bytes to accept
+    placeLabel(compiler, acceptLabel);
+    emitStatement(compiler, BPF_RET | BPF_K, snapLength != 0 ? snapLength : ACCEPTED_PACKET_SIZE);
+    placeLabel(compiler, rejectLabel);
+    emitStatement(compiler, BPF_RET | BPF_K, 0);
+    if ( exitCode == 0 && compiler->numberOfInstructions >= BPF_FILTER_MAX_INSTRUCTIONS ) {
+        exitCode = reportError(compiler, "The filter expression is too complex");
+    }
+
+    // Resolve labels to the offsets of jumps
+    int i = 0;
+    for ( i = 0; exitCode == 0 && i < compiler->numberOfInstructions; ++ i ) {
+        struct sock_filter* instruction = &compiler->instructions[i];
+        if ( BPF_CLASS(instruction->code) != BPF_JMP ) {
+            continue;
+        }
+        int trueOffset = resolveLabel(compiler, compiler->trueLabels[i], i);
+        int falseOffset = resolveLabel(compiler, compiler->falseLabels[i], i);
+        if ( trueOffset < 0 || trueOffset > 255 || falseOffset < 0 || falseOffset > 255 ) {
+            exitCode = reportError(compiler, "The filter expression is too complex");
+            break;
+        }
+        instruction->jt = trueOffset;
+        instruction->jf = falseOffset;
+    }
+
+    if ( exitCode == 0 ) {
+        program->len = compiler->numberOfInstructions;
+        program->filter = malloc(program->len * sizeof(struct sock_filter));
+        if ( program->filter == NULL ) {
+            exitCode = reportError(compiler, "%s", strerror(errno));
+        } else {
+            memcpy(program->filter, compiler->instructions, program->len * sizeof(struct sock_filter));
+        }
+    }
+    free(compiler);
+
+    return exitCode;
+}
+
+/**
+ * Attach the program to a socket, so that packets not accepted are dropped
+ * in the kernel before they are copied to the user space.
+ *
+ * @param  socketFileDescriptor the file descriptor of the socket
+ * @param  program              the compiled program
+ * @return -1 if the program cannot be attached
+ */
+int attachBpfFilter(int socketFileDescriptor, struct sock_fprog* program) {
+    return setsockopt(socketFileDescriptor, SOL_SOCKET, SO_ATTACH_FILTER, program, sizeof(struct sock_fprog));
+}
+
+/**
+ * Release the instructions of the program.
+ *
+ * @param program the compiled program
+ */
+void releaseBpfFilter(struct sock_fprog* program) {
+    free(program->filter);
+    program->filter = NULL;
+    program->len = 0;
+}
+
+/**
+ * Compile "and-expr { or and-expr }".
+ *
+ * @param  compiler   the state of compiling
+ * @param  trueLabel  the label to jump to if the expression is true
+ * @param  falseLabel the label to jump to if the expression is false
+ * @return -1 if the expression is invalid
+ */
+static int compileOrExpression(struct BpfFilterCompiler* compiler, int trueLabel, int falseLabel) {
+    while ( TRUE ) {
+        // Try the next operand if this one is false
+        int nextLabel = createLabel(compiler);
+        if ( compileAndExpression(compiler, trueLabel, nextLabel) == -1 ) {
+            return -1;
+        }
+        if ( !isToken(compiler, "or") && !isToken(compiler, "||") ) {
+            aliasLabel(compiler, nextLabel, falseLabel);
+            return 0;
+        }
+        readToken(compiler);
+        placeLabel(compiler, nextLabel);
+    }
+}
+
+/**
+ * Compile "not-expr { and not-expr }".
+ *
+ * @param  compiler   the state of compiling
+ * @param  trueLabel  the label to jump to if the expression is true
+ * @param  falseLabel the label to jump to if the expression is false
+ * @return -1 if the expression is invalid
+ */
+static int compileAndExpression(struct BpfFilterCompiler* compiler, int trueLabel, int falseLabel) {
+    while ( TRUE ) {
+        // Check the next operand if this one is true
+        int nextLabel = createLabel(compiler);
+        if ( compileNotExpression(compiler, nextLabel, falseLabel) == -1 ) {
+            return -1;
+        }
+        if ( !isToken(compiler, "and") && !isToken(compiler, "&&") ) {
+            aliasLabel(compiler, nextLabel, trueLabel);
+            return 0;
+        }
+        readToken(compiler);
+        placeLabel(compiler, nextLabel);
+    }
+}
+
+/**
+ * Compile "not not-expr", "( expression )" or a primitive.
+ *
+ * @param  compiler   the state of compiling
+ * @param  trueLabel  the label to jump to if the expression is true
+ * @param  falseLabel the label to jump to if the expression is false
+ * @return -1 if the expression is invalid
+ */
+static int compileNotExpression(struct BpfFilterCompiler* compiler, int trueLabel, int falseLabel) {
+    if ( isToken(compiler, "not") || isToken(compiler, "!") ) {
+        readToken(compiler);
+        return compileNotExpression(compiler, falseLabel, trueLabel);
+    } else if ( isToken(compiler, "(") ) {
+        readToken(compiler);
+        if ( compileOrExpression(compiler, trueLabel, falseLabel) == -1 ) {
+            return -1;
+        }
+        if ( !isToken(compiler, ")") ) {
+            return reportError(compiler, "Expected \")\"");
+        }
+        readToken(compiler);
+        return 0;
+    }
+    return compilePrimitive(compiler, trueLabel, falseLabel);
+}
+
+/**
+ * Compile a primitive, e.g. "tcp", "udp dst port 53" or "src host 10.0.0.1".
+ *
+ * @param  compiler   the state of compiling
+ * @param  trueLabel  the label to jump to if the primitive is true
+ * @param  falseLabel the label to jump to if the primitive is false
+ * @return -1 if the primitive is invalid
+ */
+static int compilePrimitive(struct BpfFilterCompiler* compiler, int trueLabel, int falseLabel) {
+    int protocol = -1;
+    int direction = DIRECTION_ANY;
+
+    if ( isToken(compiler, "ip") ) {
+        readToken(compiler);
+        emitStatement(compiler, BPF_LD | BPF_H | BPF_ABS, OFFSET_ETHER_TYPE);
+        emitJump(compiler, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, trueLabel, falseLabel);
+        return 0;
+    }
+    if ( (protocol = getProtocolNumber(compiler->token)) != -1 ) {
+        readToken(compiler);
+        // A protocol without qualifiers, or a protocol qualifying a port
+        if ( !isToken(compiler, "port") && !isToken(compiler, "src") && !isToken(compiler, "dst") ) {
+            compileIpCheck(compiler, falseLabel);
+            emitStatement(compiler, BPF_LD | BPF_B | BPF_ABS, OFFSET_IP_PROTOCOL);
+            emitJump(compiler, BPF_JMP | BPF_JEQ | BPF_K, protocol, trueLabel, falseLabel);
+            return 0;
+        }
+        if ( protocol != IPPROTO_TCP && protocol != IPPROTO_UDP ) {
+            return reportError(compiler, "Only tcp and udp have ports");
+        }
+    }
+    if ( isToken(compiler, "src") || isToken(compiler, "dst") ) {
+        direction = isToken(compiler, "src") ? DIRECTION_SOURCE : DIRECTION_DESTINATION;
+        readToken(compiler);
+    }
+
+    if ( isToken(compiler, "host") ) {
+        readToken(compiler);
+        struct in_addr address;
+        if ( protocol != -1 || inet_pton(AF_INET, compiler->token, &address) != 1 ) {
+            return reportError(compiler, "Expected an IPv4 address after \"host\"");
+        }
+        readToken(compiler);
+        compileHostCheck(compiler, direction, ntohl(address.s_addr), trueLabel, falseLabel);
+        return 0;
+    } else if ( isToken(compiler, "port") ) {
+        readToken(compiler);
+        char* pEnd = NULL;
+        long port = strtol(compiler->token, &pEnd, 10);
+        if ( compiler->token[0] == 0 || *pEnd != 0 || port < 0 || port > 65535 ) {
+            return reportError(compiler, "Expected a port number after \"port\"");
+        }
+        readToken(compiler);
+        compilePortCheck(compiler, protocol, direction, port, trueLabel, falseLabel);
+        return 0;
+    }
+
+    if ( compiler->token[0] == 0 ) {
+        return reportError(compiler, "Unexpected end of the filter expression");
+    }
+    return reportError(compiler, "Unknown primitive \"%s\"", compiler->token);
+}
+
+/**
+ * Jump to falseLabel if the frame isn't IPv4, or fall through otherwise.
+ *
+ * @param compiler   the state of compiling
+ * @param falseLabel the label to jump to if the frame isn't IPv4
+ */
+static void compileIpCheck(struct BpfFilterCompiler* compiler, int falseLabel) {
+    emitStatement(compiler, BPF_LD | BPF_H | BPF_ABS, OFFSET_ETHER_TYPE);
+    emitJump(compiler, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, LABEL_NEXT, falseLabel);
+}
+
+/**
+ * Compile the check of source and/or destination address.
+ *
+ * @param compiler   the state of compiling
+ * @param direction  which address to check
+ * @param address    the IPv4 address in host byte order
+ * @param trueLabel  the label to jump to if the address matches
+ * @param falseLabel the label to jump to otherwise
+ */
+static void compileHostCheck(struct BpfFilterCompiler* compiler, int direction, unsigned int address, int trueLabel, int falseLabel) {
+    compileIpCheck(compiler, falseLabel);
+
+    if ( direction != DIRECTION_DESTINATION ) {
+        emitStatement(compiler, BPF_LD | BPF_W | BPF_ABS, OFFSET_IP_SOURCE);
+        emitJump(compiler, BPF_JMP | BPF_JEQ | BPF_K, address, trueLabel, 
+            direction == DIRECTION_ANY ? LABEL_NEXT : falseLabel);
+    }
+    if ( direction != DIRECTION_SOURCE ) {
+        emitStatement(compiler, BPF_LD | BPF_W | BPF_ABS, OFFSET_IP_DESTINATION);
+        emitJump(compiler, BPF_JMP | BPF_JEQ | BPF_K, address, trueLabel, falseLabel);
+    }
+}
+
+/**
+ * Compile the check of source and/or destination port of TCP or UDP.
+ * Fragments other than the first one are never matched, since they carry
+ * no transport header.
+ *
+ * @param compiler   the state of compiling
+ * @param protocol   IPPROTO_TCP, IPPROTO_UDP, or -1 for both
+ * @param direction  which port to check
+ * @param port       the port number
+ * @param trueLabel  the label to jump to if the port matches
+ * @param falseLabel the label to jump to otherwise
+ */
+static void compilePortCheck(struct BpfFilterCompiler* compiler, int protocol, int direction, unsigned int port, int trueLabel, int falseLabel) {
+    compileIpCheck(compiler, falseLabel);
+
+    emitStatement(compiler, BPF_LD | BPF_B | BPF_ABS, OFFSET_IP_PROTOCOL);
+    if ( protocol == -1 ) {
+        int transportLabel = createLabel(compiler);
+        emitJump(compiler, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, transportLabel, LABEL_NEXT);
+        emitJump(compiler, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, LABEL_NEXT, falseLabel);
+        placeLabel(compiler, transportLabel);
+    } else {
+        emitJump(compiler, BPF_JMP | BPF_JEQ | BPF_K, protocol, LABEL_NEXT, falseLabel);
+    }
+    emitStatement(compiler, BPF_LD | BPF_H | BPF_ABS, OFFSET_IP_FRAGMENT);
+    emitJump(compiler, BPF_JMP | BPF_JSET | BPF_K, IP_FRAGMENT_OFFSET_MASK, falseLabel, LABEL_NEXT);
+
+    // X = the length of IP header, ports are the first two fields of both TCP and UDP
+    emitStatement(compiler, BPF_LDX | BPF_B | BPF_MSH, OFFSET_IP_HEADER);
+    if ( direction != DIRECTION_DESTINATION ) {
+        emitStatement(compiler, BPF_LD | BPF_H | BPF_IND, OFFSET_IP_HEADER);
+        emitJump(compiler, BPF_JMP | BPF_JEQ | BPF_K, port, trueLabel, 
+            direction == DIRECTION_ANY ? LABEL_NEXT : falseLabel);
+    }
+    if ( direction != DIRECTION_SOURCE ) {
+        emitStatement(compiler, BPF_LD | BPF_H | BPF_IND, OFFSET_IP_HEADER + 2);
+        emitJump(compiler, BPF_JMP | BPF_JEQ | BPF_K, port, trueLabel, falseLabel);
+    }
+}
+
+/**
+ * Read the next token of the expression into compiler->token.
+ * The token is empty at the end of the expression.
+ *
+ * @param compiler the state of compiling
+ */
+static void readToken(struct BpfFilterCompiler* compiler) {
+    const char* pInput = compiler->input;
+    int length = 0;
+
+    while ( isspace((unsigned char) *pInput) ) {
+        ++ pInput;
+    }
+    if ( *pInput == '(' || *pInput == ')' || *pInput == '!' ) {
+        length = 1;
+    } else if ( strncmp(pInput, "&&", 2) == 0 || strncmp(pInput, "||", 2) == 0 ) {
+        length = 2;
+    } else {
+        while ( pInput[length] != 0 && !isspace((unsigned char) pInput[length]) && 
+                strchr("()!&|", pInput[length]) == NULL ) {
+            ++ length;
+        }
+    }
+    if ( length >= MAX_TOKEN_SIZE ) {
+        length = MAX_TOKEN_SIZE - 1;
+    }
+    memcpy(compiler->token, pInput, length);
+    compiler->token[length] = 0;
+    compiler->input = pInput + length;
+}
+
+/**
+ * Check whether the current token is the given one.
+ *
+ * @param  compiler the state of compiling
+ * @param  token    the expected token
+ * @return TRUE if the current token is the given one
+ */
+static int isToken(struct BpfFilterCompiler* compiler, const char* token) {
+    return strcmp(compiler->token, token) == 0;
+}
+
+/**
+ * Get the IP protocol number of a protocol name.
+ *
+ * @param  token the name of the protocol
+ * @return the protocol number, or -1 if it isn't a protocol name
+ */
+static int getProtocolNumber(const char* token) {
+    if ( strcmp(token, "tcp") == 0 ) {
+        return IPPROTO_TCP;
+    } else if ( strcmp(token, "udp") == 0 ) {
+        return IPPROTO_UDP;
+    } else if ( strcmp(token, "icmp") == 0 ) {
+        return IPPROTO_ICMP;
+    } else if ( strcmp(token, "igmp") == 0 ) {
+        return IPPROTO_IGMP;
+    }
+    return -1;
+}
+
+/**
+ * Create a label that isn't placed yet.
+ *
+ * @param  compiler the state of compiling
+ * @return the new label
+ */
+static int createLabel(struct BpfFilterCompiler* compiler) {
+    if ( compiler->numberOfLabels == BPF_FILTER_MAX_LABELS ) {
+        // Reported as a complex expression when the instructions overflow
+        compiler->numberOfInstructions = BPF_FILTER_MAX_INSTRUCTIONS;
+        return BPF_FILTER_MAX_LABELS - 1;
+    }
+    int label = compiler->numberOfLabels ++;
+    compiler->labelPositions[label] = -1;
+    compiler->labelAliases[label] = -1;
+
+    return label;
+}
+
+/**
+ * Bind the label to the next instruction.
+ *
+ * @param compiler the state of compiling
+ * @param label    the label to place
+ */
+static void placeLabel(struct BpfFilterCompiler* compiler, int label) {
+    compiler->labelPositions[label] = compiler->numberOfInstructions;
+}
+
+/**
+ * Make the label jump to the same position as the target label.
+ *
+ * @param compiler    the state of compiling
+ * @param label       the label to bind
+ * @param targetLabel the label to follow
+ */
+static void aliasLabel(struct BpfFilterCompiler* compiler, int label, int targetLabel) {
+    compiler->labelAliases[label] = targetLabel;
+}
+
+/**
+ * Get the jump offset from the instruction to the label.
+ *
+ * @param  compiler         the state of compiling
+ * @param  label            the label to jump to
+ * @param  instructionIndex the index of the jump instruction
+ * @return the offset of the jump, or -1 if the label isn't placed
+ */
+static int resolveLabel(struct BpfFilterCompiler* compiler, int label, int instructionIndex) {
+    if ( label == LABEL_NEXT ) {
+        return 0;
+    }
+
+    int i = 0;
+    for ( i = 0; i < compiler->numberOfLabels && compiler->labelAliases[label] != -1; ++ i ) {
+        label = compiler->labelAliases[label];
+    }
+    if ( compiler->labelPositions[label] == -1 ) {
+        return -1;
+    }
+    return compiler->labelPositions[label] - instructionIndex - 1;
+}
+
+/**
+ * Emit an instruction other than conditional jumps.
+ *
+ * @param compiler the state of compiling
+ * @param code     the operation code
+ * @param k        the generic field of the instruction
+ */
+static void emitStatement(struct BpfFilterCompiler* compiler, unsigned short code, unsigned int k) {
+    emitJump(compiler, code, k, LABEL_NEXT, LABEL_NEXT);
+}
+
+/**
+ * Emit an instruction with the labels to jump to.
+ *
+ * @param compiler   the state of compiling
+ * @param code       the operation code
+ * @param k          the generic field of the instruction
+ * @param trueLabel  the label to jump to if the condition is true
+ * @param falseLabel the label to jump to if the condition is false
+ */
+static void emitJump(struct BpfFilterCompiler* compiler, unsigned short code, unsigned int k, int trueLabel, int falseLabel) {
+    if ( compiler->numberOfInstructions >= BPF_FILTER_MAX_INSTRUCTIONS ) {
+        return;
+    }
+    int i = compiler->numberOfInstructions ++;
+    struct sock_filter instruction = BPF_STMT(code, k);
+    compiler->instructions[i] = instruction;
+    compiler->trueLabels[i] = trueLabel;
+    compiler->falseLabels[i] = falseLabel;
+}
+
+/**
+ * Write the error message.
+ *
+ * @param  compiler the state of compiling
+ * @param  format   the format of the message
+ * @return -1 always
+ */
+static int reportError(struct BpfFilterCompiler* compiler, const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(compiler->errorMessage, compiler->errorMessageSize, format, arguments);
+    va_end(arguments);
+
+    return -1;
+}
@@ -0,0 +1,19 @@
+#ifndef BPF_FILTER_H
+#define BPF_FILTER_H
+
+#include <stddef.h>
+#include <linux/filter.h>
+
+#define BPF_FILTER_MAX_INSTRUCTIONS     512
+#define BPF_FILTER_MAX_LABELS           512
+#define BPF_FILTER_ERROR_SIZE           256
+
+/**
+ * Prototypes of functions.
+ */
+int compileBpfFilter(const char* expression, unsigned int snapLength, struct sock_fprog* program, 
+        char* errorMessage, size_t n);
+int attachBpfFilter(int socketFileDescriptor, struct sock_fprog* program);
+void releaseBpfFilter(struct sock_fprog* program);
+
+#endif
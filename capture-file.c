@@ -0,0 +1,521 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capture-file.h"
+
+#define FALSE                           0
+#define TRUE                            1
+
+/**
+ * Block types and options of pcapng, see
+ * https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-02.html
+ */
+#define PCAPNG_SECTION_HEADER_BLOCK     0x0A0D0D0A
+#define PCAPNG_INTERFACE_DESCRIPTION    0x00000001
+#define PCAPNG_SIMPLE_PACKET_BLOCK      0x00000003
+#define PCAPNG_ENHANCED_PACKET_BLOCK    0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC         0x1A2B3C4D
+#define PCAPNG_OPTION_END               0
+#define PCAPNG_OPTION_IF_TSRESOL        9
+#define PCAPNG_SNAPLEN                  65535
+
+/**
+ * The size of the Section Header Block and the Interface Description Block
+ * at the beginning of each file.
+ */
+#define PCAPNG_FILE_HEADER_SIZE         60
+
+/**
+ * The size of fixed fields in an Enhanced Packet Block and a Simple Packet
+ * Block, including the leading and trailing block lengths.
+ */
+#define PCAPNG_PACKET_BLOCK_OVERHEAD    32
+#define PCAPNG_SIMPLE_PACKET_BLOCK_OVERHEAD 16
+
+/**
+ * Magic numbers and sizes of the classic pcap format, see
+ * https://wiki.wireshark.org/Development/LibpcapFileFormat
+ */
+#define PCAP_MAGIC_MICROSECONDS         0xA1B2C3D4
+#define PCAP_MAGIC_NANOSECONDS          0xA1B23C4D
+#define PCAP_FILE_HEADER_SIZE           24
+#define PCAP_PACKET_HEADER_SIZE         16
+
+/**
+ * Prototypes of functions.
+ */
+static int openCaptureFile(struct CaptureFileWriter* writer);
+static void formatCaptureFilePath(struct CaptureFileWriter* writer, char* filePath, size_t n);
+static void appendUint16(struct CaptureFileWriter* writer, uint16_t value);
+static void appendUint32(struct CaptureFileWriter* writer, uint32_t value);
+static int readInterfaceDescription(struct CaptureFileReader* reader, size_t offset, uint32_t blockLength);
+static uint16_t getUint16(struct CaptureFileReader* reader, size_t offset);
+static uint32_t getUint32(struct CaptureFileReader* reader, size_t offset);
+
+/**
+ * Open a pcapng file for writing.
+ *
+ * @param  writer     the writer to initialize
+ * @param  path       the path to the file
+ * @param  workerId   the id of the capture worker inserted into the name of file, -1 for none
+ * @param  rotateSize the size in bytes to rotate the file, 0 for never
+ * @return -1 if the file cannot be opened
+ */
+int openCaptureFileWriter(struct CaptureFileWriter* writer, const char* path, int workerId, unsigned long long rotateSize) {
+    memset(writer, 0, sizeof(struct CaptureFileWriter));
+    strncpy(writer->path, path, CAPTURE_FILE_MAX_PATH - 1);
+    writer->workerId = workerId;
+    writer->rotateSize = rotateSize;
+    writer->buffer = malloc(CAPTURE_FILE_BUFFER_SIZE);
+    if ( writer->buffer == NULL ) {
+        return -1;
+    }
+    return openCaptureFile(writer);
+}
+
+/**
+ * Append a packet to the capture file as an Enhanced Packet Block.
+ *
+ * @param  writer         the writer of the capture file
+ * @param  packet         the Ethernet frame
+ * @param  capturedLength the number of bytes captured
+ * @param  originalLength the length of the frame on the wire
+ * @param  timestamp      the time when the frame was captured
+ * @return -1 if the buffer cannot be written to the file
+ */
+int writeCapturedPacket(struct CaptureFileWriter* writer, const unsigned char* packet, 
+        unsigned int capturedLength, unsigned int originalLength, const struct timespec* timestamp) {
+    if ( capturedLength > PCAPNG_SNAPLEN ) {
+        capturedLength = PCAPNG_SNAPLEN;
+    }
+    size_t paddedLength = (capturedLength + 3) & ~3u;
+    size_t blockLength = PCAPNG_PACKET_BLOCK_OVERHEAD + paddedLength;
+
+    // Rotate the file before it grows beyond the limit, a file holds one packet at least
+    unsigned long long fileSize = writer->fileSize + writer->bufferedBytes;
+    if ( writer->rotateSize != 0 && fileSize > PCAPNG_FILE_HEADER_SIZE && fileSize + blockLength > writer->rotateSize ) {
+        if ( flushCaptureFileWriter(writer) == -1 ) {
+            return -1;
+        }
+        close(writer->fileDescriptor);
+        ++ writer->fileIndex;
+        if ( openCaptureFile(writer) == -1 ) {
+            return -1;
+        }
+    }
+    if ( writer->bufferedBytes + blockLength > CAPTURE_FILE_BUFFER_SIZE && flushCaptureFileWriter(writer) == -1 ) {
+        return -1;
+    }
+
+    // Timestamps are in nanoseconds, as declared by if_tsresol of the interface
+    uint64_t nanoseconds = (uint64_t) timestamp->tv_sec * 1000000000ull + timestamp->tv_nsec;
+    appendUint32(writer, PCAPNG_ENHANCED_PACKET_BLOCK);
+    appendUint32(writer, blockLength);
+    appendUint32(writer, 0);
+    appendUint32(writer, nanoseconds >> 32);
+    appendUint32(writer, nanoseconds & 0xFFFFFFFF);
+    appendUint32(writer, capturedLength);
+    appendUint32(writer, originalLength);
+    memcpy(writer->buffer + writer->bufferedBytes, packet, capturedLength);
+    memset(writer->buffer + writer->bufferedBytes + capturedLength, 0, paddedLength - capturedLength);
+    writer->bufferedBytes += paddedLength;
+    appendUint32(writer, blockLength);
+
+    // Flush periodically by the wall clock, so that the file is useful while capturing.
+    // The time of packets may be far from it, e.g. when a capture is replayed.
+    time_t currentTime = time(NULL);
+    if ( currentTime - writer->lastFlushTime >= CAPTURE_FILE_FLUSH_INTERVAL || currentTime < writer->lastFlushTime ) {
+        return flushCaptureFileWriter(writer);
+    }
+    return 0;
+}
+
+/**
+ * Write the buffered packets to the file.
+ *
+ * @param  writer the writer of the capture file
+ * @return -1 if the buffer cannot be written to the file
+ */
+int flushCaptureFileWriter(struct CaptureFileWriter* writer) {
+    size_t writtenBytes = 0;
+    while ( writtenBytes < writer->bufferedBytes ) {
+        ssize_t bytes = write(writer->fileDescriptor, writer->buffer + writtenBytes, writer->bufferedBytes - writtenBytes);
+        if ( bytes == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        writtenBytes += bytes;
+    }
+    writer->fileSize += writer->bufferedBytes;
+    writer->bufferedBytes = 0;
+    writer->lastFlushTime = time(NULL);
+
+    return 0;
+}
+
+/**
+ * Flush the buffered packets and close the capture file.
+ *
+ * @param writer the writer of the capture file
+ */
+void closeCaptureFileWriter(struct CaptureFileWriter* writer) {
+    if ( flushCaptureFileWriter(writer) == -1 ) {
+        fprintf(stderr, "[WARN] Unable to write to the capture file: %s.\n", strerror(errno));
+    }
+    close(writer->fileDescriptor);
+    free(writer->buffer);
+    writer->buffer = NULL;
+}
+
+/**
+ * Create the current capture file, and write the Section Header Block and
+ * the Interface Description Block into the buffer.
+ *
+ * @param  writer the writer of the capture file
+ * @return -1 if the file cannot be created
+ */
+static int openCaptureFile(struct CaptureFileWriter* writer) {
+    char filePath[CAPTURE_FILE_MAX_PATH] = {0};
+    formatCaptureFilePath(writer, filePath, sizeof(filePath));
+
+    writer->fileDescriptor = open(filePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ( writer->fileDescriptor == -1 ) {
+        fprintf(stderr, "[ERROR] Unable to create %s file: %s.\n", filePath, strerror(errno));
+        return -1;
+    }
+    writer->fileSize = 0;
+    writer->lastFlushTime = time(NULL);
+
+    // Section Header Block, the length of section is unspecified
+    appendUint32(writer, PCAPNG_SECTION_HEADER_BLOCK);
+    appendUint32(writer, 28);
+    appendUint32(writer, PCAPNG_BYTE_ORDER_MAGIC);
+    appendUint16(writer, 1);
+    appendUint16(writer, 0);
+    appendUint32(writer, 0xFFFFFFFF);
+    appendUint32(writer, 0xFFFFFFFF);
+    appendUint32(writer, 28);
+
+    // Interface Description Block, with timestamps in nanoseconds
+    appendUint32(writer, PCAPNG_INTERFACE_DESCRIPTION);
+    appendUint32(writer, 32);
+    appendUint16(writer, LINKTYPE_ETHERNET);
+    appendUint16(writer, 0);
+    appendUint32(writer, PCAPNG_SNAPLEN);
+    appendUint16(writer, PCAPNG_OPTION_IF_TSRESOL);
+    appendUint16(writer, 1);
+    appendUint32(writer, 9);
+    appendUint16(writer, PCAPNG_OPTION_END);
+    appendUint16(writer, 0);
+    appendUint32(writer, 32);
+
+    return 0;
+}
+
+/**
+ * Get the path to the current capture file.
+ * The id of worker and the index of file are inserted before the extension,
+ * e.g. "capture-1.2.pcapng" for the third file of the second worker.
+ *
+ * @param writer   the writer of the capture file
+ * @param filePath the buffer for the path
+ * @param n        the size of the buffer
+ */
+static void formatCaptureFilePath(struct CaptureFileWriter* writer, char* filePath, size_t n) {
+    const char* extension = strrchr(writer->path, '.');
+    const char* fileName = strrchr(writer->path, '/');
+    if ( extension == NULL || (fileName != NULL && extension < fileName) ) {
+        extension = writer->path + strlen(writer->path);
+    }
+    int baseLength = extension - writer->path;
+    int length = snprintf(filePath, n, "%.*s", baseLength, writer->path);
+
+    if ( writer->workerId >= 0 ) {
+        length += snprintf(filePath + length, n - length, "-%d", writer->workerId);
+    }
+    if ( writer->fileIndex > 0 ) {
+        length += snprintf(filePath + length, n - length, ".%d", writer->fileIndex);
+    }
+    snprintf(filePath + length, n - length, "%s", extension);
+}
+
+/**
+ * Append a 16-bit integer in host byte order to the buffer.
+ * The byte order of the section is told by the byte-order magic.
+ *
+ * @param writer the writer of the capture file
+ * @param value  the value to append
+ */
+static void appendUint16(struct CaptureFileWriter* writer, uint16_t value) {
+    memcpy(writer->buffer + writer->bufferedBytes, &value, sizeof(value));
+    writer->bufferedBytes += sizeof(value);
+}
+
+/**
+ * Append a 32-bit integer in host byte order to the buffer.
+ *
+ * @param writer the writer of the capture file
+ * @param value  the value to append
+ */
+static void appendUint32(struct CaptureFileWriter* writer, uint32_t value) {
+    memcpy(writer->buffer + writer->bufferedBytes, &value, sizeof(value));
+    writer->bufferedBytes += sizeof(value);
+}
+
+/**
+ * Map a pcap or pcapng file into the memory for reading.
+ *
+ * @param  reader the reader to initialize
+ * @param  path   the path to the file
+ * @return -1 if the file cannot be read, or isn't a capture of Ethernet frames
+ */
+int openCaptureFileReader(struct CaptureFileReader* reader, const char* path) {
+    memset(reader, 0, sizeof(struct CaptureFileReader));
+    reader->fileDescriptor = open(path, O_RDONLY);
+    if ( reader->fileDescriptor == -1 ) {
+        fprintf(stderr, "[ERROR] Unable to open %s file: %s.\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat fileStatus;
+    if ( fstat(reader->fileDescriptor, &fileStatus) == -1 || fileStatus.st_size < PCAP_FILE_HEADER_SIZE ) {
+        fprintf(stderr, "[ERROR] %s is not a capture file.\n", path);
+        close(reader->fileDescriptor);
+        return -1;
+    }
+
+    // The pages are populated up front, so that page faults don't disturb the replay
+    reader->mapSize = fileStatus.st_size;
+    reader->map = mmap(NULL, reader->mapSize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, reader->fileDescriptor, 0);
+    if ( reader->map == MAP_FAILED ) {
+        fprintf(stderr, "[ERROR] Unable to map %s file: %s.\n", path, strerror(errno));
+        close(reader->fileDescriptor);
+        return -1;
+    }
+    madvise((void*) reader->map, reader->mapSize, MADV_SEQUENTIAL);
+
+    uint32_t magic = 0;
+    memcpy(&magic, reader->map, sizeof(magic));
+    if ( magic == PCAPNG_SECTION_HEADER_BLOCK ) {
+        // The Section Header Block is parsed as the first block
+        reader->isPcapng = TRUE;
+        return 0;
+    }
+    if ( magic == PCAP_MAGIC_MICROSECONDS || magic == PCAP_MAGIC_NANOSECONDS ) {
+        reader->isByteSwapped = FALSE;
+    } else if ( __builtin_bswap32(magic) == PCAP_MAGIC_MICROSECONDS || __builtin_bswap32(magic) == PCAP_MAGIC_NANOSECONDS ) {
+        reader->isByteSwapped = TRUE;
+        magic = __builtin_bswap32(magic);
+    } else {
+        fprintf(stderr, "[ERROR] %s is not a capture file.\n", path);
+        closeCaptureFileReader(reader);
+        return -1;
+    }
+    if ( getUint32(reader, 20) != LINKTYPE_ETHERNET ) {
+        fprintf(stderr, "[ERROR] Unsupported link type %u of %s file.\n", getUint32(reader, 20), path);
+        closeCaptureFileReader(reader);
+        return -1;
+    }
+    reader->timestampUnitsPerSecond[0] = magic == PCAP_MAGIC_NANOSECONDS ? 1000000000ull : 1000000ull;
+    reader->numberOfInterfaces = 1;
+    reader->offset = PCAP_FILE_HEADER_SIZE;
+
+    return 0;
+}
+
+/**
+ * Read the next packet of the capture file.
+ *
+ * @param  reader         the reader of the capture file
+ * @param  packet         the Ethernet frame, pointing into the mapped file
+ * @param  capturedLength the number of bytes captured
+ * @param  originalLength the length of the frame on the wire
+ * @param  timestamp      the time when the frame was captured
+ * @return 1 if a packet is read, 0 at the end of the file, or -1 if the file is corrupted
+ */
+int readCapturedPacket(struct CaptureFileReader* reader, const unsigned char** packet, 
+        unsigned int* capturedLength, unsigned int* originalLength, struct timespec* timestamp) {
+    if ( !reader->isPcapng ) {
+        if ( reader->offset == reader->mapSize ) {
+            return 0;
+        }
+        if ( reader->mapSize - reader->offset < PCAP_PACKET_HEADER_SIZE ) {
+            fprintf(stderr, "[ERROR] The capture file is truncated.\n");
+            return -1;
+        }
+        uint32_t seconds = getUint32(reader, reader->offset);
+        uint32_t fraction = getUint32(reader, reader->offset + 4);
+        *capturedLength = getUint32(reader, reader->offset + 8);
+        *originalLength = getUint32(reader, reader->offset + 12);
+        if ( *capturedLength > reader->mapSize - reader->offset - PCAP_PACKET_HEADER_SIZE ) {
+            fprintf(stderr, "[ERROR] The capture file is truncated.\n");
+            return -1;
+        }
+        *packet = reader->map + reader->offset + PCAP_PACKET_HEADER_SIZE;
+        timestamp->tv_sec = seconds;
+        timestamp->tv_nsec = reader->timestampUnitsPerSecond[0] == 1000000ull ? fraction * 1000 : fraction;
+        reader->offset += PCAP_PACKET_HEADER_SIZE + *capturedLength;
+        return 1;
+    }
+
+    // Blocks other than packets and interfaces are skipped
+    while ( reader->offset != reader->mapSize ) {
+        if ( reader->mapSize - reader->offset < 12 ) {
+            fprintf(stderr, "[ERROR] The capture file is truncated.\n");
+            return -1;
+        }
+        size_t offset = reader->offset;
+        uint32_t blockType = 0;
+        memcpy(&blockType, reader->map + offset, sizeof(blockType));
+
+        // A new section may change the byte order, and starts with no interfaces
+        if ( blockType == PCAPNG_SECTION_HEADER_BLOCK ) {
+            uint32_t byteOrderMagic = 0;
+            memcpy(&byteOrderMagic, reader->map + offset + 8, sizeof(byteOrderMagic));
+            if ( byteOrderMagic != PCAPNG_BYTE_ORDER_MAGIC && __builtin_bswap32(byteOrderMagic) != PCAPNG_BYTE_ORDER_MAGIC ) {
+                fprintf(stderr, "[ERROR] The capture file is corrupted.\n");
+                return -1;
+            }
+            reader->isByteSwapped = byteOrderMagic != PCAPNG_BYTE_ORDER_MAGIC;
+            reader->numberOfInterfaces = 0;
+        }
+        blockType = getUint32(reader, offset);
+        uint32_t blockLength = getUint32(reader, offset + 4);
+        if ( blockLength < 12 || blockLength % 4 != 0 || blockLength > reader->mapSize - offset ) {
+            fprintf(stderr, "[ERROR] The capture file is truncated or corrupted.\n");
+            return -1;
+        }
+        reader->offset += blockLength;
+
+        if ( blockType == PCAPNG_INTERFACE_DESCRIPTION ) {
+            if ( readInterfaceDescription(reader, offset, blockLength) == -1 ) {
+                return -1;
+            }
+        } else if ( blockType == PCAPNG_ENHANCED_PACKET_BLOCK ) {
+            if ( blockLength < PCAPNG_PACKET_BLOCK_OVERHEAD ) {
+                fprintf(stderr, "[ERROR] The capture file is corrupted.\n");
+                return -1;
+            }
+            uint32_t interfaceId = getUint32(reader, offset + 8);
+            uint64_t units = (uint64_t) getUint32(reader, offset + 12) << 32 | getUint32(reader, offset + 16);
+            *capturedLength = getUint32(reader, offset + 20);
+            *originalLength = getUint32(reader, offset + 24);
+            if ( interfaceId >= reader->numberOfInterfaces || *capturedLength > blockLength - PCAPNG_PACKET_BLOCK_OVERHEAD ) {
+                fprintf(stderr, "[ERROR] The capture file is corrupted.\n");
+                return -1;
+            }
+            uint64_t unitsPerSecond = reader->timestampUnitsPerSecond[interfaceId];
+            *packet = reader->map + offset + 28;
+            timestamp->tv_sec = units / unitsPerSecond;
+            timestamp->tv_nsec = (double) (units % unitsPerSecond) * 1e9 / unitsPerSecond;
+            return 1;
+        } else if ( blockType == PCAPNG_SIMPLE_PACKET_BLOCK ) {
+            // Simple Packet Blocks carry no timestamp
+            if ( blockLength < PCAPNG_SIMPLE_PACKET_BLOCK_OVERHEAD ) {
+                fprintf(stderr, "[ERROR] The capture file is corrupted.\n");
+                return -1;
+            }
+            *originalLength = getUint32(reader, offset + 8);
+            *capturedLength = *originalLength < blockLength - PCAPNG_SIMPLE_PACKET_BLOCK_OVERHEAD ? 
+                *originalLength : blockLength - PCAPNG_SIMPLE_PACKET_BLOCK_OVERHEAD;
+            *packet = reader->map + offset + 12;
+            timestamp->tv_sec = 0;
+            timestamp->tv_nsec = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Unmap and close the capture file.
+ *
+ * @param reader the reader of the capture file
+ */
+void closeCaptureFileReader(struct CaptureFileReader* reader) {
+    munmap((void*) reader->map, reader->mapSize);
+    close(reader->fileDescriptor);
+}
+
+/**
+ * Parse an Interface Description Block, only Ethernet is supported.
+ *
+ * @param  reader      the reader of the capture file
+ * @param  offset      the offset of the block in the file
+ * @param  blockLength the length of the block
+ * @return -1 if the interface isn't Ethernet
+ */
+static int readInterfaceDescription(struct CaptureFileReader* reader, size_t offset, uint32_t blockLength) {
+    if ( blockLength < 20 || reader->numberOfInterfaces == CAPTURE_FILE_MAX_INTERFACES ) {
+        fprintf(stderr, "[ERROR] The capture file has too many interfaces or is corrupted.\n");
+        return -1;
+    }
+    uint16_t linkType = getUint16(reader, offset + 8);
+    if ( linkType != LINKTYPE_ETHERNET ) {
+        fprintf(stderr, "[ERROR] Unsupported link type %u of the capture file.\n", linkType);
+        return -1;
+    }
+
+    // Timestamps are in microseconds unless if_tsresol tells otherwise
+    uint64_t unitsPerSecond = 1000000ull;
+    size_t optionOffset = offset + 16;
+    size_t optionsEnd = offset + blockLength - 4;
+    while ( optionOffset + 4 <= optionsEnd ) {
+        uint16_t optionCode = getUint16(reader, optionOffset);
+        uint16_t optionLength = getUint16(reader, optionOffset + 2);
+        if ( optionCode == PCAPNG_OPTION_END ) {
+            break;
+        }
+        if ( optionCode == PCAPNG_OPTION_IF_TSRESOL && optionLength >= 1 && optionOffset + 5 <= optionsEnd ) {
+            uint8_t resolution = reader->map[optionOffset + 4];
+            int exponent = resolution & 0x7F;
+            int isBinary = (resolution & 0x80) != 0;
+
+            // The units must fit in 64 bits, otherwise the default is kept
+            if ( exponent <= (isBinary ? 63 : 19) ) {
+                unitsPerSecond = 1;
+                while ( exponent -- > 0 ) {
+                    unitsPerSecond *= isBinary ? 2 : 10;
+                }
+            }
+        }
+        optionOffset += 4 + ((optionLength + 3) & ~3u);
+    }
+    reader->timestampUnitsPerSecond[reader->numberOfInterfaces ++] = unitsPerSecond;
+    return 0;
+}
+
+/**
+ * Get a 16-bit integer in the byte order of the capture file.
+ *
+ * @param  reader the reader of the capture file
+ * @param  offset the offset of the integer in the file
+ * @return the integer in host byte order
+ */
+static uint16_t getUint16(struct CaptureFileReader* reader, size_t offset) {
+    uint16_t value = 0;
+    memcpy(&value, reader->map + offset, sizeof(value));
+    return reader->isByteSwapped ? __builtin_bswap16(value) : value;
+}
+
+/**
+ * Get a 32-bit integer in the byte order of the capture file.
+ *
+ * @param  reader the reader of the capture file
+ * @param  offset the offset of the integer in the file
+ * @return the integer in host byte order
+ */
+static uint32_t getUint32(struct CaptureFileReader* reader, size_t offset) {
+    uint32_t value = 0;
+    memcpy(&value, reader->map + offset, sizeof(value));
+    return reader->isByteSwapped ? __builtin_bswap32(value) : value;
+}
@@ -0,0 +1,65 @@
+#ifndef CAPTURE_FILE_H
+#define CAPTURE_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define CAPTURE_FILE_BUFFER_SIZE    (4 * 1024 * 1024)
+#define CAPTURE_FILE_FLUSH_INTERVAL 1       // in seconds
+#define CAPTURE_FILE_MAX_PATH       4096
+#define CAPTURE_FILE_MAX_INTERFACES 16
+
+/**
+ * Link type of Ethernet frames, see http://www.tcpdump.org/linktypes.html.
+ */
+#define LINKTYPE_ETHERNET           1
+
+/**
+ * A writer of pcapng files.
+ * Packets are collected in a large buffer, which is written to the file
+ * when it's full or every CAPTURE_FILE_FLUSH_INTERVAL seconds. The file is
+ * rotated to a new one once it grows beyond rotateSize.
+ */
+struct CaptureFileWriter {
+    int fileDescriptor;
+    char path[CAPTURE_FILE_MAX_PATH];
+    int workerId;
+    int fileIndex;
+    unsigned long long fileSize;
+    unsigned long long rotateSize;
+    unsigned char* buffer;
+    size_t bufferedBytes;
+    time_t lastFlushTime;
+};
+
+/**
+ * A reader of pcap and pcapng files.
+ * The file is mapped into the memory, and packets are returned in place
+ * without being copied.
+ */
+struct CaptureFileReader {
+    int fileDescriptor;
+    const unsigned char* map;
+    size_t mapSize;
+    size_t offset;
+    int isPcapng;
+    int isByteSwapped;
+    uint64_t timestampUnitsPerSecond[CAPTURE_FILE_MAX_INTERFACES];
+    uint32_t numberOfInterfaces;
+};
+
+/**
+ * Prototypes of functions.
+ */
+int openCaptureFileWriter(struct CaptureFileWriter* writer, const char* path, int workerId, unsigned long long rotateSize);
+int writeCapturedPacket(struct CaptureFileWriter* writer, const unsigned char* packet, 
+        unsigned int capturedLength, unsigned int originalLength, const struct timespec* timestamp);
+int flushCaptureFileWriter(struct CaptureFileWriter* writer);
+void closeCaptureFileWriter(struct CaptureFileWriter* writer);
+int openCaptureFileReader(struct CaptureFileReader* reader, const char* path);
+int readCapturedPacket(struct CaptureFileReader* reader, const unsigned char** packet, 
+        unsigned int* capturedLength, unsigned int* originalLength, struct timespec* timestamp);
+void closeCaptureFileReader(struct CaptureFileReader* reader);
+
+#endif
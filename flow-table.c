@@ -0,0 +1,311 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flow-table.h"
+
+#define FALSE                   0
+#define TRUE                    1
+
+/**
+ * Criteria of ranking flows.
+ */
+#define RANK_BY_BYTES           0
+#define RANK_BY_PACKETS         1
+
+/**
+ * Prototypes of functions.
+ */
+static uint32_t getFlowHash(const struct FlowKey* key);
+static void removeFlowEntry(struct FlowTable* table, uint32_t index);
+static void findTopFlows(struct FlowTable* table, int rankBy, struct FlowEntry** topFlows, int n);
+static void printFlowEntry(struct FlowEntry* entry, int rank, FILE* outputFile);
+
+/**
+ * Allocate the memory of the flow table.
+ *
+ * @param  table       the flow table
+ * @param  capacity    the number of slots, rounded up to a power of 2 of at most FLOW_TABLE_MAX_CAPACITY
+ * @param  idleTimeout the time in nanoseconds before an idle flow is aged out
+ * @return -1 if the memory cannot be allocated
+ */
+int createFlowTable(struct FlowTable* table, uint32_t capacity, uint64_t idleTimeout) {
+    memset(table, 0, sizeof(struct FlowTable));
+
+    table->capacity = 1;
+    while ( table->capacity < capacity && table->capacity < FLOW_TABLE_MAX_CAPACITY ) {
+        table->capacity <<= 1;
+    }
+    table->idleTimeout = idleTimeout;
+    table->entries = calloc(table->capacity, sizeof(struct FlowEntry));
+
+    return table->entries == NULL ? -1 : 0;
+}
+
+/**
+ * Release the memory of the flow table.
+ *
+ * @param table the flow table
+ */
+void destroyFlowTable(struct FlowTable* table) {
+    free(table->entries);
+    table->entries = NULL;
+}
+
+/**
+ * Get the 5-tuple of a decoded IPv4 packet.
+ *
+ * @param  packet the decoded packet
+ * @param  key    the 5-tuple of the flow
+ * @return -1 if the packet doesn't carry IPv4
+ */
+int extractFlowKey(const struct DecodedPacket* packet, struct FlowKey* key) {
+    if ( packet->ipVersion != 4 ) {
+        return -1;
+    }
+    uint32_t sourceAddress = 0, destinationAddress = 0;
+    memcpy(&sourceAddress, packet->sourceAddress, sizeof(sourceAddress));
+    memcpy(&destinationAddress, packet->destinationAddress, sizeof(destinationAddress));
+
+    memset(key, 0, sizeof(struct FlowKey));
+    key->sourceAddress = ntohl(sourceAddress);
+    key->destinationAddress = ntohl(destinationAddress);
+    key->sourcePort = packet->sourcePort;
+    key->destinationPort = packet->destinationPort;
+    key->protocol = packet->protocol;
+
+    return 0;
+}
+
+/**
+ * Account a packet to its flow, the flow is created if it's new.
+ *
+ * @param  table     the flow table
+ * @param  key       the 5-tuple of the flow
+ * @param  tcpFlags  the flags of the TCP segment
+ * @param  bytes     the length of the packet
+ * @param  timestamp the time when the packet was captured in nanoseconds
+ * @return the number of packets of the flow including this one, 0 if the flow isn't tracked
+ */
+uint64_t updateFlowTable(struct FlowTable* table, const struct FlowKey* key, uint8_t tcpFlags, uint32_t bytes, uint64_t timestamp) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = getFlowHash(key) & mask;
+
+    while ( table->entries[index].isInUse ) {
+        struct FlowEntry* entry = &table->entries[index];
+        if ( memcmp(&entry->key, key, sizeof(struct FlowKey)) == 0 ) {
+            ++ entry->packets;
+            entry->bytes += bytes;
+            entry->lastSeen = timestamp;
+            entry->tcpFlags |= tcpFlags;
+            return entry->packets;
+        }
+        index = (index + 1) & mask;
+    }
+
+    // The memory is never grown, idle flows are aged out to make room. Aging out
+    // scans the whole table, so it's done at most once per timeout, otherwise
+    // every packet of a flood of new flows would scan it.
+    if ( table->numberOfFlows + 1 > table->capacity * FLOW_TABLE_MAX_LOAD_FACTOR ) {
+        if ( timestamp < table->lastExpireTime ) {
+            // The clock stepped backwards, wait for a whole timeout from now
+            table->lastExpireTime = timestamp;
+        } else if ( timestamp - table->lastExpireTime >= table->idleTimeout ) {
+            expireFlows(table, timestamp);
+        }
+        if ( table->numberOfFlows + 1 > table->capacity * FLOW_TABLE_MAX_LOAD_FACTOR ) {
+            ++ table->untrackedPackets;
+            return 0;
+        }
+        // Entries may have been shifted, so the free slot is searched again
+        index = getFlowHash(key) & mask;
+        while ( table->entries[index].isInUse ) {
+            index = (index + 1) & mask;
+        }
+    }
+
+    struct FlowEntry* entry = &table->entries[index];
+    memset(entry, 0, sizeof(struct FlowEntry));
+    entry->key = *key;
+    entry->packets = 1;
+    entry->bytes = bytes;
+    entry->firstSeen = timestamp;
+    entry->lastSeen = timestamp;
+    entry->tcpFlags = tcpFlags;
+    entry->isInUse = TRUE;
+    ++ table->numberOfFlows;
+
+    return 1;
+}
+
+/**
+ * Remove the flows idle for longer than the timeout. Flows seen after the
+ * current time, i.e. before the clock stepped backwards, are kept.
+ *
+ * @param table       the flow table
+ * @param currentTime the current time in nanoseconds
+ */
+void expireFlows(struct FlowTable* table, uint64_t currentTime) {
+    uint32_t i = 0;
+    for ( i = 0; i < table->capacity; ++ i ) {
+        // The slot is checked again after removing, since another entry may be shifted into it
+        while ( table->entries[i].isInUse && table->entries[i].lastSeen < currentTime && 
+                currentTime - table->entries[i].lastSeen > table->idleTimeout ) {
+            removeFlowEntry(table, i);
+            ++ table->expiredFlows;
+        }
+    }
+    table->lastExpireTime = currentTime;
+}
+
+/**
+ * Print the top flows ranked by bytes and by packets.
+ *
+ * @param table      the flow table
+ * @param n          the number of flows to print for each ranking
+ * @param outputFile the file to print to
+ */
+void reportTopFlows(struct FlowTable* table, int n, FILE* outputFile) {
+    struct FlowEntry* topFlows[FLOW_TABLE_MAX_TOP_FLOWS];
+    if ( n > FLOW_TABLE_MAX_TOP_FLOWS ) {
+        n = FLOW_TABLE_MAX_TOP_FLOWS;
+    }
+
+    fprintf(outputFile, "Flows Stat: Active : %u   Expired : %llu   Untracked Packets : %llu\n", 
+        table->numberOfFlows, (unsigned long long) table->expiredFlows, (unsigned long long) table->untrackedPackets);
+
+    int rankBy = 0, i = 0;
+    for ( rankBy = RANK_BY_BYTES; rankBy <= RANK_BY_PACKETS; ++ rankBy ) {
+        fprintf(outputFile, "   Top %d Flows by %s\n", n, rankBy == RANK_BY_BYTES ? "Bytes" : "Packets");
+        findTopFlows(table, rankBy, topFlows, n);
+
+        for ( i = 0; i < n && topFlows[i] != NULL; ++ i ) {
+            printFlowEntry(topFlows[i], i + 1, outputFile);
+        }
+    }
+    fflush(outputFile);
+}
+
+/**
+ * Hash the 5-tuple.
+ *
+ * @param  key the 5-tuple of the flow
+ * @return the hash of the flow
+ */
+static uint32_t getFlowHash(const struct FlowKey* key) {
+    uint64_t hash = ((uint64_t) key->sourceAddress << 32 | key->destinationAddress) * 0x9E3779B97F4A7C15ull;
+    hash ^= ((uint64_t) key->sourcePort << 24 | (uint64_t) key->destinationPort << 8 | key->protocol) + (hash >> 29);
+    hash *= 0xBF58476D1CE4E5B9ull;
+
+    return (uint32_t) (hash >> 32);
+}
+
+/**
+ * Remove an entry, and shift the following entries of the probe sequence
+ * backward, so that no tombstone is needed.
+ *
+ * @param table the flow table
+ * @param index the index of the entry to remove
+ */
+static void removeFlowEntry(struct FlowTable* table, uint32_t index) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t emptyIndex = index;
+    uint32_t i = (index + 1) & mask;
+
+    while ( table->entries[i].isInUse ) {
+        uint32_t homeIndex = getFlowHash(&table->entries[i].key) & mask;
+
+        // The entry can fill the hole if its home slot isn't between the hole and itself
+        if ( ((i - homeIndex) & mask) >= ((i - emptyIndex) & mask) ) {
+            table->entries[emptyIndex] = table->entries[i];
+            emptyIndex = i;
+        }
+        i = (i + 1) & mask;
+    }
+    table->entries[emptyIndex].isInUse = FALSE;
+    -- table->numberOfFlows;
+}
+
+/**
+ * Find the top n flows.
+ *
+ * @param table    the flow table
+ * @param rankBy   RANK_BY_BYTES or RANK_BY_PACKETS
+ * @param topFlows the top flows in descending order, padded with NULL
+ * @param n        the number of flows to find
+ */
+static void findTopFlows(struct FlowTable* table, int rankBy, struct FlowEntry** topFlows, int n) {
+    int numberOfTopFlows = 0;
+    uint32_t i = 0;
+    int j = 0;
+
+    for ( i = 0; i < table->capacity; ++ i ) {
+        struct FlowEntry* entry = &table->entries[i];
+        if ( !entry->isInUse ) {
+            continue;
+        }
+        uint64_t value = rankBy == RANK_BY_BYTES ? entry->bytes : entry->packets;
+
+        // Insert the entry into the sorted list if it ranks in the top n
+        if ( numberOfTopFlows == n ) {
+            struct FlowEntry* lastEntry = topFlows[n - 1];
+            if ( value <= (rankBy == RANK_BY_BYTES ? lastEntry->bytes : lastEntry->packets) ) {
+                continue;
+            }
+            -- numberOfTopFlows;
+        }
+        for ( j = numberOfTopFlows; j > 0; -- j ) {
+            struct FlowEntry* previousEntry = topFlows[j - 1];
+            if ( value <= (rankBy == RANK_BY_BYTES ? previousEntry->bytes : previousEntry->packets) ) {
+                break;
+            }
+            topFlows[j] = previousEntry;
+        }
+        topFlows[j] = entry;
+        ++ numberOfTopFlows;
+    }
+    for ( j = numberOfTopFlows; j < n; ++ j ) {
+        topFlows[j] = NULL;
+    }
+}
+
+/**
+ * Print a flow on one line.
+ *
+ * @param entry      the flow
+ * @param rank       the rank of the flow
+ * @param outputFile the file to print to
+ */
+static void printFlowEntry(struct FlowEntry* entry, int rank, FILE* outputFile) {
+    char sourceAddress[INET_ADDRSTRLEN] = {0}, destinationAddress[INET_ADDRSTRLEN] = {0};
+    uint32_t address = htonl(entry->key.sourceAddress);
+    inet_ntop(AF_INET, &address, sourceAddress, sizeof(sourceAddress));
+    address = htonl(entry->key.destinationAddress);
+    inet_ntop(AF_INET, &address, destinationAddress, sizeof(destinationAddress));
+
+    const char* protocol = "IP";
+    switch ( entry->key.protocol ) {
+        case IPPROTO_TCP:  protocol = "TCP";  break;
+        case IPPROTO_UDP:  protocol = "UDP";  break;
+        case IPPROTO_ICMP: protocol = "ICMP"; break;
+        case IPPROTO_IGMP: protocol = "IGMP"; break;
+    }
+
+    // TCP flags in the order of the header: C E U A P R S F
+    char flags[9] = {0};
+    const char* flagNames = "CEUAPRSF";
+    int i = 0;
+    for ( i = 0; i < 8; ++ i ) {
+        flags[i] = (entry->tcpFlags & (0x80 >> i)) ? flagNames[i] : '.';
+    }
+
+    fprintf(outputFile, "   |-#%-3d %-4s %15s:%-5u -> %15s:%-5u  Packets : %-10llu  Bytes : %-12llu  Duration : %.3f s", 
+        rank, protocol, sourceAddress, entry->key.sourcePort, destinationAddress, entry->key.destinationPort, 
+        (unsigned long long) entry->packets, (unsigned long long) entry->bytes, 
+        (entry->lastSeen - entry->firstSeen) / 1e9);
+    if ( entry->key.protocol == IPPROTO_TCP ) {
+        fprintf(outputFile, "  Flags : %s", flags);
+    }
+    fprintf(outputFile, "\n");
+}
@@ -0,0 +1,64 @@
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "packet-decoder.h"
+
+#define FLOW_TABLE_MAX_LOAD_FACTOR  0.75
+#define FLOW_TABLE_MAX_TOP_FLOWS    100
+#define FLOW_TABLE_MAX_CAPACITY     (1U << 31)
+
+/**
+ * The 5-tuple of a flow, all fields in host byte order.
+ */
+struct FlowKey {
+    uint32_t sourceAddress;
+    uint32_t destinationAddress;
+    uint16_t sourcePort;
+    uint16_t destinationPort;
+    uint8_t protocol;
+    uint8_t padding[3];
+};
+
+/**
+ * A slot of the flow table, one cache line each.
+ */
+struct FlowEntry {
+    struct FlowKey key;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t firstSeen;         // in nanoseconds
+    uint64_t lastSeen;          // in nanoseconds
+    uint8_t tcpFlags;           // all TCP flags seen in the flow
+    uint8_t isInUse;
+    uint8_t padding[14];
+};
+
+/**
+ * An open-addressing hash table of flows with linear probing.
+ * The memory is allocated once, flows idle for longer than the timeout are
+ * aged out, and packets of new flows are only counted when the table is full.
+ */
+struct FlowTable {
+    struct FlowEntry* entries;
+    uint32_t capacity;          // a power of 2
+    uint32_t numberOfFlows;
+    uint64_t idleTimeout;       // in nanoseconds
+    uint64_t lastExpireTime;    // in nanoseconds
+    uint64_t untrackedPackets;
+    uint64_t expiredFlows;
+};
+
+/**
+ * Prototypes of functions.
+ */
+int createFlowTable(struct FlowTable* table, uint32_t capacity, uint64_t idleTimeout);
+void destroyFlowTable(struct FlowTable* table);
+int extractFlowKey(const struct DecodedPacket* packet, struct FlowKey* key);
+uint64_t updateFlowTable(struct FlowTable* table, const struct FlowKey* key, uint8_t tcpFlags, uint32_t bytes, uint64_t timestamp);
+void expireFlows(struct FlowTable* table, uint64_t currentTime);
+void reportTopFlows(struct FlowTable* table, int n, FILE* outputFile);
+
+#endif
@@ -0,0 +1,384 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/if_ether.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "packet-decoder.h"
+#include "packet-printer.h"
+#include "server-core.h"
+
+#define FALSE                   0
+#define TRUE                    1
+#define NANOSECONDS_PER_SECOND  1000000000ull
+#define MIN_RUN_TIME            (20 * 1000000ull)   // in nanoseconds, for each repetition
+#define NUMBER_OF_REPETITIONS   5
+#define MAX_FRAME_SIZE          9018                // a jumbo frame with a VLAN tag
+
+/**
+ * A kernel to time, called with its context for each operation.
+ */
+typedef void (*BenchmarkKernel)(void* context);
+
+/**
+ * The context of string kernels.
+ */
+struct StringContext {
+    char* input;
+    char* output;
+};
+
+/**
+ * The context of packet kernels.
+ */
+struct PacketContext {
+    unsigned char* frame;
+    uint32_t frameSize;
+    struct DecodedPacket decodedPacket;
+    struct PacketStatistics statistics;
+    FILE* logFile;
+};
+
+/**
+ * The context of the file stream kernel.
+ */
+struct FileStreamContext {
+    int socketFileDescriptor;
+    char* filePath;
+    char outputBuffer[SERVER_BUFFER_SIZE];
+};
+
+/**
+ * Prototypes of functions.
+ */
+int isKernelSelected(const char* name, const char* filter);
+uint64_t getMonotonicTime();
+double timeKernel(BenchmarkKernel kernel, void* context);
+void printResult(const char* name, int size, double nanoseconds);
+void benchmarkToUppercaseString(const char* filter);
+void benchmarkPacketKernels(const char* filter);
+void benchmarkFileStream(const char* filter);
+void runToUppercaseString(void* context);
+void runDecodePacket(void* context);
+void runParseDataPacket(void* context);
+void runParseDataPacketHeaders(void* context);
+void runParseDataPayload(void* context);
+void runSendFileStream(void* context);
+int buildUdpFrame(unsigned char* frame, int frameSize);
+void* drainSocket(void* argument);
+
+/**
+ * The entrance of the microbenchmarks.
+ *
+ * Each kernel is timed across payload sizes, and the best of several
+ * repetitions is reported, so runs are comparable between build profiles.
+ *
+ * @param  argc the number of arguments
+ * @param  argv a pointer to a char array that stores arguments
+ * @return 0 if the application exited normally
+ */
+int main(int argc, char* argv[]) {
+    if ( argc > 2 ) {
+        fprintf(stderr, "Usage: %s [Kernel]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char* filter = argc == 2 ? argv[1] : NULL;
+
+    printf("%-28s %8s %12s %10s\n", "Kernel", "Size", "ns/op", "MB/s");
+    benchmarkToUppercaseString(filter);
+    benchmarkPacketKernels(filter);
+    benchmarkFileStream(filter);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Check whether a kernel is selected to run.
+ *
+ * @param  name   the name of the kernel
+ * @param  filter the name given on the command line, NULL for all kernels
+ * @return whether the kernel is selected
+ */
+int isKernelSelected(const char* name, const char* filter) {
+    return filter == NULL || strcmp(name, filter) == 0;
+}
+
+/**
+ * Get the time of the monotonic clock.
+ *
+ * @return the time in nanoseconds
+ */
+uint64_t getMonotonicTime() {
+    struct timespec currentTime;
+    clock_gettime(CLOCK_MONOTONIC, &currentTime);
+
+    return currentTime.tv_sec * NANOSECONDS_PER_SECOND + currentTime.tv_nsec;
+}
+
+/**
+ * Time a kernel. The number of operations is doubled until a run takes
+ * MIN_RUN_TIME, then the run is repeated and the fastest one is kept.
+ *
+ * @param  kernel  the kernel to time
+ * @param  context the context of the kernel
+ * @return the time of an operation in nanoseconds
+ */
+double timeKernel(BenchmarkKernel kernel, void* context) {
+    uint64_t numberOfOperations = 1;
+    uint64_t elapsedTime = 0;
+    uint64_t i = 0;
+
+    // Warm up and calibrate
+    do {
+        numberOfOperations *= 2;
+        uint64_t startTime = getMonotonicTime();
+        for ( i = 0; i < numberOfOperations; ++ i ) {
+            kernel(context);
+        }
+        elapsedTime = getMonotonicTime() - startTime;
+    } while ( elapsedTime < MIN_RUN_TIME );
+
+    double bestTime = (double) elapsedTime / numberOfOperations;
+    int j = 0;
+    for ( j = 0; j < NUMBER_OF_REPETITIONS; ++ j ) {
+        uint64_t startTime = getMonotonicTime();
+        for ( i = 0; i < numberOfOperations; ++ i ) {
+            kernel(context);
+        }
+        double time = (double) (getMonotonicTime() - startTime) / numberOfOperations;
+        if ( time < bestTime ) {
+            bestTime = time;
+        }
+    }
+    return bestTime;
+}
+
+/**
+ * Print the time of a kernel, and the throughput of the payload.
+ *
+ * @param name        the name of the kernel
+ * @param size        the size of the payload in bytes
+ * @param nanoseconds the time of an operation in nanoseconds
+ */
+void printResult(const char* name, int size, double nanoseconds) {
+    printf("%-28s %8d %12.1f %10.1f\n", name, size, nanoseconds, size / nanoseconds * 1000);
+    fflush(stdout);
+}
+
+/**
+ * Time toUppercaseString on messages up to the size of the server buffer.
+ *
+ * @param filter the name of the kernel to run, NULL for all kernels
+ */
+void benchmarkToUppercaseString(const char* filter) {
+    static const int sizes[] = {16, 64, 256, SERVER_BUFFER_SIZE - 1};
+    if ( !isKernelSelected("toUppercaseString", filter) ) {
+        return;
+    }
+    char input[SERVER_BUFFER_SIZE];
+    char output[SERVER_BUFFER_SIZE];
+    struct StringContext context = {input, output};
+
+    int i = 0, j = 0;
+    for ( i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++ i ) {
+        // Mixed case text with punctuation, like the messages of clients
+        for ( j = 0; j < sizes[i]; ++ j ) {
+            input[j] = "Hello, World! 0123"[j % 18];
+        }
+        input[sizes[i]] = 0;
+        printResult("toUppercaseString", sizes[i], timeKernel(runToUppercaseString, &context));
+    }
+}
+
+/**
+ * Time decoding, parsing and hex dumps of UDP frames, from the minimum
+ * Ethernet frame to a jumbo frame. Logs are written to /dev/null, so only
+ * the formatting is timed.
+ *
+ * @param filter the name of the kernel to run, NULL for all kernels
+ */
+void benchmarkPacketKernels(const char* filter) {
+    static const int sizes[] = {64, 512, 1514, 9014};
+    struct PacketContext context;
+    memset(&context, 0, sizeof(context));
+
+    context.logFile = fopen("/dev/null", "w");
+    context.frame = malloc(MAX_FRAME_SIZE);
+    if ( context.logFile == NULL || context.frame == NULL ) {
+        fprintf(stderr, "[ERROR] Failed to set up packet kernels: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    int i = 0;
+    for ( i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++ i ) {
+        context.frameSize = buildUdpFrame(context.frame, sizes[i]);
+        decodePacket(context.frame, context.frameSize, &context.decodedPacket);
+
+        if ( isKernelSelected("decodePacket", filter) ) {
+            printResult("decodePacket", sizes[i], timeKernel(runDecodePacket, &context));
+        }
+        if ( isKernelSelected("parseDataPacket", filter) ) {
+            printResult("parseDataPacket", sizes[i], timeKernel(runParseDataPacket, &context));
+            printResult("parseDataPacket (headers)", sizes[i], timeKernel(runParseDataPacketHeaders, &context));
+        }
+        if ( isKernelSelected("parseDataPayload", filter) ) {
+            printResult("parseDataPayload", sizes[i], timeKernel(runParseDataPayload, &context));
+        }
+    }
+    free(context.frame);
+    fclose(context.logFile);
+}
+
+/**
+ * Time sendFileStream, i.e. the loop of GET requests, on files of several
+ * sizes. The stream is sent over a Unix socket drained by another thread.
+ * The server logs each file to stderr, which is sent to /dev/null meanwhile.
+ *
+ * @param filter the name of the kernel to run, NULL for all kernels
+ */
+void benchmarkFileStream(const char* filter) {
+    static const int sizes[] = {4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+    if ( !isKernelSelected("sendFileStream", filter) ) {
+        return;
+    }
+    struct FileStreamContext context;
+    char filePath[] = "/tmp/microbench-XXXXXX";
+    int socketFileDescriptors[2];
+    pthread_t drainThread;
+
+    int fileDescriptor = mkstemp(filePath);
+    if ( fileDescriptor == -1 || socketpair(AF_UNIX, SOCK_STREAM, 0, socketFileDescriptors) == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to set up the file stream: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    context.socketFileDescriptor = socketFileDescriptors[0];
+    context.filePath = filePath;
+    pthread_create(&drainThread, NULL, drainSocket, &socketFileDescriptors[1]);
+
+    int standardError = dup(STDERR_FILENO);
+    int nullFileDescriptor = open("/dev/null", O_WRONLY);
+
+    char chunk[SERVER_BUFFER_SIZE];
+    memset(chunk, 'x', sizeof(chunk));
+    int fileSize = 0;
+    int i = 0;
+    for ( i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++ i ) {
+        // Grow the file to the next size, it stays in the page cache
+        for ( ; fileSize < sizes[i]; fileSize += sizeof(chunk) ) {
+            if ( write(fileDescriptor, chunk, sizeof(chunk)) != sizeof(chunk) ) {
+                fprintf(stderr, "[ERROR] Failed to write %s: %s\n", filePath, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+        dup2(nullFileDescriptor, STDERR_FILENO);
+        double nanoseconds = timeKernel(runSendFileStream, &context);
+        dup2(standardError, STDERR_FILENO);
+        printResult("sendFileStream", sizes[i], nanoseconds);
+    }
+
+    // The drain thread stops when the socket is closed
+    shutdown(socketFileDescriptors[0], SHUT_WR);
+    pthread_join(drainThread, NULL);
+    close(socketFileDescriptors[0]);
+    close(socketFileDescriptors[1]);
+    close(nullFileDescriptor);
+    close(standardError);
+    close(fileDescriptor);
+    unlink(filePath);
+}
+
+/**
+ * Kernels, called with their contexts.
+ */
+void runToUppercaseString(void* context) {
+    struct StringContext* stringContext = (struct StringContext*) context;
+    toUppercaseString(stringContext->input, stringContext->output);
+}
+
+void runDecodePacket(void* context) {
+    struct PacketContext* packetContext = (struct PacketContext*) context;
+    decodePacket(packetContext->frame, packetContext->frameSize, &packetContext->decodedPacket);
+}
+
+void runParseDataPacket(void* context) {
+    struct PacketContext* packetContext = (struct PacketContext*) context;
+    parseDataPacket(&packetContext->decodedPacket, &packetContext->statistics, packetContext->logFile, TRUE);
+}
+
+void runParseDataPacketHeaders(void* context) {
+    struct PacketContext* packetContext = (struct PacketContext*) context;
+    parseDataPacket(&packetContext->decodedPacket, &packetContext->statistics, packetContext->logFile, FALSE);
+}
+
+void runParseDataPayload(void* context) {
+    struct PacketContext* packetContext = (struct PacketContext*) context;
+    parseDataPayload(packetContext->frame, packetContext->frameSize, packetContext->logFile);
+}
+
+void runSendFileStream(void* context) {
+    struct FileStreamContext* fileStreamContext = (struct FileStreamContext*) context;
+    if ( sendFileStream(fileStreamContext->socketFileDescriptor, fileStreamContext->filePath,
+            fileStreamContext->outputBuffer) == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to send the file stream: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Build an Ethernet frame of an IPv4 UDP datagram, whose payload is text
+ * mixed with binary bytes.
+ *
+ * @param  frame     the buffer for the frame, MAX_FRAME_SIZE bytes at least
+ * @param  frameSize the size of the frame
+ * @return the size of the frame
+ */
+int buildUdpFrame(unsigned char* frame, int frameSize) {
+    memset(frame, 0, frameSize);
+    struct ethhdr* eth = (struct ethhdr*) frame;
+    eth->h_proto = htons(ETH_P_IP);
+
+    struct iphdr* iph = (struct iphdr*) (frame + sizeof(struct ethhdr));
+    iph->version = 4;
+    iph->ihl = 5;
+    iph->ttl = 64;
+    iph->protocol = IPPROTO_UDP;
+    iph->tot_len = htons(frameSize - sizeof(struct ethhdr));
+    iph->saddr = htonl(0x0A000001);
+    iph->daddr = htonl(0x0A000002);
+
+    struct udphdr* udph = (struct udphdr*) ((unsigned char*) iph + sizeof(struct iphdr));
+    udph->source = htons(40000);
+    udph->dest = htons(9000);
+    udph->len = htons(frameSize - sizeof(struct ethhdr) - sizeof(struct iphdr));
+
+    int i = 0;
+    int payloadOffset = sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr);
+    for ( i = payloadOffset; i < frameSize; ++ i ) {
+        frame[i] = i % 4 == 0 ? i & 0xFF : 'a' + i % 26;
+    }
+    return frameSize;
+}
+
+/**
+ * Read and discard the data from a socket until it's closed.
+ *
+ * @param  argument the file descriptor of the socket
+ * @return NULL
+ */
+void* drainSocket(void* argument) {
+    int socketFileDescriptor = *(int*) argument;
+    char buffer[64 * 1024];
+
+    while ( read(socketFileDescriptor, buffer, sizeof(buffer)) > 0 ) {
+    }
+    return NULL;
+}
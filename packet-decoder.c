@@ -0,0 +1,253 @@
+#include <netinet/icmp6.h>
+#include <netinet/if_ether.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <string.h>
+
+#include "packet-decoder.h"
+
+#define FALSE                   0
+#define TRUE                    1
+
+/**
+ * EtherTypes of VLAN tags, 802.1Q and 802.1ad.
+ */
+#define ETHERTYPE_VLAN          0x8100
+#define ETHERTYPE_QINQ          0x88A8
+
+/**
+ * Prototypes of functions.
+ */
+static void decodeIpv4Header(struct DecodedPacket* packet, uint32_t offset);
+static void decodeIpv6Header(struct DecodedPacket* packet, uint32_t offset);
+static void decodeTransportHeader(struct DecodedPacket* packet, uint32_t offset, uint32_t networkEnd);
+static uint16_t getUint16(const unsigned char* data);
+
+/**
+ * Decode the Ethernet, VLAN, IP and transport headers of a frame.
+ *
+ * Every header is checked against the captured bytes before it's read, so
+ * the decoder never reads beyond the frame, and truncated frames are
+ * decoded as far as they go.
+ *
+ * @param  frame     the Ethernet frame
+ * @param  frameSize the number of bytes captured
+ * @param  packet    the decoded packet
+ * @return -1 if the frame is truncated
+ */
+int decodePacket(const unsigned char* frame, uint32_t frameSize, struct DecodedPacket* packet) {
+    memset(packet, 0, sizeof(struct DecodedPacket));
+    packet->frame = frame;
+    packet->frameSize = frameSize;
+
+    if ( frameSize < sizeof(struct ethhdr) ) {
+        packet->isTruncated = TRUE;
+        return -1;
+    }
+    uint32_t offset = sizeof(struct ethhdr);
+    packet->etherType = getUint16(frame + 12);
+
+    // Skip VLAN tags, the tag of each one is followed by the next EtherType
+    while ( (packet->etherType == ETHERTYPE_VLAN || packet->etherType == ETHERTYPE_QINQ) &&
+            packet->numberOfVlanTags < DECODED_PACKET_MAX_VLAN_TAGS ) {
+        if ( offset + 4 > frameSize ) {
+            packet->isTruncated = TRUE;
+            return -1;
+        }
+        packet->vlanIds[packet->numberOfVlanTags ++] = getUint16(frame + offset) & 0x0FFF;
+        packet->etherType = getUint16(frame + offset + 2);
+        offset += 4;
+    }
+
+    if ( packet->etherType == ETH_P_IP ) {
+        decodeIpv4Header(packet, offset);
+    } else if ( packet->etherType == ETH_P_IPV6 ) {
+        decodeIpv6Header(packet, offset);
+    }
+    return packet->isTruncated ? -1 : 0;
+}
+
+/**
+ * Decode the IPv4 header, and the transport header after it.
+ *
+ * @param packet the decoded packet
+ * @param offset the offset of the IPv4 header
+ */
+static void decodeIpv4Header(struct DecodedPacket* packet, uint32_t offset) {
+    const unsigned char* frame = packet->frame;
+    if ( offset + sizeof(struct iphdr) > packet->frameSize ) {
+        packet->isTruncated = TRUE;
+        return;
+    }
+    const struct iphdr* iph = (const struct iphdr*) (frame + offset);
+    uint32_t headerLength = iph->ihl * 4;
+    uint32_t totalLength = ntohs(iph->tot_len);
+    if ( iph->version != 4 || headerLength < sizeof(struct iphdr) || totalLength < headerLength ) {
+        return;
+    }
+    if ( offset + headerLength > packet->frameSize ) {
+        packet->isTruncated = TRUE;
+        return;
+    }
+    packet->ipVersion = 4;
+    packet->networkOffset = offset;
+    packet->protocol = iph->protocol;
+    memcpy(packet->sourceAddress, &iph->saddr, 4);
+    memcpy(packet->destinationAddress, &iph->daddr, 4);
+
+    // Ethernet padding after the IP packet isn't part of the payload
+    uint32_t networkEnd = offset + totalLength;
+    if ( networkEnd > packet->frameSize ) {
+        networkEnd = packet->frameSize;
+        packet->isTruncated = TRUE;
+    }
+    // Only the first fragment carries the transport header
+    if ( (ntohs(iph->frag_off) & IP_OFFMASK) != 0 ) {
+        packet->isFragment = TRUE;
+        packet->payloadOffset = offset + headerLength;
+        packet->payloadLength = networkEnd - packet->payloadOffset;
+        return;
+    }
+    decodeTransportHeader(packet, offset + headerLength, networkEnd);
+}
+
+/**
+ * Decode the IPv6 header, its extension headers, and the transport header
+ * after them.
+ *
+ * @param packet the decoded packet
+ * @param offset the offset of the IPv6 header
+ */
+static void decodeIpv6Header(struct DecodedPacket* packet, uint32_t offset) {
+    const unsigned char* frame = packet->frame;
+    if ( offset + sizeof(struct ip6_hdr) > packet->frameSize ) {
+        packet->isTruncated = TRUE;
+        return;
+    }
+    const struct ip6_hdr* ip6h = (const struct ip6_hdr*) (frame + offset);
+    if ( (frame[offset] >> 4) != 6 ) {
+        return;
+    }
+    packet->ipVersion = 6;
+    packet->networkOffset = offset;
+    memcpy(packet->sourceAddress, &ip6h->ip6_src, 16);
+    memcpy(packet->destinationAddress, &ip6h->ip6_dst, 16);
+
+    // A payload length of 0 stands for a jumbogram, which takes the rest of the frame
+    uint32_t payloadLength = ntohs(ip6h->ip6_plen);
+    uint32_t networkEnd = payloadLength == 0 ? packet->frameSize : offset + sizeof(struct ip6_hdr) + payloadLength;
+    if ( networkEnd > packet->frameSize ) {
+        networkEnd = packet->frameSize;
+        packet->isTruncated = TRUE;
+    }
+
+    uint8_t nextHeader = ip6h->ip6_nxt;
+    offset += sizeof(struct ip6_hdr);
+    int i = 0;
+    for ( i = 0; i < DECODED_PACKET_MAX_IPV6_HEADERS; ++ i ) {
+        uint32_t headerLength = 0;
+
+        if ( nextHeader == IPPROTO_HOPOPTS || nextHeader == IPPROTO_ROUTING || nextHeader == IPPROTO_DSTOPTS ) {
+            if ( offset + 2 > networkEnd ) {
+                packet->isTruncated = TRUE;
+                return;
+            }
+            headerLength = (frame[offset + 1] + 1) * 8;
+        } else if ( nextHeader == IPPROTO_AH ) {
+            if ( offset + 2 > networkEnd ) {
+                packet->isTruncated = TRUE;
+                return;
+            }
+            headerLength = (frame[offset + 1] + 2) * 4;
+        } else if ( nextHeader == IPPROTO_FRAGMENT ) {
+            headerLength = sizeof(struct ip6_frag);
+            if ( offset + headerLength <= networkEnd && (getUint16(frame + offset + 2) & 0xFFF8) != 0 ) {
+                packet->isFragment = TRUE;
+            }
+        } else {
+            break;
+        }
+        if ( offset + headerLength > networkEnd ) {
+            packet->isTruncated = TRUE;
+            return;
+        }
+        nextHeader = frame[offset];
+        offset += headerLength;
+    }
+    packet->protocol = nextHeader;
+
+    if ( packet->isFragment ) {
+        packet->payloadOffset = offset;
+        packet->payloadLength = networkEnd - offset;
+        return;
+    }
+    decodeTransportHeader(packet, offset, networkEnd);
+}
+
+/**
+ * Decode the TCP, UDP or ICMP header. The payload of other protocols
+ * starts right after the IP headers.
+ *
+ * @param packet     the decoded packet
+ * @param offset     the offset of the transport header
+ * @param networkEnd the end of the IP packet within the captured bytes
+ */
+static void decodeTransportHeader(struct DecodedPacket* packet, uint32_t offset, uint32_t networkEnd) {
+    const unsigned char* frame = packet->frame;
+    uint32_t headerLength = 0;
+
+    switch ( packet->protocol ) {
+        case IPPROTO_TCP:
+            if ( offset + sizeof(struct tcphdr) > networkEnd ) {
+                packet->isTruncated = TRUE;
+                return;
+            }
+            headerLength = ((const struct tcphdr*) (frame + offset))->doff * 4;
+            if ( headerLength < sizeof(struct tcphdr) ) {
+                packet->isInvalid = TRUE;
+                return;
+            }
+            packet->tcpFlags = frame[offset + 13];
+            break;
+
+        case IPPROTO_UDP:
+            headerLength = sizeof(struct udphdr);
+            break;
+
+        case IPPROTO_ICMP:
+            headerLength = sizeof(struct icmphdr);
+            break;
+
+        case IPPROTO_ICMPV6:
+            headerLength = sizeof(struct icmp6_hdr);
+            break;
+
+        default:
+            break;
+    }
+    if ( offset + headerLength > networkEnd ) {
+        packet->isTruncated = TRUE;
+        return;
+    }
+    if ( packet->protocol == IPPROTO_TCP || packet->protocol == IPPROTO_UDP ) {
+        packet->sourcePort = getUint16(frame + offset);
+        packet->destinationPort = getUint16(frame + offset + 2);
+    }
+    packet->transportOffset = offset;
+    packet->payloadOffset = offset + headerLength;
+    packet->payloadLength = networkEnd - packet->payloadOffset;
+}
+
+/**
+ * Read a 16-bit integer in network byte order.
+ *
+ * @param  data the bytes of the integer
+ * @return the integer in host byte order
+ */
+static uint16_t getUint16(const unsigned char* data) {
+    return (data[0] << 8) | data[1];
+}
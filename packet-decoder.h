@@ -0,0 +1,43 @@
+#ifndef PACKET_DECODER_H
+#define PACKET_DECODER_H
+
+#include <stdint.h>
+
+#define DECODED_PACKET_MAX_VLAN_TAGS    2
+#define DECODED_PACKET_MAX_IPV6_HEADERS 8
+
+/**
+ * The layers of an Ethernet frame, decoded in one pass.
+ *
+ * Offsets are from the beginning of the frame, and a header is only
+ * referenced when all of its bytes are captured, so printers and other
+ * consumers may cast the header at the offset without checking again.
+ */
+struct DecodedPacket {
+    const unsigned char* frame;
+    uint32_t frameSize;                 // the number of bytes captured
+    uint16_t etherType;                 // of the network layer, after VLAN tags
+    uint16_t vlanIds[DECODED_PACKET_MAX_VLAN_TAGS];
+    uint8_t numberOfVlanTags;
+    uint8_t ipVersion;                  // 4, 6, or 0 if the frame doesn't carry IP
+    uint8_t protocol;                   // of the transport layer, after IPv6 extension headers
+    uint8_t tcpFlags;
+    uint8_t isFragment;                 // not the first fragment, so no transport header
+    uint8_t isTruncated;                // fewer bytes are captured than the headers tell
+    uint8_t isInvalid;                  // the transport header has an impossible length
+    uint32_t networkOffset;             // 0 if there's no complete IP header
+    uint32_t transportOffset;           // 0 if there's no complete transport header
+    uint32_t payloadOffset;
+    uint32_t payloadLength;             // the captured bytes of payload, excluding Ethernet padding
+    uint16_t sourcePort;                // in host byte order
+    uint16_t destinationPort;
+    unsigned char sourceAddress[16];    // in network byte order, the first 4 bytes for IPv4
+    unsigned char destinationAddress[16];
+};
+
+/**
+ * Prototypes of functions.
+ */
+int decodePacket(const unsigned char* frame, uint32_t frameSize, struct DecodedPacket* packet);
+
+#endif
@@ -0,0 +1,467 @@
+#include <arpa/inet.h>
+#include <netinet/icmp6.h>
+#include <netinet/if_ether.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "packet-printer.h"
+
+#define FALSE                   0
+#define TRUE                    1
+#define CHARS_PER_LINE          16
+#define HEX_DUMP_LINE_SIZE      (4 + CHARS_PER_LINE * 3 + 9 + CHARS_PER_LINE + 1)
+#define PACKET_OUTPUT_SIZE      (64 * 1024)     // holds the dump of a 9000-byte jumbo frame
+#define MAX_TEXT_LINE_SIZE      256
+
+/**
+ * The text of a packet, rendered in memory and written to the log file with
+ * one fwrite. Only dumps larger than the buffer are written in several parts.
+ */
+struct PacketOutput {
+    FILE* logFile;
+    int size;
+    char data[PACKET_OUTPUT_SIZE];
+};
+
+/**
+ * Prototypes of functions.
+ */
+static void printEthernetHeader(const struct DecodedPacket* packet, struct PacketOutput* output);
+static void printIpHeader(const struct DecodedPacket* packet, struct PacketOutput* output);
+static void printIcmpPacket(const struct DecodedPacket* packet, struct PacketOutput* output, int isDataDumped);
+static void printTcpPacket(const struct DecodedPacket* packet, struct PacketOutput* output, int isDataDumped);
+static void printUdpPacket(const struct DecodedPacket* packet, struct PacketOutput* output, int isDataDumped);
+static void printIncompletePacket(const struct DecodedPacket* packet, struct PacketOutput* output, int isDataDumped);
+static void appendText(struct PacketOutput* output, const char* format, ...);
+static void appendHexDump(struct PacketOutput* output, const unsigned char* data, int size);
+static void flushPacketOutput(struct PacketOutput* output);
+static int formatHexDumpLine(const unsigned char* data, int lineSize, int isLastLine, char* output);
+
+/**
+ * Count the packet by its protocol, and print it to the log file. The text
+ * of the packet is rendered in memory first, and written with one fwrite.
+ * 
+ * @param packet       the decoded packet
+ * @param statistics   the statistics of the worker that received the packet
+ * @param logFile      the file descriptor of log file, NULL for counting packets only
+ * @param isDataDumped whether the bytes of the packet are dumped after its headers
+ */
+void parseDataPacket(const struct DecodedPacket* packet, struct PacketStatistics* statistics, FILE* logFile, int isDataDumped) {
+    struct PacketOutput output;
+    output.logFile = logFile;
+    output.size = 0;
+
+    addToCounter(&statistics->totalPacketsReceived, 1);
+
+    // Frames without IP are counted as others
+    switch ( packet->ipVersion != 0 ? packet->protocol : IPPROTO_RAW ) {
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            addToCounter(&statistics->icmpPacketsReceived, 1);
+            if ( logFile != NULL ) {
+                printIcmpPacket(packet, &output, isDataDumped);
+            }
+
+            break;
+
+        case IPPROTO_IGMP:
+            addToCounter(&statistics->igmpPacketsReceived, 1);
+            break;
+        
+        case IPPROTO_TCP:
+            addToCounter(&statistics->tcpPacketsReceived, 1);
+            if ( logFile != NULL ) {
+                printTcpPacket(packet, &output, isDataDumped);
+            }
+
+            break;
+        
+        case IPPROTO_UDP:
+            addToCounter(&statistics->udpPacketsReceived, 1);
+            if ( logFile != NULL ) {
+                printUdpPacket(packet, &output, isDataDumped);
+            }
+
+            break;
+        
+        default:
+            addToCounter(&statistics->otherPacketsReceived, 1);
+            break;
+    }
+    if ( logFile != NULL ) {
+        flushPacketOutput(&output);
+    }
+}
+
+/**
+ * Print the header of the ethernet packet.
+ * 
+ * @param packet  the decoded packet
+ * @param output  the text of the packet
+ */
+static void printEthernetHeader(const struct DecodedPacket* packet, struct PacketOutput* output) {
+    const struct ethhdr* eth = (const struct ethhdr*) packet->frame;
+
+    appendText(output, "\n");
+    appendText(output, "Ethernet Header\n");
+    appendText(output, "   |-Destination Address  : %.2X-%.2X-%.2X-%.2X-%.2X-%.2X \n", eth->h_dest[0], eth->h_dest[1], eth->h_dest[2], eth->h_dest[3], eth->h_dest[4], eth->h_dest[5]);
+    appendText(output, "   |-Source Address       : %.2X-%.2X-%.2X-%.2X-%.2X-%.2X \n", eth->h_source[0], eth->h_source[1], eth->h_source[2], eth->h_source[3], eth->h_source[4], eth->h_source[5]);
+
+    int i = 0;
+    for ( i = 0; i < packet->numberOfVlanTags; ++ i ) {
+        appendText(output, "   |-VLAN ID              : %u \n", packet->vlanIds[i]);
+    }
+    // The field is printed as the bytes on the wire, as the log always did
+    appendText(output, "   |-Protocol             : %u \n", (unsigned short) eth->h_proto);
+}
+
+/**
+ * Print the header of the IPv4 or IPv6 packet.
+ * 
+ * @param packet  the decoded packet
+ * @param output  the text of the packet
+ */
+static void printIpHeader(const struct DecodedPacket* packet, struct PacketOutput* output) {
+    // Print Ethernet Header first
+    printEthernetHeader(packet, output);
+
+    char sourceAddress[INET6_ADDRSTRLEN] = {0};
+    char destinationAddress[INET6_ADDRSTRLEN] = {0};
+    int addressFamily = packet->ipVersion == 4 ? AF_INET : AF_INET6;
+    inet_ntop(addressFamily, packet->sourceAddress, sourceAddress, sizeof(sourceAddress));
+    inet_ntop(addressFamily, packet->destinationAddress, destinationAddress, sizeof(destinationAddress));
+
+    appendText(output, "\n");
+    if ( packet->ipVersion == 4 ) {
+        const struct iphdr* iph = (const struct iphdr*) (packet->frame + packet->networkOffset);
+
+        appendText(output, "IP Header\n");
+        appendText(output, "   |-IP Version           : %d\n", (unsigned int) iph->version);
+        appendText(output, "   |-IP Header Length     : %d Bytes\n", ((unsigned int) (iph->ihl)) * 4);
+        appendText(output, "   |-Type Of Service      : %d\n", (unsigned int)iph->tos);
+        appendText(output, "   |-IP Total Length      : %d Bytes\n", ntohs(iph->tot_len));
+        appendText(output, "   |-Identification       : %d\n", ntohs(iph->id));
+        appendText(output, "   |-TTL                  : %d\n", (unsigned int) iph->ttl);
+        appendText(output, "   |-Protocol             : %d\n", (unsigned int) iph->protocol);
+        appendText(output, "   |-Checksum             : %d\n", ntohs(iph->check));
+    } else {
+        const struct ip6_hdr* ip6h = (const struct ip6_hdr*) (packet->frame + packet->networkOffset);
+        uint32_t flow = ntohl(ip6h->ip6_flow);
+
+        appendText(output, "IPv6 Header\n");
+        appendText(output, "   |-IP Version           : 6\n");
+        appendText(output, "   |-Traffic Class        : %u\n", (flow >> 20) & 0xFF);
+        appendText(output, "   |-Flow Label           : %u\n", flow & 0xFFFFF);
+        appendText(output, "   |-Payload Length       : %d Bytes\n", ntohs(ip6h->ip6_plen));
+        appendText(output, "   |-Next Header          : %d\n", (unsigned int) ip6h->ip6_nxt);
+        appendText(output, "   |-Hop Limit            : %d\n", (unsigned int) ip6h->ip6_hlim);
+        appendText(output, "   |-Protocol             : %d\n", (unsigned int) packet->protocol);
+    }
+    appendText(output, "   |-Source IP            : %s\n", sourceAddress);
+    appendText(output, "   |-Destination IP       : %s\n", destinationAddress);
+}
+
+/**
+ * Print the ICMP or ICMPv6 packet.
+ * 
+ * @param packet       the decoded packet
+ * @param output       the text of the packet
+ * @param isDataDumped whether the bytes of the packet are dumped after its headers
+ */
+static void printIcmpPacket(const struct DecodedPacket* packet, struct PacketOutput* output, int isDataDumped) {
+    if ( packet->transportOffset == 0 ) {
+        printIncompletePacket(packet, output, isDataDumped);
+        return;
+    }
+    // The type, code and checksum are laid out in the same way in ICMPv6
+    const struct icmphdr* icmph = (const struct icmphdr*) (packet->frame + packet->transportOffset);
+    int isIcmpv6 = packet->protocol == IPPROTO_ICMPV6;
+
+    appendText(output, "\n***********************ICMP Packet************************\n");
+
+    // Print ethernet packet and IP packet first.
+    printIpHeader(packet, output);
+
+    // Print ICMP packet
+    appendText(output, "\n");
+    appendText(output, "ICMP Header\n");
+    appendText(output, "   |-Type                 : %d ", (unsigned int)(icmph->type));
+
+    if ( icmph->type == (isIcmpv6 ? ICMP6_TIME_EXCEEDED : ICMP_TIME_EXCEEDED) ) {
+        appendText(output, "  (TTL Expired)\n");
+    } else if ( icmph->type == (isIcmpv6 ? ICMP6_ECHO_REPLY : ICMP_ECHOREPLY) ) {
+        appendText(output, "  (ICMP Echo Reply)\n");
+    } else {
+        appendText(output, "\n");
+    }
+
+    appendText(output, "   |-Code                 : %d\n", (unsigned int)(icmph->code));
+    appendText(output, "   |-Checksum             : %d\n", ntohs(icmph->checksum));
+    appendText(output, "\n");
+    if ( !isDataDumped ) {
+        return;
+    }
+
+    appendText(output, "IP Header\n");
+    appendHexDump(output, packet->frame + packet->networkOffset, 
+        packet->transportOffset - packet->networkOffset);
+         
+    appendText(output, "ICMP Header\n");
+    appendHexDump(output, packet->frame + packet->transportOffset, 
+        packet->payloadOffset - packet->transportOffset);
+         
+    appendText(output, "Data Payload\n");
+    appendHexDump(output, packet->frame + packet->payloadOffset, packet->payloadLength);
+}
+
+/**
+ * Print the TCP packet.
+ * 
+ * @param packet       the decoded packet
+ * @param output       the text of the packet
+ * @param isDataDumped whether the bytes of the packet are dumped after its headers
+ */
+static void printTcpPacket(const struct DecodedPacket* packet, struct PacketOutput* output, int isDataDumped) {
+    if ( packet->transportOffset == 0 ) {
+        printIncompletePacket(packet, output, isDataDumped);
+        return;
+    }
+    const struct tcphdr* tcph = (const struct tcphdr*) (packet->frame + packet->transportOffset);
+
+    appendText(output, "\n***********************TCP Packet*************************\n");
+
+    // Print ethernet packet and IP packet first.
+    printIpHeader(packet, output);
+
+    // Print TCP packet
+    appendText(output, "\n");
+    appendText(output, "TCP Header\n");
+    appendText(output, "   |-Source Port          : %u\n", packet->sourcePort);
+    appendText(output, "   |-Destination Port     : %u\n", packet->destinationPort);
+    appendText(output, "   |-Sequence Number      : %u\n", ntohl(tcph->seq));
+    appendText(output, "   |-Acknowledge Number   : %u\n", ntohl(tcph->ack_seq));
+    appendText(output, "   |-Header Length        : %d Bytes\n" , (unsigned int)tcph->doff * 4);
+    appendText(output, "   |-Urgent Flag          : %d\n", (unsigned int)tcph->urg);
+    appendText(output, "   |-Acknowledgement Flag : %d\n", (unsigned int)tcph->ack);
+    appendText(output, "   |-Push Flag            : %d\n", (unsigned int)tcph->psh);
+    appendText(output, "   |-Reset Flag           : %d\n", (unsigned int)tcph->rst);
+    appendText(output, "   |-Synchronise Flag     : %d\n", (unsigned int)tcph->syn);
+    appendText(output, "   |-Finish Flag          : %d\n", (unsigned int)tcph->fin);
+    appendText(output, "   |-Window               : %d\n", ntohs(tcph->window));
+    appendText(output, "   |-Checksum             : %d\n", ntohs(tcph->check));
+    appendText(output, "   |-Urgent Pointer       : %d\n", tcph->urg_ptr);
+    if ( !isDataDumped ) {
+        return;
+    }
+    appendText(output, "\n                        DATA Dump                         \n");
+         
+    appendText(output, "IP Header\n");
+    appendHexDump(output, packet->frame + packet->networkOffset, 
+        packet->transportOffset - packet->networkOffset);
+         
+    appendText(output, "TCP Header\n");
+    appendHexDump(output, packet->frame + packet->transportOffset, 
+        packet->payloadOffset - packet->transportOffset);
+         
+    appendText(output, "Data Payload\n");
+    if ( packet->payloadLength != 0 ) {
+        appendHexDump(output, packet->frame + packet->payloadOffset, packet->payloadLength);
+    } else {
+        appendText(output, "    (Empty)\n");
+    }
+}
+
+/**
+ * Print the UDP packet.
+ * 
+ * @param packet       the decoded packet
+ * @param output       the text of the packet
+ * @param isDataDumped whether the bytes of the packet are dumped after its headers
+ */
+static void printUdpPacket(const struct DecodedPacket* packet, struct PacketOutput* output, int isDataDumped) {
+    if ( packet->transportOffset == 0 ) {
+        printIncompletePacket(packet, output, isDataDumped);
+        return;
+    }
+    const struct udphdr* udph = (const struct udphdr*) (packet->frame + packet->transportOffset);
+    
+    appendText(output, "\n***********************UDP Packet*************************\n");
+
+    // Print ethernet packet and IP packet first.
+    printIpHeader(packet, output);
+
+    // Print UDP packet
+    appendText(output, "\nUDP Header\n");
+    appendText(output, "   |-Source Port          : %d\n", packet->sourcePort);
+    appendText(output, "   |-Destination Port     : %d\n", packet->destinationPort);
+    appendText(output, "   |-UDP Length           : %d\n", ntohs(udph->len));
+    appendText(output, "   |-UDP Checksum         : %d\n", ntohs(udph->check));
+    if ( !isDataDumped ) {
+        return;
+    }
+    appendText(output, "\n                        DATA Dump                         \n");
+     
+    appendText(output, "IP Header\n");
+    appendHexDump(output, packet->frame + packet->networkOffset, 
+        packet->transportOffset - packet->networkOffset);
+
+    appendText(output, "UDP Header\n");
+    appendHexDump(output, packet->frame + packet->transportOffset, 
+        packet->payloadOffset - packet->transportOffset);
+
+    appendText(output, "Data Payload\n");
+    appendHexDump(output, packet->frame + packet->payloadOffset, packet->payloadLength);
+}
+
+/**
+ * Print an IP packet without a complete transport header, which is either
+ * a fragment after the first one, truncated, or has an invalid header.
+ * 
+ * @param packet       the decoded packet
+ * @param output       the text of the packet
+ * @param isDataDumped whether the bytes of the packet are dumped after its headers
+ */
+static void printIncompletePacket(const struct DecodedPacket* packet, struct PacketOutput* output, int isDataDumped) {
+    appendText(output, "\n********************Incomplete Packet*********************\n");
+
+    // Print ethernet packet and IP packet first.
+    printIpHeader(packet, output);
+
+    appendText(output, "\n");
+    appendText(output, "   |-Reason               : %s\n", packet->isFragment ? "Fragment" : 
+        (packet->isInvalid ? "Invalid Header" : "Truncated"));
+    if ( !isDataDumped ) {
+        return;
+    }
+    appendText(output, "\n                        DATA Dump                         \n");
+
+    // The data of a fragment follows the IP headers, otherwise all bytes after the IP header are dumped
+    appendText(output, "Data Payload\n");
+    if ( packet->isFragment ) {
+        appendHexDump(output, packet->frame + packet->payloadOffset, packet->payloadLength);
+    } else {
+        appendHexDump(output, packet->frame + packet->networkOffset, 
+            packet->frameSize - packet->networkOffset);
+    }
+}
+
+/**
+ * Parse the data of the packet.
+ *
+ * The dump is rendered line by line into a buffer on the stack with lookup
+ * tables, and written with one fwrite unless it's larger than the buffer.
+ * 
+ * @param buffer     the buffer for receiving data
+ * @param packetSize the size of received data
+ * @param logFile    the file descriptor of log file
+ */
+void parseDataPayload(unsigned char* buffer, int packetSize, FILE* logFile) {
+    struct PacketOutput output;
+    output.logFile = logFile;
+    output.size = 0;
+
+    appendHexDump(&output, buffer, packetSize);
+    flushPacketOutput(&output);
+}
+
+/**
+ * Append a formatted line to the text of the packet, the text is written
+ * to the log file first if the line may not fit in the buffer.
+ *
+ * @param output the text of the packet
+ * @param format the format of the line, which is shorter than MAX_TEXT_LINE_SIZE
+ */
+static void appendText(struct PacketOutput* output, const char* format, ...) {
+    if ( PACKET_OUTPUT_SIZE - output->size < MAX_TEXT_LINE_SIZE ) {
+        flushPacketOutput(output);
+    }
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(output->data + output->size, PACKET_OUTPUT_SIZE - output->size, format, arguments);
+    va_end(arguments);
+
+    if ( length > 0 ) {
+        output->size += length < PACKET_OUTPUT_SIZE - output->size ? length : PACKET_OUTPUT_SIZE - output->size - 1;
+    }
+}
+
+/**
+ * Append the hex dump of the data to the text of the packet.
+ *
+ * @param output the text of the packet
+ * @param data   the data to dump
+ * @param size   the size of the data
+ */
+static void appendHexDump(struct PacketOutput* output, const unsigned char* data, int size) {
+    int i = 0;
+
+    for ( i = 0; i < size; i += CHARS_PER_LINE ) {
+        int lineSize = size - i < CHARS_PER_LINE ? size - i : CHARS_PER_LINE;
+
+        if ( output->size + HEX_DUMP_LINE_SIZE > PACKET_OUTPUT_SIZE ) {
+            flushPacketOutput(output);
+        }
+        output->size += formatHexDumpLine(data + i, lineSize, i + lineSize == size, output->data + output->size);
+    }
+}
+
+/**
+ * Write the text of the packet to the log file.
+ *
+ * @param output the text of the packet
+ */
+static void flushPacketOutput(struct PacketOutput* output) {
+    if ( output->size != 0 ) {
+        fwrite(output->data, 1, output->size, output->logFile);
+        output->size = 0;
+    }
+}
+
+/**
+ * Render one line of the hex dump, e.g.
+ * "    45 00 00 54 ...          E..T...\n".
+ *
+ * Each line holds the hex of up to 16 bytes, followed by the visible
+ * characters. The hex column of the last line is padded with spaces, and
+ * its last byte is left out of the characters on the right.
+ *
+ * @param  data       the bytes of the line
+ * @param  lineSize   the number of bytes in the line, from 1 to CHARS_PER_LINE
+ * @param  isLastLine whether it is the last line of the dump
+ * @param  output     the buffer for the line, HEX_DUMP_LINE_SIZE bytes at least
+ * @return the number of characters written
+ */
+static int formatHexDumpLine(const unsigned char* data, int lineSize, int isLastLine, char* output) {
+    static const char hexDigits[] = "0123456789ABCDEF";
+    char* pOutput = output;
+    int i = 0;
+
+    memcpy(pOutput, "    ", 4);
+    pOutput += 4;
+
+    // Print the hex charcter in the data.
+    for ( i = 0; i < lineSize; ++ i ) {
+        pOutput[0] = hexDigits[data[i] >> 4];
+        pOutput[1] = hexDigits[data[i] & 0x0F];
+        pOutput[2] = ' ';
+        pOutput += 3;
+    }
+    // Print extra spaces for alignment, and the separator
+    memset(pOutput, ' ', (CHARS_PER_LINE - lineSize) * 3 + 9);
+    pOutput += (CHARS_PER_LINE - lineSize) * 3 + 9;
+
+    // If it isn't a number or alphabet, print a dot. Otherwise, print the character.
+    int visibleChars = isLastLine ? lineSize - 1 : lineSize;
+    for ( i = 0; i < visibleChars; ++ i ) {
+        *pOutput ++ = ( data[i] >= 32 && data[i] <= 128 ) ? data[i] : '.';
+    }
+    *pOutput ++ = '\n';
+
+    return pOutput - output;
+}
@@ -0,0 +1,41 @@
+#ifndef PACKET_PRINTER_H
+#define PACKET_PRINTER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "packet-decoder.h"
+
+/**
+ * The number of packets received for each protocol, and the bytes on the wire.
+ * The counters are only written by the thread that parses the packets.
+ */
+struct PacketStatistics {
+    uint64_t tcpPacketsReceived;
+    uint64_t udpPacketsReceived;
+    uint64_t icmpPacketsReceived;
+    uint64_t igmpPacketsReceived;
+    uint64_t otherPacketsReceived;
+    uint64_t totalPacketsReceived;
+    uint64_t totalBytesReceived;
+};
+
+/**
+ * Add to a counter of the statistics. The reporter thread reads the counters
+ * with __atomic_load_n, so they're written atomically too. There's only one
+ * writer, so a relaxed load and store is enough, without a locked add.
+ *
+ * @param counter the counter
+ * @param value   the value to add
+ */
+static inline void addToCounter(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Prototypes of functions.
+ */
+void parseDataPacket(const struct DecodedPacket* packet, struct PacketStatistics* statistics, FILE* logFile, int isDataDumped);
+void parseDataPayload(unsigned char* buffer, int packetSize, FILE* logFile);
+
+#endif
@@ -1,34 +1,200 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <linux/if_packet.h>
+#include <netinet/icmp6.h>
 #include <netinet/if_ether.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
-#define FALSE           0
-#define TRUE            1
-#define BUFFER_SIZE     65536
-#define CHARS_PER_LINE  16
+#include "bpf-filter.h"
+#include "capture-file.h"
+#include "flow-table.h"
+#include "packet-decoder.h"
+#include "packet-printer.h"
+#include "tcp-reassembly.h"
+
+#define FALSE                   0
+#define TRUE                    1
+#define BUFFER_SIZE             65536
+#define MAX_THREADS             64
+#define CAPTURE_POLL_TIMEOUT    100     // in milliseconds
+#define NANOSECONDS_PER_SECOND  1000000000ull
+#define STATISTICS_INTERVAL     1       // in seconds
+
+/**
+ * Default settings of the flow table.
+ */
+#define DEFAULT_FLOW_TABLE_SIZE     65536
+#define DEFAULT_FLOW_IDLE_TIMEOUT   60      // in seconds
+#define DEFAULT_TOP_FLOWS           10
+
+/**
+ * Default settings of the TCP stream reassembly.
+ */
+#define DEFAULT_TCP_STREAMS         16384
+#define DEFAULT_TCP_SEGMENTS        8192            // 16 MiB of out-of-order data for each thread
+#define DEFAULT_STREAM_BUFFER_SIZE  (256 * 1024)
+
+/**
+ * Stages of handling a packet, timed while replaying a capture file.
+ */
+#define STAGE_READ                  0
+#define STAGE_WRITE                 1
+#define STAGE_DECODE                2
+#define STAGE_PARSE                 3
+#define STAGE_REASSEMBLE            4
+#define STAGE_FLOW                  5
+#define NUMBER_OF_STAGES            6
+
+/**
+ * Default geometry of the memory-mapped RX ring.
+ */
+#define DEFAULT_RING_BLOCK_SIZE     (1 << 20)
+#define DEFAULT_RING_BLOCK_COUNT    64
+#define RING_FRAME_SIZE             2048
+#define RING_BLOCK_TIMEOUT          60      // in milliseconds
+
+/**
+ * The memory-mapped RX ring of a packet socket (TPACKET_V3).
+ * The kernel fills the ring block by block, and hands a block over to
+ * the user space once it is full or its timeout expires.
+ */
+struct RingBuffer {
+    unsigned char* map;
+    size_t mapSize;
+    unsigned int blockSize;
+    unsigned int blockCount;
+};
+
+/**
+ * The number of packets received and dropped by the kernel on a socket.
+ */
+struct KernelStatistics {
+    uint64_t receivedPackets;
+    uint64_t droppedPackets;
+    uint64_t queueFreezes;
+};
+
+/**
+ * Options of capturing packets.
+ */
+struct CaptureOptions {
+    int isRingBufferUsed;
+    unsigned int ringBlockSize;
+    unsigned int ringBlockCount;
+    int numberOfThreads;
+    char* captureFilePath;
+    unsigned long long captureFileRotateSize;
+    struct sock_fprog* filterProgram;
+    int flowReportInterval;
+    unsigned int flowTableSize;
+    int flowIdleTimeout;
+    int numberOfTopFlows;
+    int isTcpStreamReassembled;
+    unsigned int streamBufferSize;
+    char* replayFilePath;
+    unsigned int snapLength;
+    unsigned int sampleInterval;
+    unsigned int flowSampleCount;
+};
+
+/**
+ * A capture thread with its own socket, log file and statistics.
+ * Sockets of all workers join the same PACKET_FANOUT group, so the kernel
+ * spreads packets over the workers by flow hash.
+ */
+struct CaptureWorker {
+    int id;
+    pthread_t thread;
+    int rawSocketFileDescriptor;
+    int isRingBufferUsed;
+    struct RingBuffer ring;
+    FILE* logFile;
+    int isCaptureFileWritten;
+    struct CaptureFileWriter captureFileWriter;
+    int isFlowTableUsed;
+    struct FlowTable flowTable;
+    uint64_t flowReportInterval;
+    uint64_t lastFlowReportTime;
+    int numberOfTopFlows;
+    int isTcpStreamReassembled;
+    struct TcpReassembler tcpReassembler;
+    uint64_t lastStreamExpiryTime;
+    char* replayFilePath;
+    int isStageTimed;
+    uint64_t stageStartTime;
+    uint64_t stageTimes[NUMBER_OF_STAGES];
+    uint64_t replayTime;
+    uint64_t replayedBytes;
+    uint64_t lastPacketTime;
+    unsigned int snapLength;
+    unsigned int sampleInterval;
+    unsigned int flowSampleCount;
+    struct PacketStatistics statistics;
+    struct KernelStatistics kernelStatistics;   // accumulated by the main thread
+    int exitCode;
+};
+
+/**
+ * Whether the sniffer keeps capturing, cleared by SIGINT and SIGTERM.
+ */
+static volatile sig_atomic_t isRunning = TRUE;
+
+/**
+ * All capture workers, used for merging the statistics.
+ */
+static struct CaptureWorker* captureWorkers = NULL;
+static int numberOfCaptureWorkers = 0;
 
 /**
  * Prototypes of functions.
  */
-unsigned short getIpHeaderLength(unsigned char* buffer);
-void parseDataPacket(unsigned char* buffer, int packetSize, FILE* logFile);
-void parseEthernetHeader(unsigned char* buffer, int packetSize, FILE* logFile);
-void parseIpHeader(unsigned char* buffer, int packetSize, FILE* logFile);
-void parseIcmpPacket(unsigned char* buffer, int packetSize, FILE* logFile);
-void parseTcpPacket(unsigned char* buffer, int packetSize, FILE* logFile);
-void parseUdpPacket(unsigned char* buffer, int packetSize, FILE* logFile);
-void parseDataPayload(unsigned char* buffer, int packetSize, FILE* logFile);
+void stopCapturing(int signalNumber);
+int setupCaptureWorker(struct CaptureWorker* worker, int id, struct CaptureOptions* options, int fanoutGroupId);
+void* runCaptureWorker(void* argument);
+void releaseCaptureWorker(struct CaptureWorker* worker);
+int handleCapturedPacket(struct CaptureWorker* worker, unsigned char* packet, 
+        unsigned int capturedLength, unsigned int originalLength, const struct timespec* timestamp);
+void handleIdleCaptureWorker(struct CaptureWorker* worker);
+void reportFlows(struct CaptureWorker* worker, uint64_t currentTime);
+void expireIdleTcpStreams(struct CaptureWorker* worker, uint64_t currentTime);
+void handleTcpStreamEvent(struct TcpStream* stream, int direction, int event, 
+        const unsigned char* data, uint32_t length, void* context);
+int captureWithRecvfrom(struct CaptureWorker* worker);
+int replayCaptureFile(struct CaptureWorker* worker);
+uint64_t getMonotonicTime();
+void recordStageTime(struct CaptureWorker* worker, int stage);
+int setupRingBuffer(int rawSocketFileDescriptor, struct RingBuffer* ring, unsigned int blockSize, unsigned int blockCount);
+int captureWithRingBuffer(struct CaptureWorker* worker);
+void releaseRingBuffer(struct RingBuffer* ring);
+void reportStatistics();
+void sumPacketStatistics(struct PacketStatistics* total);
+void readKernelStatistics(struct KernelStatistics* delta);
+void printPacketStatistics();
+void printKernelStatistics();
+void printTcpReassemblyStatistics();
+void printReplayStatistics(struct CaptureWorker* worker);
+int isPacketSampled(struct CaptureWorker* worker, uint64_t flowPackets);
+int parseInteger(const char* text, long minimum, long maximum, long* pValue);
 
 /**
  * The entrance of the server application.
@@ -40,359 +206,1049 @@ void parseDataPayload(unsigned char* buffer, int packetSize, FILE* logFile);
  * @return 0 if the application exited normally
  */
 int main(int argc, char* argv[]) {
-    // Buffer for receiving packets
-    unsigned char* buffer = (unsigned char*) malloc(BUFFER_SIZE);
-    
-    // File descriptor for the log file
-    FILE* logFile = fopen("packet-sniffer.log", "w");
+    /*
+     * Parse options.
+     *
+     * -r, --ring             capture packets from a memory-mapped RX ring instead of recvfrom
+     * -s, --ring-block-size  the size of each block in the ring, a multiple of the page size
+     * -n, --ring-blocks      the number of blocks in the ring
+     * -t, --threads          the number of capture threads joined to one PACKET_FANOUT group
+     * -w, --write            write raw packets to a pcapng file instead of dumping them to the log file
+     * -C, --rotate-size      rotate the pcapng file once it grows beyond the size in bytes
+     * -f, --filter           capture only packets matching the expression, filtered in the kernel
+     * -F, --flow-report      aggregate packets by flow, and report the top flows every N seconds
+     * -N, --top              the number of top flows to report
+     * -T, --flow-timeout     the idle time in seconds before a flow is aged out
+     * -S, --flow-table-size  the maximum number of flows tracked by each thread
+     * -a, --reassemble       reassemble TCP streams, and dump the contiguous data of each stream
+     * -B, --stream-buffer    the maximum bytes of out-of-order data buffered for each direction of a stream
+     * -R, --read             replay packets from a pcap or pcapng file as fast as possible, and time each stage
+     * -l, --snaplen          capture at most the number of bytes of each packet
+     * -m, --sample           dump the data of 1 in N packets to the log file, headers of all packets are still logged
+     * -k, --sample-first     dump the data of the first N packets of each flow to the log file, untracked packets are always dumped
+     */
+    struct CaptureOptions options = {FALSE, DEFAULT_RING_BLOCK_SIZE, DEFAULT_RING_BLOCK_COUNT, 1, NULL, 0, NULL, 
+                                     0, DEFAULT_FLOW_TABLE_SIZE, DEFAULT_FLOW_IDLE_TIMEOUT, DEFAULT_TOP_FLOWS, 
+                                     FALSE, DEFAULT_STREAM_BUFFER_SIZE, NULL, 0, 0, 0};
+    char* filterExpression = NULL;
+    long ringBlockSize = DEFAULT_RING_BLOCK_SIZE;
+    long ringBlockCount = DEFAULT_RING_BLOCK_COUNT;
+    long value = 0;
+    struct option longOptions[] = {
+        {"ring",            no_argument,       NULL, 'r'},
+        {"ring-block-size", required_argument, NULL, 's'},
+        {"ring-blocks",     required_argument, NULL, 'n'},
+        {"threads",         required_argument, NULL, 't'},
+        {"write",           required_argument, NULL, 'w'},
+        {"rotate-size",     required_argument, NULL, 'C'},
+        {"filter",          required_argument, NULL, 'f'},
+        {"flow-report",     required_argument, NULL, 'F'},
+        {"top",             required_argument, NULL, 'N'},
+        {"flow-timeout",    required_argument, NULL, 'T'},
+        {"flow-table-size", required_argument, NULL, 'S'},
+        {"reassemble",      no_argument,       NULL, 'a'},
+        {"stream-buffer",   required_argument, NULL, 'B'},
+        {"read",            required_argument, NULL, 'R'},
+        {"snaplen",         required_argument, NULL, 'l'},
+        {"sample",          required_argument, NULL, 'm'},
+        {"sample-first",    required_argument, NULL, 'k'},
+        {NULL,              0,                 NULL, 0}
+    };
+    int option = 0;
+    while ( (option = getopt_long(argc, argv, "rs:n:t:w:C:f:F:N:T:S:aB:R:l:m:k:", longOptions, NULL)) != -1 ) {
+        switch ( option ) {
+            case 'r':
+                options.isRingBufferUsed = TRUE;
+                break;
+            case 's':
+                ringBlockSize = atol(optarg);
+                break;
+            case 'n':
+                ringBlockCount = atol(optarg);
+                break;
+            case 't':
+                options.numberOfThreads = atoi(optarg);
+                break;
+            case 'w':
+                options.captureFilePath = optarg;
+                break;
+            case 'C':
+                options.captureFileRotateSize = strtoull(optarg, NULL, 10);
+                break;
+            case 'f':
+                filterExpression = optarg;
+                break;
+            case 'F':
+                options.flowReportInterval = atoi(optarg);
+                break;
+            case 'N':
+                options.numberOfTopFlows = atoi(optarg);
+                break;
+            case 'T':
+                options.flowIdleTimeout = atoi(optarg);
+                break;
+            case 'S':
+                if ( parseInteger(optarg, 1, FLOW_TABLE_MAX_CAPACITY, &value) == -1 ) {
+                    fprintf(stderr, "[ERROR] Invalid size of the flow table, expected 1 to %u: %s.\n", FLOW_TABLE_MAX_CAPACITY, optarg);
+                    return EXIT_FAILURE;
+                }
+                options.flowTableSize = value;
+                break;
+            case 'a':
+                options.isTcpStreamReassembled = TRUE;
+                break;
+            case 'B':
+                if ( parseInteger(optarg, 1, INT_MAX, &value) == -1 ) {
+                    fprintf(stderr, "[ERROR] Invalid size of stream buffers, expected 1 to %d: %s.\n", INT_MAX, optarg);
+                    return EXIT_FAILURE;
+                }
+                options.streamBufferSize = value;
+                break;
+            case 'R':
+                options.replayFilePath = optarg;
+                break;
+            case 'l':
+                if ( parseInteger(optarg, 0, BUFFER_SIZE, &value) == -1 ) {
+                    fprintf(stderr, "[ERROR] Invalid snap length, expected 0 to %d: %s.\n", BUFFER_SIZE, optarg);
+                    return EXIT_FAILURE;
+                }
+                options.snapLength = value;
+                break;
+            case 'm':
+                if ( parseInteger(optarg, 1, INT_MAX, &value) == -1 ) {
+                    fprintf(stderr, "[ERROR] Invalid sample interval, expected 1 to %d: %s.\n", INT_MAX, optarg);
+                    return EXIT_FAILURE;
+                }
+                options.sampleInterval = value;
+                break;
+            case 'k':
+                if ( parseInteger(optarg, 1, INT_MAX, &value) == -1 ) {
+                    fprintf(stderr, "[ERROR] Invalid number of packets sampled for each flow, expected 1 to %d: %s.\n", INT_MAX, optarg);
+                    return EXIT_FAILURE;
+                }
+                options.flowSampleCount = value;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [--ring [--ring-block-size Bytes] [--ring-blocks N]] [--threads N] "
+                    "[--write File.pcapng [--rotate-size Bytes]] [--filter Expression] "
+                    "[--flow-report Seconds [--top N] [--flow-timeout Seconds] [--flow-table-size N]] "
+                    "[--reassemble [--stream-buffer Bytes]] [--read File.pcap] "
+                    "[--snaplen Bytes] [--sample N] [--sample-first N]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if ( ringBlockSize <= 0 || ringBlockSize % getpagesize() != 0 || ringBlockSize % RING_FRAME_SIZE != 0 ) {
+        fprintf(stderr, "[ERROR] The size of ring blocks must be a positive multiple of both the page size (%d bytes) "
+            "and the frame size (%d bytes).\n", getpagesize(), RING_FRAME_SIZE);
+        return EXIT_FAILURE;
+    }
+    if ( ringBlockCount <= 0 ) {
+        fprintf(stderr, "[ERROR] The number of ring blocks must be positive.\n");
+        return EXIT_FAILURE;
+    }
+    if ( options.numberOfThreads <= 0 || options.numberOfThreads > MAX_THREADS ) {
+        fprintf(stderr, "[ERROR] The number of threads must be between 1 and %d.\n", MAX_THREADS);
+        return EXIT_FAILURE;
+    }
+    if ( options.flowReportInterval < 0 || options.flowIdleTimeout <= 0 || 
+            options.numberOfTopFlows <= 0 || options.numberOfTopFlows > FLOW_TABLE_MAX_TOP_FLOWS ) {
+        fprintf(stderr, "[ERROR] Invalid options of the flow table.\n");
+        return EXIT_FAILURE;
+    }
+    if ( options.replayFilePath != NULL && 
+            (options.isRingBufferUsed || options.numberOfThreads != 1 || filterExpression != NULL) ) {
+        fprintf(stderr, "[ERROR] --ring, --threads and --filter cannot be used with --read.\n");
+        return EXIT_FAILURE;
+    }
+    if ( options.isTcpStreamReassembled && options.snapLength != 0 ) {
+        fprintf(stderr, "[ERROR] --reassemble cannot be used with --snaplen, since truncated segments would look like gaps.\n");
+        return EXIT_FAILURE;
+    }
+    options.ringBlockSize = ringBlockSize;
+    options.ringBlockCount = ringBlockCount;
 
-    if ( logFile == NULL ) {
-        fprintf(stderr, "[ERROR] Unable to create packet-sniffer.log file.\n");
+    // Compile the filter expression into a BPF program. The snap length of the ring is applied by the
+    // program as well, so the kernel copies less, while recvfrom truncates packets by itself
+    struct sock_fprog filterProgram;
+    unsigned int filterSnapLength = options.isRingBufferUsed ? options.snapLength : 0;
+    if ( filterExpression != NULL || filterSnapLength != 0 ) {
+        char errorMessage[BPF_FILTER_ERROR_SIZE] = {0};
+        if ( compileBpfFilter(filterExpression, filterSnapLength, &filterProgram, errorMessage, sizeof(errorMessage)) == -1 ) {
+            fprintf(stderr, "[ERROR] Invalid filter expression: %s.\n", errorMessage);
+            return EXIT_FAILURE;
+        }
+        options.filterProgram = &filterProgram;
+    }
+
+    // Create a socket and a log file for each worker
+    captureWorkers = calloc(options.numberOfThreads, sizeof(struct CaptureWorker));
+    if ( captureWorkers == NULL ) {
+        fprintf(stderr, "[ERROR] Unable to allocate the capture workers: %s.\n", strerror(errno));
         return EXIT_FAILURE;
     }
+    numberOfCaptureWorkers = options.numberOfThreads;
+    int fanoutGroupId = getpid() & 0xffff;
+    int i = 0;
+    for ( i = 0; i < numberOfCaptureWorkers; ++ i ) {
+        if ( setupCaptureWorker(&captureWorkers[i], i, &options, fanoutGroupId) == -1 ) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Stop capturing on Ctrl+C, SA_RESTART is not set so that blocking calls are interrupted
+    struct sigaction signalAction;
+    memset(&signalAction, 0, sizeof(signalAction));
+    signalAction.sa_handler = stopCapturing;
+    sigaction(SIGINT, &signalAction, NULL);
+    sigaction(SIGTERM, &signalAction, NULL);
+
+    // Start sniffing packets
+    if ( options.replayFilePath != NULL ) {
+        fprintf(stderr, "[INFO] Start replaying packets from %s.\n", options.replayFilePath);
+    } else if ( options.captureFilePath != NULL ) {
+        fprintf(stderr, "[INFO] Start sniffing packets, packets will be written to %s%s.\n", 
+            options.captureFilePath, numberOfCaptureWorkers == 1 ? "" : " (one file for each thread)");
+    } else if ( numberOfCaptureWorkers == 1 ) {
+        fprintf(stderr, "[INFO] Start sniffing packets, packets will be saved to packet-sniffer.log file.\n");
+    } else {
+        fprintf(stderr, "[INFO] Start sniffing packets with %d threads, packets will be saved to packet-sniffer-<N>.log files.\n", 
+            numberOfCaptureWorkers);
+    }
+
+    // Signals are blocked in workers, so that they interrupt the reporter in the main thread
+    sigset_t stopSignals, previousSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &previousSignals);
+    for ( i = 0; i < numberOfCaptureWorkers; ++ i ) {
+        pthread_create(&captureWorkers[i].thread, NULL, runCaptureWorker, &captureWorkers[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &previousSignals, NULL);
+
+    // A replay ends by itself, and reports its own throughput
+    if ( options.replayFilePath == NULL ) {
+        reportStatistics();
+    }
+
+    int exitCode = EXIT_SUCCESS;
+    for ( i = 0; i < numberOfCaptureWorkers; ++ i ) {
+        pthread_join(captureWorkers[i].thread, NULL);
+        if ( captureWorkers[i].exitCode == -1 ) {
+            exitCode = EXIT_FAILURE;
+        }
+    }
+    printPacketStatistics();
+    printf("\n");
+    if ( options.replayFilePath != NULL ) {
+        printReplayStatistics(&captureWorkers[0]);
+    } else {
+        printKernelStatistics();
+    }
+    if ( options.isTcpStreamReassembled ) {
+        printTcpReassemblyStatistics();
+    }
+
+    // Close file descriptor for file and socket
+    for ( i = 0; i < numberOfCaptureWorkers; ++ i ) {
+        releaseCaptureWorker(&captureWorkers[i]);
+    }
+    free(captureWorkers);
+    if ( options.filterProgram != NULL ) {
+        releaseBpfFilter(options.filterProgram);
+    }
+
+    return exitCode;
+}
+
+/**
+ * The handler of SIGINT and SIGTERM.
+ *
+ * @param signalNumber the number of the signal
+ */
+void stopCapturing(int signalNumber) {
+    isRunning = FALSE;
+}
+
+/**
+ * Create the raw socket and the log file of a capture worker.
+ *
+ * @param  worker        the worker to set up
+ * @param  id            the index of the worker
+ * @param  options       the options of capturing packets
+ * @param  fanoutGroupId the id of PACKET_FANOUT group, only used with more than one worker
+ * @return -1 if the worker cannot be set up
+ */
+int setupCaptureWorker(struct CaptureWorker* worker, int id, struct CaptureOptions* options, int fanoutGroupId) {
+    worker->id = id;
+    worker->isRingBufferUsed = options->isRingBufferUsed;
+    worker->replayFilePath = options->replayFilePath;
+    worker->rawSocketFileDescriptor = -1;
+    worker->snapLength = options->snapLength != 0 ? options->snapLength : BUFFER_SIZE;
+    worker->sampleInterval = options->sampleInterval;
+    worker->flowSampleCount = options->flowSampleCount;
+
+    // Flows are tracked by each worker, since a flow always goes to the same worker,
+    // and also for sampling the first packets of each flow
+    if ( options->flowReportInterval > 0 || options->flowSampleCount > 0 ) {
+        if ( createFlowTable(&worker->flowTable, options->flowTableSize, 
+                options->flowIdleTimeout * NANOSECONDS_PER_SECOND) == -1 ) {
+            fprintf(stderr, "[ERROR] Unable to allocate the flow table: %s.\n", strerror(errno));
+            return -1;
+        }
+        worker->isFlowTableUsed = TRUE;
+        worker->flowReportInterval = options->flowReportInterval * NANOSECONDS_PER_SECOND;
+        worker->numberOfTopFlows = options->numberOfTopFlows;
+
+        struct timespec currentTime;
+        clock_gettime(CLOCK_REALTIME, &currentTime);
+        worker->lastFlowReportTime = currentTime.tv_sec * NANOSECONDS_PER_SECOND + currentTime.tv_nsec;
+    }
+
+    // Streams are reassembled by each worker as well, idle streams are closed after the flow timeout
+    if ( options->isTcpStreamReassembled ) {
+        if ( createTcpReassembler(&worker->tcpReassembler, DEFAULT_TCP_STREAMS, DEFAULT_TCP_SEGMENTS, 
+                options->streamBufferSize, options->flowIdleTimeout * NANOSECONDS_PER_SECOND, 
+                handleTcpStreamEvent, worker) == -1 ) {
+            fprintf(stderr, "[ERROR] Unable to allocate the TCP stream reassembler: %s.\n", strerror(errno));
+            return -1;
+        }
+        worker->isTcpStreamReassembled = TRUE;
+    }
+
+    // Raw packets are written to the pcapng file, the text dump is skipped then
+    if ( options->captureFilePath != NULL ) {
+        if ( openCaptureFileWriter(&worker->captureFileWriter, options->captureFilePath, 
+                options->numberOfThreads > 1 ? id : -1, options->captureFileRotateSize) == -1 ) {
+            return -1;
+        }
+        worker->isCaptureFileWritten = TRUE;
+    } else {
+        // File descriptor for the log file
+        char logFilePath[64] = "packet-sniffer.log";
+        if ( options->numberOfThreads > 1 ) {
+            snprintf(logFilePath, sizeof(logFilePath), "packet-sniffer-%d.log", id);
+        }
+        worker->logFile = fopen(logFilePath, "w");
+
+        if ( worker->logFile == NULL ) {
+            fprintf(stderr, "[ERROR] Unable to create %s file.\n", logFilePath);
+            return -1;
+        }
+    }
+
+    // Packets are read from the capture file instead of the network
+    if ( worker->replayFilePath != NULL ) {
+        worker->isStageTimed = TRUE;
+        return 0;
+    }
 
     // Create file descriptor for raw socket
-    int rawSocketFileDescriptor = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL)) ;
-    if ( rawSocketFileDescriptor == -1 ) {
+    worker->rawSocketFileDescriptor = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL)) ;
+    if ( worker->rawSocketFileDescriptor == -1 ) {
         fprintf(stderr, "[ERROR] Unable to create row socket: %s.\n", strerror(errno));
-        return EXIT_FAILURE;
+        return -1;
     }
 
-    // Start sniffing packets
-    fprintf(stderr, "[INFO] Start sniffing packets, packets will be saved to packet-sniffer.log file.\n");
-    while ( TRUE ) {
+    // Drop unwanted packets in the kernel before they are copied to the user space
+    if ( options->filterProgram != NULL && attachBpfFilter(worker->rawSocketFileDescriptor, options->filterProgram) == -1 ) {
+        fprintf(stderr, "[ERROR] Unable to attach the filter: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    // Wake up periodically to check whether to stop, since the signal may be delivered to another thread
+    struct timeval timeout = {0, CAPTURE_POLL_TIMEOUT * 1000};
+    setsockopt(worker->rawSocketFileDescriptor, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // The ring must be set up before the socket joins a fanout group
+    if ( worker->isRingBufferUsed && 
+            setupRingBuffer(worker->rawSocketFileDescriptor, &worker->ring, options->ringBlockSize, options->ringBlockCount) == -1 ) {
+        fprintf(stderr, "[ERROR] Unable to set up the RX ring: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    // Packets of the same flow are always delivered to the same worker in hash mode
+    if ( options->numberOfThreads > 1 ) {
+        int fanoutArgument = fanoutGroupId | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+        if ( setsockopt(worker->rawSocketFileDescriptor, SOL_PACKET, PACKET_FANOUT, 
+                &fanoutArgument, sizeof(fanoutArgument)) == -1 ) {
+            fprintf(stderr, "[ERROR] Unable to join the PACKET_FANOUT group: %s.\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * The entrance of capture threads.
+ *
+ * @param  argument the capture worker
+ * @return NULL
+ */
+void* runCaptureWorker(void* argument) {
+    struct CaptureWorker* worker = (struct CaptureWorker*) argument;
+
+    if ( worker->replayFilePath != NULL ) {
+        worker->exitCode = replayCaptureFile(worker);
+    } else if ( worker->isRingBufferUsed ) {
+        worker->exitCode = captureWithRingBuffer(worker);
+    } else {
+        worker->exitCode = captureWithRecvfrom(worker);
+    }
+    if ( worker->exitCode == -1 ) {
+        isRunning = FALSE;
+    }
+    if ( worker->flowReportInterval > 0 ) {
+        // Flows of a replayed file are aged by the time of its last packet
+        struct timespec currentTime;
+        clock_gettime(CLOCK_REALTIME, &currentTime);
+        reportFlows(worker, worker->replayFilePath != NULL ? worker->lastPacketTime : 
+            currentTime.tv_sec * NANOSECONDS_PER_SECOND + currentTime.tv_nsec);
+    }
+    if ( worker->isTcpStreamReassembled ) {
+        // Deliver the data of streams still open
+        expireTcpStreams(&worker->tcpReassembler, UINT64_MAX);
+    }
+    if ( worker->logFile != NULL ) {
+        fflush(worker->logFile);
+    }
+
+    return NULL;
+}
+
+/**
+ * Close the socket and the log file of a capture worker.
+ *
+ * @param worker the worker to release
+ */
+void releaseCaptureWorker(struct CaptureWorker* worker) {
+    if ( worker->isRingBufferUsed ) {
+        releaseRingBuffer(&worker->ring);
+    }
+    if ( worker->isCaptureFileWritten ) {
+        closeCaptureFileWriter(&worker->captureFileWriter);
+    }
+    if ( worker->isFlowTableUsed ) {
+        destroyFlowTable(&worker->flowTable);
+    }
+    if ( worker->isTcpStreamReassembled ) {
+        destroyTcpReassembler(&worker->tcpReassembler);
+    }
+    if ( worker->logFile != NULL ) {
+        fclose(worker->logFile);
+    }
+    if ( worker->rawSocketFileDescriptor != -1 ) {
+        close(worker->rawSocketFileDescriptor);
+    }
+}
+
+/**
+ * Handle a captured packet: write it to the capture file, account it to
+ * its flow, parse it, and reassemble its TCP stream.
+ *
+ * @param  worker         the capture worker
+ * @param  packet         the Ethernet frame
+ * @param  capturedLength the number of bytes captured
+ * @param  originalLength the length of the frame on the wire
+ * @param  timestamp      the time when the frame was captured
+ * @return -1 if the packet cannot be written to the capture file
+ */
+int handleCapturedPacket(struct CaptureWorker* worker, unsigned char* packet, 
+        unsigned int capturedLength, unsigned int originalLength, const struct timespec* timestamp) {
+    // Packets replayed from a file may be longer than the snap length
+    if ( capturedLength > worker->snapLength ) {
+        capturedLength = worker->snapLength;
+    }
+
+    // Write raw packet to the capture file
+    if ( worker->isCaptureFileWritten && 
+            writeCapturedPacket(&worker->captureFileWriter, packet, capturedLength, originalLength, timestamp) == -1 ) {
+        fprintf(stderr, "[ERROR] An error occurred while writing the capture file: %s.\n", strerror(errno));
+        return -1;
+    }
+    if ( worker->isStageTimed ) {
+        recordStageTime(worker, STAGE_WRITE);
+    }
+
+    // Decode the headers once, all stages below read the decoded packet
+    struct DecodedPacket decodedPacket;
+    decodePacket(packet, capturedLength, &decodedPacket);
+    if ( worker->isStageTimed ) {
+        recordStageTime(worker, STAGE_DECODE);
+    }
+
+    // Account the packet to its flow, before parsing since the flow decides whether its data is dumped
+    uint64_t currentTime = timestamp->tv_sec * NANOSECONDS_PER_SECOND + timestamp->tv_nsec;
+    uint64_t flowPackets = 0;
+    if ( worker->isFlowTableUsed ) {
+        struct FlowKey flowKey;
+
+        if ( extractFlowKey(&decodedPacket, &flowKey) == 0 ) {
+            flowPackets = updateFlowTable(&worker->flowTable, &flowKey, decodedPacket.tcpFlags, originalLength, currentTime);
+        }
+        if ( worker->flowReportInterval > 0 && currentTime - worker->lastFlowReportTime >= worker->flowReportInterval ) {
+            reportFlows(worker, currentTime);
+        }
+        if ( worker->isStageTimed ) {
+            recordStageTime(worker, STAGE_FLOW);
+        }
+    }
+
+    // Parse data packet, the rates count bytes on the wire rather than the captured ones
+    addToCounter(&worker->statistics.totalBytesReceived, originalLength);
+    parseDataPacket(&decodedPacket, &worker->statistics, worker->logFile, isPacketSampled(worker, flowPackets));
+    if ( worker->isStageTimed ) {
+        recordStageTime(worker, STAGE_PARSE);
+    }
+
+    if ( worker->isTcpStreamReassembled ) {
+        processTcpSegment(&worker->tcpReassembler, &decodedPacket, currentTime);
+        if ( currentTime - worker->lastStreamExpiryTime >= NANOSECONDS_PER_SECOND ) {
+            expireIdleTcpStreams(worker, currentTime);
+        }
+        if ( worker->isStageTimed ) {
+            recordStageTime(worker, STAGE_REASSEMBLE);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Do the periodic work of a capture worker while the network is idle.
+ *
+ * @param worker the capture worker
+ */
+void handleIdleCaptureWorker(struct CaptureWorker* worker) {
+    // Flush the capture file while the network is idle
+    if ( worker->isCaptureFileWritten ) {
+        flushCaptureFileWriter(&worker->captureFileWriter);
+    }
+    if ( worker->flowReportInterval > 0 || worker->isTcpStreamReassembled ) {
+        struct timespec timestamp;
+        clock_gettime(CLOCK_REALTIME, &timestamp);
+        uint64_t currentTime = timestamp.tv_sec * NANOSECONDS_PER_SECOND + timestamp.tv_nsec;
+
+        if ( worker->flowReportInterval > 0 && currentTime - worker->lastFlowReportTime >= worker->flowReportInterval ) {
+            reportFlows(worker, currentTime);
+        }
+        if ( worker->isTcpStreamReassembled && currentTime - worker->lastStreamExpiryTime >= NANOSECONDS_PER_SECOND ) {
+            expireIdleTcpStreams(worker, currentTime);
+        }
+    }
+}
+
+/**
+ * Age out the idle flows, and print the top flows of the worker.
+ *
+ * @param worker      the capture worker
+ * @param currentTime the current time in nanoseconds
+ */
+void reportFlows(struct CaptureWorker* worker, uint64_t currentTime) {
+    expireFlows(&worker->flowTable, currentTime);
+
+    // Lock stderr, so that reports of workers are not interleaved
+    flockfile(stderr);
+    if ( numberOfCaptureWorkers > 1 ) {
+        fprintf(stderr, "\n[INFO] Flows of thread #%d\n", worker->id);
+    } else {
+        fprintf(stderr, "\n");
+    }
+    reportTopFlows(&worker->flowTable, worker->numberOfTopFlows, stderr);
+    funlockfile(stderr);
+
+    worker->lastFlowReportTime = currentTime;
+}
+
+/**
+ * Close the TCP streams idle for longer than the flow timeout, at most once a second.
+ *
+ * @param worker      the capture worker
+ * @param currentTime the current time in nanoseconds
+ */
+void expireIdleTcpStreams(struct CaptureWorker* worker, uint64_t currentTime) {
+    expireTcpStreams(&worker->tcpReassembler, currentTime);
+    worker->lastStreamExpiryTime = currentTime;
+}
+
+/**
+ * Dump the contiguous data of a TCP stream, and the events of the stream,
+ * into the log file of the worker.
+ *
+ * @param stream    the stream
+ * @param direction the direction of the data
+ * @param event     TCP_STREAM_EVENT_DATA, TCP_STREAM_EVENT_GAP or TCP_STREAM_EVENT_CLOSED
+ * @param data      the data, NULL for other events
+ * @param length    the length of the data, or the number of bytes missing
+ * @param context   the capture worker
+ */
+void handleTcpStreamEvent(struct TcpStream* stream, int direction, int event, 
+        const unsigned char* data, uint32_t length, void* context) {
+    FILE* logFile = ((struct CaptureWorker*) context)->logFile;
+    if ( logFile == NULL ) {
+        return;
+    }
+
+    // The key of the stream is oriented from client to server
+    const struct FlowKey* key = &stream->key;
+    uint32_t sourceAddress = direction == TCP_STREAM_CLIENT_TO_SERVER ? key->sourceAddress : key->destinationAddress;
+    uint32_t destinationAddress = direction == TCP_STREAM_CLIENT_TO_SERVER ? key->destinationAddress : key->sourceAddress;
+    uint16_t sourcePort = direction == TCP_STREAM_CLIENT_TO_SERVER ? key->sourcePort : key->destinationPort;
+    uint16_t destinationPort = direction == TCP_STREAM_CLIENT_TO_SERVER ? key->destinationPort : key->sourcePort;
+
+    fprintf(logFile, "\n***********************TCP Stream*************************\n");
+    fprintf(logFile, "   |-Source               : %u.%u.%u.%u:%u\n", sourceAddress >> 24, (sourceAddress >> 16) & 0xff, 
+        (sourceAddress >> 8) & 0xff, sourceAddress & 0xff, sourcePort);
+    fprintf(logFile, "   |-Destination          : %u.%u.%u.%u:%u\n", destinationAddress >> 24, (destinationAddress >> 16) & 0xff, 
+        (destinationAddress >> 8) & 0xff, destinationAddress & 0xff, destinationPort);
+    if ( event == TCP_STREAM_EVENT_CLOSED ) {
+        fprintf(logFile, "   |-Stream Closed        : %llu Bytes Sent, %llu Bytes Received\n", 
+            (unsigned long long) stream->halves[TCP_STREAM_CLIENT_TO_SERVER].deliveredBytes, 
+            (unsigned long long) stream->halves[TCP_STREAM_SERVER_TO_CLIENT].deliveredBytes);
+        return;
+    }
+    fprintf(logFile, "   |-Stream Offset        : %llu\n", (unsigned long long) stream->halves[direction].deliveredBytes);
+    if ( event == TCP_STREAM_EVENT_GAP ) {
+        fprintf(logFile, "   |-Missing Bytes        : %u\n", length);
+        return;
+    }
+    fprintf(logFile, "Data Payload\n");
+    parseDataPayload((unsigned char*) data, length, logFile);
+}
+
+/**
+ * Capture packets with one recvfrom call for each packet.
+ *
+ * @param  worker the capture worker
+ * @return -1 if an error occurred while receiving packets
+ */
+int captureWithRecvfrom(struct CaptureWorker* worker) {
+    // Buffer for receiving packets
+    unsigned char* buffer = (unsigned char*) malloc(BUFFER_SIZE);
+
+    while ( isRunning ) {
         struct sockaddr_in serverSocketAddr;
         socklen_t sockaddrSize = sizeof(struct sockaddr);
 
-        // Receive a packet
-        int receivedDataSize = recvfrom(rawSocketFileDescriptor, buffer, BUFFER_SIZE, 0, 
+        // Receive at most the snap length of a packet, MSG_TRUNC returns its length on the wire
+        int receivedDataSize = recvfrom(worker->rawSocketFileDescriptor, buffer, worker->snapLength, MSG_TRUNC, 
                                 (struct sockaddr *)(&serverSocketAddr), &sockaddrSize);
         if ( receivedDataSize < 0 ) {
+            if ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ) {
+                handleIdleCaptureWorker(worker);
+                continue;
+            }
             fprintf(stderr, "[ERROR] An error occurred while receiving data packets: %s.\n", strerror(errno));
-            return EXIT_FAILURE;
+            free(buffer);
+            return -1;
         }
 
-        // Parse data packet
-        parseDataPacket(buffer, receivedDataSize, logFile);
+        // Handle the packet
+        struct timespec timestamp;
+        clock_gettime(CLOCK_REALTIME, &timestamp);
+        unsigned int capturedLength = receivedDataSize < worker->snapLength ? receivedDataSize : worker->snapLength;
+        if ( handleCapturedPacket(worker, buffer, capturedLength, receivedDataSize, &timestamp) == -1 ) {
+            free(buffer);
+            return -1;
+        }
     }
+    free(buffer);
 
-    // Close file descriptor for file and socket
-    close(rawSocketFileDescriptor);
-    fclose(logFile);
-
-    return EXIT_SUCCESS;
+    return 0;
 }
 
 /**
- * Detect the type of the packet, and parse them respectively.
- * 
- * @param buffer     the buffer for receiving data
- * @param packetSize the size of received data
- * @param logFile    the file descriptor of log file
+ * Feed the packets of a capture file through the same stages as captured
+ * packets, as fast as possible. The file is mapped into the memory, so
+ * packets are handled in place.
+ *
+ * @param  worker the capture worker
+ * @return 0 if all packets in the file are handled
  */
-void parseDataPacket(unsigned char* buffer, int packetSize, FILE* logFile) {
-    /*
-     * Static variables for statistics.
-     */
-    static int tcpPacketsReceived = 0,
-               udpPacketsReceived = 0,
-               icmpPacketsReceived = 0,
-               igmpPacketsReceived = 0,
-               otherPacketsReceived = 0,
-               totalPacketsReceived = 0;
+int replayCaptureFile(struct CaptureWorker* worker) {
+    struct CaptureFileReader reader;
+    if ( openCaptureFileReader(&reader, worker->replayFilePath) == -1 ) {
+        return -1;
+    }
 
-    ++ totalPacketsReceived;
+    const unsigned char* packet = NULL;
+    unsigned int capturedLength = 0, originalLength = 0;
+    struct timespec timestamp;
+    int result = 0;
+    uint64_t startTime = getMonotonicTime();
 
-    /*
-     * Parse IP protocol of this packet, where ethernet header is excluded.
-     */
-    struct iphdr *iph = (struct iphdr*)(buffer + sizeof(struct ethhdr));
+    worker->stageStartTime = startTime;
+    while ( isRunning && (result = readCapturedPacket(&reader, &packet, &capturedLength, &originalLength, &timestamp)) == 1 ) {
+        recordStageTime(worker, STAGE_READ);
 
-    switch ( iph->protocol ) {
-        case IPPROTO_ICMP:
-            ++ icmpPacketsReceived;
-            parseIcmpPacket(buffer, packetSize, logFile);
+        // Periodic work is driven by the time in the file, instead of the wall clock
+        uint64_t packetTime = timestamp.tv_sec * NANOSECONDS_PER_SECOND + timestamp.tv_nsec;
+        if ( worker->statistics.totalPacketsReceived == 0 ) {
+            worker->lastFlowReportTime = packetTime;
+            worker->lastStreamExpiryTime = packetTime;
+        }
+        worker->lastPacketTime = packetTime;
+        worker->replayedBytes += capturedLength;
 
+        if ( handleCapturedPacket(worker, (unsigned char*) packet, capturedLength, originalLength, &timestamp) == -1 ) {
+            result = -1;
             break;
+        }
+    }
+    worker->replayTime = getMonotonicTime() - startTime;
+    closeCaptureFileReader(&reader);
 
-        case IPPROTO_IGMP:
-            ++ igmpPacketsReceived;
-            break;
-        
-        case IPPROTO_TCP:
-            ++ tcpPacketsReceived;
-            parseTcpPacket(buffer, packetSize, logFile);
+    return result == -1 ? -1 : 0;
+}
 
-            break;
-        
-        case IPPROTO_UDP:
-            ++ udpPacketsReceived;
-            parseUdpPacket(buffer, packetSize, logFile);
+/**
+ * Get the time of the monotonic clock.
+ *
+ * @return the time in nanoseconds
+ */
+uint64_t getMonotonicTime() {
+    struct timespec currentTime;
+    clock_gettime(CLOCK_MONOTONIC, &currentTime);
+    return currentTime.tv_sec * NANOSECONDS_PER_SECOND + currentTime.tv_nsec;
+}
 
-            break;
-        
-        default:
-            ++ otherPacketsReceived;
-            break;
+/**
+ * Account the time since the previous stage ended to a stage.
+ *
+ * @param worker the capture worker
+ * @param stage  the stage that just ended
+ */
+void recordStageTime(struct CaptureWorker* worker, int stage) {
+    uint64_t currentTime = getMonotonicTime();
+
+    worker->stageTimes[stage] += currentTime - worker->stageStartTime;
+    worker->stageStartTime = currentTime;
+}
+
+/**
+ * Set up a TPACKET_V3 RX ring for the raw socket and map it into memory.
+ *
+ * @param  rawSocketFileDescriptor the file descriptor of the raw socket
+ * @param  ring                    the ring buffer to set up
+ * @param  blockSize               the size of each block, a multiple of the page size
+ * @param  blockCount              the number of blocks
+ * @return -1 if the ring cannot be set up
+ */
+int setupRingBuffer(int rawSocketFileDescriptor, struct RingBuffer* ring, unsigned int blockSize, unsigned int blockCount) {
+    int version = TPACKET_V3;
+    if ( setsockopt(rawSocketFileDescriptor, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1 ) {
+        return -1;
+    }
+
+    struct tpacket_req3 request;
+    memset(&request, 0, sizeof(request));
+    request.tp_block_size = blockSize;
+    request.tp_block_nr = blockCount;
+    request.tp_frame_size = RING_FRAME_SIZE;
+    request.tp_frame_nr = (blockSize / RING_FRAME_SIZE) * blockCount;
+    request.tp_retire_blk_tov = RING_BLOCK_TIMEOUT;
+    if ( setsockopt(rawSocketFileDescriptor, SOL_PACKET, PACKET_RX_RING, &request, sizeof(request)) == -1 ) {
+        return -1;
     }
-    printf("Packets Stat: TCP : %d   UDP : %d   ICMP : %d   IGMP : %d   Others : %d   Total : %d\r", 
-        tcpPacketsReceived, udpPacketsReceived, icmpPacketsReceived, igmpPacketsReceived, 
-        otherPacketsReceived, totalPacketsReceived);
+
+    ring->blockSize = blockSize;
+    ring->blockCount = blockCount;
+    ring->mapSize = (size_t) blockSize * blockCount;
+    ring->map = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rawSocketFileDescriptor, 0);
+    if ( ring->map == MAP_FAILED ) {
+        return -1;
+    }
+    return 0;
 }
 
 /**
- * Parse the header of the ethernet packet.
- * 
- * @param buffer     the buffer for receiving data
- * @param packetSize the size of received data
- * @param logFile    the file descriptor of log file
- */
-void parseEthernetHeader(unsigned char* buffer, int packetSize, FILE* logFile) {
-    struct ethhdr* eth = (struct ethhdr *) buffer;
-
-    fprintf(logFile, "\n");
-    fprintf(logFile, "Ethernet Header\n");
-    fprintf(logFile, "   |-Destination Address  : %.2X-%.2X-%.2X-%.2X-%.2X-%.2X \n", eth->h_dest[0], eth->h_dest[1], eth->h_dest[2], eth->h_dest[3], eth->h_dest[4], eth->h_dest[5]);
-    fprintf(logFile, "   |-Source Address       : %.2X-%.2X-%.2X-%.2X-%.2X-%.2X \n", eth->h_source[0], eth->h_source[1], eth->h_source[2], eth->h_source[3], eth->h_source[4], eth->h_source[5]);
-    fprintf(logFile, "   |-Protocol             : %u \n", (unsigned short)eth->h_proto);
+ * Capture packets from the RX ring.
+ *
+ * Packets are parsed in place, and the socket is only polled when the
+ * next block isn't handed over to the user space yet, so there is no
+ * system call for each packet.
+ *
+ * @param  worker the capture worker
+ * @return -1 if an error occurred while receiving packets
+ */
+int captureWithRingBuffer(struct CaptureWorker* worker) {
+    struct RingBuffer* ring = &worker->ring;
+    struct pollfd pollFileDescriptor = {worker->rawSocketFileDescriptor, POLLIN | POLLERR, 0};
+    unsigned int blockIndex = 0;
+
+    while ( isRunning ) {
+        struct tpacket_block_desc* block = (struct tpacket_block_desc*) (ring->map + (size_t) blockIndex * ring->blockSize);
+
+        // Wait until the kernel retires the block
+        if ( (__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0 ) {
+            int events = poll(&pollFileDescriptor, 1, CAPTURE_POLL_TIMEOUT);
+            if ( events == -1 && errno != EINTR ) {
+                fprintf(stderr, "[ERROR] An error occurred while waiting for data packets: %s.\n", strerror(errno));
+                return -1;
+            }
+            if ( events == 0 ) {
+                handleIdleCaptureWorker(worker);
+            }
+            continue;
+        }
+
+        // Walk through the packets in the block
+        unsigned int numberOfPackets = block->hdr.bh1.num_pkts;
+        struct tpacket3_hdr* packetHeader = (struct tpacket3_hdr*) ((unsigned char*) block + block->hdr.bh1.offset_to_first_pkt);
+        unsigned int i = 0;
+        for ( i = 0; i < numberOfPackets; ++ i ) {
+            unsigned char* packet = (unsigned char*) packetHeader + packetHeader->tp_mac;
+            struct timespec timestamp = {packetHeader->tp_sec, packetHeader->tp_nsec};
+
+            if ( handleCapturedPacket(worker, packet, packetHeader->tp_snaplen, packetHeader->tp_len, &timestamp) == -1 ) {
+                return -1;
+            }
+            packetHeader = (struct tpacket3_hdr*) ((unsigned char*) packetHeader + packetHeader->tp_next_offset);
+        }
+
+        // Hand the block back to the kernel
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        blockIndex = (blockIndex + 1) % ring->blockCount;
+    }
+    return 0;
 }
 
 /**
- * Parse the header of the IP packet.
- * 
- * @param buffer     the buffer for receiving data
- * @param packetSize the size of received data
- * @param logFile    the file descriptor of log file
+ * Unmap the RX ring.
+ *
+ * @param ring the ring buffer to release
  */
-void parseIpHeader(unsigned char* buffer, int packetSize, FILE* logFile) {
-    /**
-     * Parse Ethernet Header
-     */
-    parseEthernetHeader(buffer, packetSize, logFile);
-
-    struct iphdr* iph = (struct iphdr*)(buffer + sizeof(struct ethhdr));
-
-    // Parse the source and destination of the IP packet
-    socklen_t sockaddrSize = sizeof(struct sockaddr);
-    struct sockaddr_in srcSocketAddr, destSocketAddr;
-
-    memset(&srcSocketAddr, 0, sockaddrSize);
-    memset(&destSocketAddr, 0, sockaddrSize);
-
-    srcSocketAddr.sin_addr.s_addr = iph->saddr;
-    destSocketAddr.sin_addr.s_addr = iph->daddr;
-
-    // Parse other information in IP packet
-    fprintf(logFile, "\n");
-    fprintf(logFile, "IP Header\n");
-    fprintf(logFile, "   |-IP Version           : %d\n", (unsigned int) iph->version);
-    fprintf(logFile, "   |-IP Header Length     : %d Bytes\n", ((unsigned int) (iph->ihl)) * 4);
-    fprintf(logFile, "   |-Type Of Service      : %d\n", (unsigned int)iph->tos);
-    fprintf(logFile, "   |-IP Total Length      : %d Bytes\n", ntohs(iph->tot_len));
-    fprintf(logFile, "   |-Identification       : %d\n", ntohs(iph->id));
-    fprintf(logFile, "   |-TTL                  : %d\n", (unsigned int) iph->ttl);
-    fprintf(logFile, "   |-Protocol             : %d\n", (unsigned int) iph->protocol);
-    fprintf(logFile, "   |-Checksum             : %d\n", ntohs(iph->check));
-    fprintf(logFile, "   |-Source IP            : %s\n", inet_ntoa(srcSocketAddr.sin_addr));
-    fprintf(logFile, "   |-Destination IP       : %s\n", inet_ntoa(destSocketAddr.sin_addr));
+void releaseRingBuffer(struct RingBuffer* ring) {
+    munmap(ring->map, ring->mapSize);
 }
 
 /**
- * Get the length of IP header.
- * @param buffer     the buffer for receiving data
- * @return the length of IP header
+ * Print the rates of packets once per interval until capturing stops, with
+ * the packets dropped by the kernel during the interval.
+ * Workers never print the statistics, so the hot path only bumps counters.
  */
-unsigned short getIpHeaderLength(unsigned char* buffer) {
-    struct iphdr* iph = (struct iphdr*)(buffer + sizeof(struct ethhdr));
-    return iph->ihl * 4;
+void reportStatistics() {
+    int timerFileDescriptor = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if ( timerFileDescriptor == -1 ) {
+        fprintf(stderr, "[WARN] Unable to create the timer of statistics: %s.\n", strerror(errno));
+        return;
+    }
+    struct itimerspec interval = {{STATISTICS_INTERVAL, 0}, {STATISTICS_INTERVAL, 0}};
+    timerfd_settime(timerFileDescriptor, 0, &interval, NULL);
+
+    struct PacketStatistics previous;
+    memset(&previous, 0, sizeof(previous));
+    uint64_t previousTime = getMonotonicTime();
+
+    while ( isRunning ) {
+        // Interrupted by SIGINT and SIGTERM, or a worker that failed within an interval
+        uint64_t numberOfExpirations = 0;
+        if ( read(timerFileDescriptor, &numberOfExpirations, sizeof(numberOfExpirations)) == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            fprintf(stderr, "[WARN] Unable to read the timer of statistics: %s.\n", strerror(errno));
+            break;
+        }
+        struct PacketStatistics current;
+        struct KernelStatistics kernel;
+        sumPacketStatistics(&current);
+        readKernelStatistics(&kernel);
+
+        uint64_t currentTime = getMonotonicTime();
+        double seconds = (double) (currentTime - previousTime) / NANOSECONDS_PER_SECOND;
+        printf("Packets Stat: %.0f pps   %.2f Mbps   TCP : %.0f   UDP : %.0f   ICMP : %.0f   IGMP : %.0f   "
+            "Others : %.0f   Dropped : %llu   Queue Freezes : %llu\n", 
+            (current.totalPacketsReceived - previous.totalPacketsReceived) / seconds, 
+            (current.totalBytesReceived - previous.totalBytesReceived) * 8 / seconds / 1e6, 
+            (current.tcpPacketsReceived - previous.tcpPacketsReceived) / seconds, 
+            (current.udpPacketsReceived - previous.udpPacketsReceived) / seconds, 
+            (current.icmpPacketsReceived - previous.icmpPacketsReceived) / seconds, 
+            (current.igmpPacketsReceived - previous.igmpPacketsReceived) / seconds, 
+            (current.otherPacketsReceived - previous.otherPacketsReceived) / seconds, 
+            (unsigned long long) kernel.droppedPackets, (unsigned long long) kernel.queueFreezes);
+        fflush(stdout);
+
+        previous = current;
+        previousTime = currentTime;
+    }
+    close(timerFileDescriptor);
 }
 
 /**
- * Parse the ICMP packet.
- * 
- * @param buffer     the buffer for receiving data
- * @param packetSize the size of received data
- * @param logFile    the file descriptor of log file
+ * Sum the statistics of all workers.
+ * Each counter is only written by its own worker, so a stale value just
+ * moves a packet to the next interval.
+ *
+ * @param total the sum of the statistics
  */
-void parseIcmpPacket(unsigned char* buffer, int packetSize, FILE* logFile) {
-    unsigned short iphdrlen = getIpHeaderLength(buffer);
+void sumPacketStatistics(struct PacketStatistics* total) {
+    memset(total, 0, sizeof(struct PacketStatistics));
 
-    struct icmphdr *icmph = (struct icmphdr*)(buffer + iphdrlen  + sizeof(struct ethhdr));
-    unsigned short hdrlen = sizeof(struct ethhdr) + iphdrlen + sizeof(struct icmphdr);
+    int i = 0;
+    for ( i = 0; i < numberOfCaptureWorkers; ++ i ) {
+        struct PacketStatistics* statistics = &captureWorkers[i].statistics;
 
-    fprintf(logFile, "\n***********************ICMP Packet************************\n");
+        total->tcpPacketsReceived += __atomic_load_n(&statistics->tcpPacketsReceived, __ATOMIC_RELAXED);
+        total->udpPacketsReceived += __atomic_load_n(&statistics->udpPacketsReceived, __ATOMIC_RELAXED);
+        total->icmpPacketsReceived += __atomic_load_n(&statistics->icmpPacketsReceived, __ATOMIC_RELAXED);
+        total->igmpPacketsReceived += __atomic_load_n(&statistics->igmpPacketsReceived, __ATOMIC_RELAXED);
+        total->otherPacketsReceived += __atomic_load_n(&statistics->otherPacketsReceived, __ATOMIC_RELAXED);
+        total->totalPacketsReceived += __atomic_load_n(&statistics->totalPacketsReceived, __ATOMIC_RELAXED);
+        total->totalBytesReceived += __atomic_load_n(&statistics->totalBytesReceived, __ATOMIC_RELAXED);
+    }
+}
 
-    // Parse ethernet packet and IP packet first.
-    parseIpHeader(buffer, packetSize, logFile);
+/**
+ * Read the statistics of all sockets from the kernel, and add them to the
+ * totals of the workers. The kernel resets its counters on every read, so
+ * this is only called from the main thread.
+ *
+ * @param delta the packets received and dropped since the last read
+ */
+void readKernelStatistics(struct KernelStatistics* delta) {
+    memset(delta, 0, sizeof(struct KernelStatistics));
 
-    // Parse ICMP packet
-    fprintf(logFile, "\n");
-    fprintf(logFile, "ICMP Header\n");
-    fprintf(logFile, "   |-Type                 : %d ", (unsigned int)(icmph->type));
+    int i = 0;
+    for ( i = 0; i < numberOfCaptureWorkers; ++ i ) {
+        // The kernel fills struct tpacket_stats if the ring isn't TPACKET_V3
+        struct tpacket_stats_v3 statistics;
+        memset(&statistics, 0, sizeof(statistics));
+        socklen_t statisticsSize = sizeof(statistics);
 
-    if ( (unsigned int)(icmph->type) == 11 ) {
-        fprintf(logFile, "  (TTL Expired)\n");
-    } else if ( (unsigned int)(icmph->type) == ICMP_ECHOREPLY ) {
-        fprintf(logFile, "  (ICMP Echo Reply)\n");
-    } else {
-        fprintf(logFile, "\n");
+        if ( getsockopt(captureWorkers[i].rawSocketFileDescriptor, SOL_PACKET, PACKET_STATISTICS, 
+                &statistics, &statisticsSize) == -1 ) {
+            continue;
+        }
+        struct KernelStatistics* total = &captureWorkers[i].kernelStatistics;
+        total->receivedPackets += statistics.tp_packets;
+        total->droppedPackets += statistics.tp_drops;
+        total->queueFreezes += statistics.tp_freeze_q_cnt;
+
+        delta->receivedPackets += statistics.tp_packets;
+        delta->droppedPackets += statistics.tp_drops;
+        delta->queueFreezes += statistics.tp_freeze_q_cnt;
     }
+}
 
-    fprintf(logFile, "   |-Code                 : %d\n", (unsigned int)(icmph->code));
-    fprintf(logFile, "   |-Checksum             : %d\n", ntohs(icmph->checksum));
-    fprintf(logFile, "\n");
+/**
+ * Print the number of packets received by all workers.
+ */
+void printPacketStatistics() {
+    struct PacketStatistics total;
+    sumPacketStatistics(&total);
 
-    fprintf(logFile, "IP Header\n");
-    parseDataPayload(buffer, iphdrlen, logFile);
-         
-    fprintf(logFile, "TCP Header\n");
-    parseDataPayload(buffer + iphdrlen, sizeof(struct icmphdr), logFile);
-         
-    fprintf(logFile, "Data Payload\n");
-    parseDataPayload(buffer + hdrlen, packetSize - hdrlen, logFile);
+    printf("Packets Stat: TCP : %llu   UDP : %llu   ICMP : %llu   IGMP : %llu   Others : %llu   Total : %llu   Bytes : %llu\r", 
+        (unsigned long long) total.tcpPacketsReceived, (unsigned long long) total.udpPacketsReceived, 
+        (unsigned long long) total.icmpPacketsReceived, (unsigned long long) total.igmpPacketsReceived, 
+        (unsigned long long) total.otherPacketsReceived, (unsigned long long) total.totalPacketsReceived, 
+        (unsigned long long) total.totalBytesReceived);
 }
 
 /**
- * Parse the TCP packet.
- * 
- * @param buffer     the buffer for receiving data
- * @param packetSize the size of received data
- * @param logFile    the file descriptor of log file
- */
-void parseTcpPacket(unsigned char* buffer, int packetSize, FILE* logFile) {
-    unsigned short iphdrlen = getIpHeaderLength(buffer);
-
-    struct tcphdr* tcph = (struct tcphdr*)(buffer + iphdrlen + sizeof(struct ethhdr));
-    unsigned short hdrlen = sizeof(struct ethhdr) + iphdrlen + tcph->doff * 4;
-
-    fprintf(logFile, "\n***********************TCP Packet*************************\n");
-
-    // Parse ethernet packet and IP packet first.
-    parseIpHeader(buffer, packetSize, logFile);
-
-    // Parse TCP packet
-    fprintf(logFile, "\n");
-    fprintf(logFile, "TCP Header\n");
-    fprintf(logFile, "   |-Source Port          : %u\n", ntohs(tcph->source));
-    fprintf(logFile, "   |-Destination Port     : %u\n", ntohs(tcph->dest));
-    fprintf(logFile, "   |-Sequence Number      : %u\n", ntohl(tcph->seq));
-    fprintf(logFile, "   |-Acknowledge Number   : %u\n", ntohl(tcph->ack_seq));
-    fprintf(logFile, "   |-Header Length        : %d Bytes\n" , (unsigned int)tcph->doff * 4);
-    fprintf(logFile, "   |-Urgent Flag          : %d\n", (unsigned int)tcph->urg);
-    fprintf(logFile, "   |-Acknowledgement Flag : %d\n", (unsigned int)tcph->ack);
-    fprintf(logFile, "   |-Push Flag            : %d\n", (unsigned int)tcph->psh);
-    fprintf(logFile, "   |-Reset Flag           : %d\n", (unsigned int)tcph->rst);
-    fprintf(logFile, "   |-Synchronise Flag     : %d\n", (unsigned int)tcph->syn);
-    fprintf(logFile, "   |-Finish Flag          : %d\n", (unsigned int)tcph->fin);
-    fprintf(logFile, "   |-Window               : %d\n", ntohs(tcph->window));
-    fprintf(logFile, "   |-Checksum             : %d\n", ntohs(tcph->check));
-    fprintf(logFile, "   |-Urgent Pointer       : %d\n", tcph->urg_ptr);
-    fprintf(logFile, "\n                        DATA Dump                         \n");
-         
-    fprintf(logFile, "IP Header\n");
-    parseDataPayload(buffer, iphdrlen, logFile);
-         
-    fprintf(logFile, "TCP Header\n");
-    parseDataPayload(buffer + iphdrlen, tcph->doff * 4, logFile);
-         
-    fprintf(logFile, "Data Payload\n");
-    if ( packetSize - hdrlen != 0 ) {
-        parseDataPayload(buffer + hdrlen, packetSize - hdrlen, logFile);
-    } else {
-        fprintf(logFile, "    (Empty)\n");
+ * Print the number of packets received and dropped by the kernel on all
+ * sockets since capturing started.
+ */
+void printKernelStatistics() {
+    struct KernelStatistics delta, total;
+    readKernelStatistics(&delta);
+    memset(&total, 0, sizeof(total));
+
+    int i = 0;
+    for ( i = 0; i < numberOfCaptureWorkers; ++ i ) {
+        total.receivedPackets += captureWorkers[i].kernelStatistics.receivedPackets;
+        total.droppedPackets += captureWorkers[i].kernelStatistics.droppedPackets;
+        total.queueFreezes += captureWorkers[i].kernelStatistics.queueFreezes;
     }
+    fprintf(stderr, "[INFO] Kernel Stat: Received : %llu   Dropped : %llu   Queue Freezes : %llu\n", 
+        (unsigned long long) total.receivedPackets, (unsigned long long) total.droppedPackets, 
+        (unsigned long long) total.queueFreezes);
 }
 
 /**
- * Parse the UDP packet.
- * 
- * @param buffer     the buffer for receiving data
- * @param packetSize the size of received data
- * @param logFile    the file descriptor of log file
- */
-void parseUdpPacket(unsigned char* buffer, int packetSize, FILE* logFile) {
-    unsigned short iphdrlen = getIpHeaderLength(buffer);
-    struct udphdr* udph = (struct udphdr*)(buffer + iphdrlen  + sizeof(struct ethhdr));
-    unsigned short hdrlen = sizeof(struct ethhdr) + iphdrlen + sizeof(struct udphdr);
-    
-    fprintf(logFile, "\n***********************UDP Packet*************************\n");
-
-    // Parse ethernet packet and IP packet first.
-    parseIpHeader(buffer, packetSize, logFile);
-
-    // Parse UDP packet
-    fprintf(logFile, "\nUDP Header\n");
-    fprintf(logFile, "   |-Source Port          : %d\n", ntohs(udph->source));
-    fprintf(logFile, "   |-Destination Port     : %d\n", ntohs(udph->dest));
-    fprintf(logFile, "   |-UDP Length           : %d\n", ntohs(udph->len));
-    fprintf(logFile, "   |-UDP Checksum         : %d\n", ntohs(udph->check));
-    fprintf(logFile, "\n                        DATA Dump                         \n");
-     
-    fprintf(logFile, "IP Header\n");
-    parseDataPayload(buffer, iphdrlen, logFile);
-
-    fprintf(logFile, "UDP Header\n");
-    parseDataPayload(buffer + iphdrlen, sizeof(struct udphdr), logFile);
+ * Print the statistics of TCP stream reassembly of all workers.
+ */
+void printTcpReassemblyStatistics() {
+    unsigned long long closedStreams = 0, outOfOrderSegments = 0, gapBytes = 0, untrackedSegments = 0;
 
-    fprintf(logFile, "Data Payload\n");
-    parseDataPayload(buffer + hdrlen, packetSize - hdrlen, logFile);
+    int i = 0;
+    for ( i = 0; i < numberOfCaptureWorkers; ++ i ) {
+        struct TcpReassembler* reassembler = &captureWorkers[i].tcpReassembler;
+
+        closedStreams += reassembler->closedStreams;
+        outOfOrderSegments += reassembler->outOfOrderSegments;
+        gapBytes += reassembler->gapBytes;
+        untrackedSegments += reassembler->untrackedSegments;
+    }
+    fprintf(stderr, "[INFO] TCP Reassembly Stat: Streams : %llu   Out-of-order Segments : %llu   "
+        "Missing Bytes : %llu   Untracked Segments : %llu\n", 
+        closedStreams, outOfOrderSegments, gapBytes, untrackedSegments);
 }
 
 /**
- * Parse the data of the packet.
- * 
- * @param buffer     the buffer for receiving data
- * @param packetSize the size of received data
- * @param logFile    the file descriptor of log file
- */
-void parseDataPayload(unsigned char* buffer, int packetSize, FILE* logFile) {
-    int i = 0, j = 0;
-
-    for ( i = 0; i < packetSize; ++ i ) {
-        // If one line of hex printing is complete, the visible characters
-        // will be printed here.
-        if ( i != 0 && i % CHARS_PER_LINE == 0 ) {
-            fprintf(logFile, "         ");
-
-            for ( j = i - CHARS_PER_LINE; j < i; ++ j ) {
-                // If it isn't a number or alphabet, print a dot. Otherwise, 
-                // print the character.
-                if ( buffer[j] >= 32 && buffer[j] <= 128 ) {
-                    fprintf(logFile, "%c", (unsigned char) buffer[j]);
-                } else {
-                    fprintf(logFile, ".");
-                }
-            }
-            fprintf(logFile, "\n");
-        }
-        
-        // Print four spaces at new line
-        if ( i % CHARS_PER_LINE == 0 ) {
-            fprintf(logFile, "    ");
-        }
+ * Print the throughput of replaying the capture file, and the average time
+ * of each stage for a packet.
+ *
+ * @param worker the capture worker that replayed the file
+ */
+void printReplayStatistics(struct CaptureWorker* worker) {
+    static const char* stageNames[NUMBER_OF_STAGES] = {"Read", "Write", "Decode", "Parse", "Reassemble", "Flows"};
+    unsigned long long packets = worker->statistics.totalPacketsReceived;
+    double seconds = worker->replayTime / 1e9;
 
-        // Print the hex charcter in the data.
-        fprintf(logFile, "%02X ", (unsigned int) buffer[i]);
+    fprintf(stderr, "[INFO] Replay Stat: Packets : %llu   Bytes : %llu   Time : %.3f s   Rate : %.0f pps   Cost : %.1f ns/packet\n", 
+        packets, (unsigned long long) worker->replayedBytes, seconds, 
+        seconds > 0 ? packets / seconds : 0, packets > 0 ? (double) worker->replayTime / packets : 0);
+    if ( packets == 0 ) {
+        return;
+    }
 
-        // Print visible characters for the last line
-        if ( i == packetSize - 1 ) {
-            // Print extra spaces for alignment
-            for ( j = 0; j < 15 - i % 16; ++ j ) {
-                fprintf(logFile, "   ");
-            }
-            fprintf(logFile, "         ");
-
-            // Print visible characters on the right
-            for ( j = i - i % 16; j < i; ++ j ) {
-                if ( buffer[j] >= 32 && buffer[j] <= 128 ) {
-                    fprintf(logFile, "%c", (unsigned char) buffer[j]);
-                } else {
-                    fprintf(logFile, ".");
-                }
-            }
-            // Print \n at the end of data payload
-            fprintf(logFile,  "\n");
+    int isStageUsed[NUMBER_OF_STAGES] = {TRUE, worker->isCaptureFileWritten, TRUE, TRUE, 
+                                         worker->isTcpStreamReassembled, worker->isFlowTableUsed};
+    int i = 0;
+    for ( i = 0; i < NUMBER_OF_STAGES; ++ i ) {
+        if ( isStageUsed[i] ) {
+            fprintf(stderr, "   |-%-20s : %.1f ns/packet\n", stageNames[i], (double) worker->stageTimes[i] / packets);
         }
     }
+}
+
+/**
+ * Decide whether the data of a packet is dumped to the log file, either
+ * 1 in every N packets, or the first N packets of each flow. All packets
+ * are dumped if neither is set. Packets not tracked by the flow table,
+ * i.e. non-IPv4 packets and packets of new flows once the table is full,
+ * are always dumped when flows are sampled, so that they aren't lost.
+ *
+ * @param  worker      the capture worker, whose counter doesn't include the packet yet
+ * @param  flowPackets the number of packets of the flow so far, 0 if the flow isn't tracked
+ * @return whether the data of the packet is dumped
+ */
+int isPacketSampled(struct CaptureWorker* worker, uint64_t flowPackets) {
+    if ( worker->sampleInterval == 0 && worker->flowSampleCount == 0 ) {
+        return TRUE;
+    }
+    if ( worker->sampleInterval != 0 && worker->statistics.totalPacketsReceived % worker->sampleInterval == 0 ) {
+        return TRUE;
+    }
+    return worker->flowSampleCount != 0 && flowPackets <= worker->flowSampleCount;
+}
 
-}
\ No newline at end of file
+/**
+ * Parse a decimal integer, the whole text must be the number.
+ *
+ * @param  text    the text to parse
+ * @param  minimum the minimum value allowed
+ * @param  maximum the maximum value allowed
+ * @param  pValue  the value parsed
+ * @return -1 if the text isn't an integer in the range
+ */
+int parseInteger(const char* text, long minimum, long maximum, long* pValue) {
+    char* pEnd = NULL;
+    errno = 0;
+    long value = strtol(text, &pEnd, 10);
+    if ( errno != 0 || pEnd == text || *pEnd != 0 || value < minimum || value > maximum ) {
+        return -1;
+    }
+    *pValue = value;
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "server-core.h"
+
+/**
+ * Send a file to the client.
+ *
+ * The header "ACCEPT <size>\n" is followed by the content of the file, or
+ * "REJECT\n" is sent if the file cannot be opened. The size of the file lets
+ * clients know where the stream ends, so that they can pipeline requests.
+ *
+ * @param  clientSocketFD the file descriptor of the client socket
+ * @param  filePath       the path to the file
+ * @param  outputBuffer   the buffer for sending data
+ * @return -1 if the file stream failed to send
+ */
+int sendFileStream(int clientSocketFD, char* filePath, char* outputBuffer) {
+    FILE* inputFile = fopen(filePath, "rb");
+
+    struct stat fileStat;
+    if ( inputFile == NULL || fstat(fileno(inputFile), &fileStat) == -1 ) {
+        char* pMessage = "REJECT\n";
+        if ( inputFile != NULL ) {
+            fclose(inputFile);
+        }
+        return send(clientSocketFD, pMessage, strlen(pMessage), 0) == -1 ? -1 : 0;
+    }
+    char header[SERVER_BUFFER_SIZE] = {0};
+    snprintf(header, SERVER_BUFFER_SIZE, "ACCEPT %lld\n", (long long) fileStat.st_size);
+    if ( sendBuffer(clientSocketFD, header, strlen(header)) == -1 ) {
+        fclose(inputFile);
+        return -1;
+    }
+
+    // Send file stream, it's logged once as logging every chunk costs more than sending it
+    long long sentBytes = 0;
+    int readBytes = 0;
+    while ( (readBytes = fread(outputBuffer, sizeof(char), SERVER_BUFFER_SIZE, inputFile)) > 0 ) {
+        if ( sendBuffer(clientSocketFD, outputBuffer, readBytes) == -1 ) {
+            fclose(inputFile);
+            return -1;
+        }
+        sentBytes += readBytes;
+    }
+    fclose(inputFile);
+    fprintf(stderr, "[INFO] Sent %lld bytes\n", sentBytes);
+
+    return 0;
+}
+
+/**
+ * Send the whole buffer to the client. A send may be cut short by a signal,
+ * e.g. SIGUSR2 during a transfer, so the rest is sent again.
+ *
+ * @param  clientSocketFD the file descriptor of the client socket
+ * @param  buffer         the data to send
+ * @param  size           the size of the data
+ * @return -1 if the data failed to send
+ */
+int sendBuffer(int clientSocketFD, char* buffer, int size) {
+    int sentBytes = 0;
+    while ( sentBytes < size ) {
+        int bytes = send(clientSocketFD, buffer + sentBytes, size - sentBytes, MSG_NOSIGNAL);
+        if ( bytes == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        sentBytes += bytes;
+    }
+    return 0;
+}
+
+/**
+ * Convert all lower case characters to upper case.
+ * @param input  the string for input
+ * @param output the string for output
+ */
+void toUppercaseString(char* input, char* output) {
+    for ( ; *input; ++ input, ++ output ) {
+        *output = *input;
+
+        if ( *input >= 'a' && *input <= 'z' ) {
+            *output = *input - 'a' + 'A';
+        }
+    }
+
+    // Add the end character of at the end of string
+    *output = 0;
+}
+
+/**
+ * Get the size of the sequence tag at the beginning of a UDP datagram.
+ * Clients with requests in flight tag each datagram as "#<id>:<message>",
+ * and match the replies by the tag.
+ * @param  message the message received
+ * @return the size of the tag including '#' and ':', or 0 if the datagram isn't tagged
+ */
+int getDatagramTagSize(char* message) {
+    if ( message[0] != '#' ) {
+        return 0;
+    }
+
+    int i = 1;
+    while ( message[i] >= '0' && message[i] <= '9' ) {
+        ++ i;
+    }
+    return ( i > 1 && message[i] == ':' ) ? i + 1 : 0;
+}
@@ -0,0 +1,17 @@
+#ifndef SERVER_CORE_H
+#define SERVER_CORE_H
+
+/**
+ * The size of buffers for messages, and of each chunk of a file stream.
+ */
+#define SERVER_BUFFER_SIZE      1024
+
+/**
+ * Prototypes of functions.
+ */
+int sendFileStream(int clientSocketFD, char* filePath, char* outputBuffer);
+int sendBuffer(int clientSocketFD, char* buffer, int size);
+void toUppercaseString(char* input, char* output);
+int getDatagramTagSize(char* message);
+
+#endif
@@ -1,22 +1,62 @@
+#define _GNU_SOURCE     // for sched_setaffinity and sched_getcpu
+
 #include <errno.h>
 #include <fcntl.h>      // for opening socket
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>     // for closing socket
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+
+#include "server-core.h"
 
 #define TRUE                    1
 #define FALSE                   0
 
 #define MAX_PENDING_CONNECTIONS 4
 #define MAX_CONNECTIONS         32
-#define BUFFER_SIZE             1024
+#define BUFFER_SIZE             SERVER_BUFFER_SIZE
+
+/**
+ * Settings of handing the sockets off to a new binary on upgrade.
+ */
+#define HANDOFF_ENVIRONMENT_VARIABLE    "MULTIPLEX_SERVER_HANDOFF_FD"
+#define HANDOFF_TIMEOUT                 10      // in seconds, for the new server to start serving
+#define DRAIN_TIMEOUT                   60      // in seconds, for clients of the old server to disconnect
+#define HANDOFF_READY                   'R'
+
+/**
+ * Socket options of busy polling, which older C libraries don't define.
+ */
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL            46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL     69
+#endif
+
+/**
+ * Whether the server is asked to hand its sockets off to a new binary, set by SIGUSR2.
+ */
+static volatile sig_atomic_t isUpgradeRequested = FALSE;
+
+/**
+ * The arguments of the server, which the new binary is started with.
+ */
+static char** serverArguments = NULL;
 
 /**
  * Fix undefined reference to `max' issue.
@@ -28,9 +68,17 @@ static inline int max(int a, int b) {
 /**
  * Prototypes of functions.
  */
-int acceptConnections(int tcpSocketFileDescriptor, int udpSocketFileDescriptor);
+void printUsage(char* programName);
+int parseInteger(const char* text, long minimum, long maximum, int* pValue);
+int createServerSockets(int portNumber, int* pTcpSocketFileDescriptor, int* pUdpSocketFileDescriptor);
+void requestUpgrade(int signalNumber);
+int upgradeServer(int tcpSocketFileDescriptor, int udpSocketFileDescriptor);
+int receiveListeningSockets(int handoffSocketFileDescriptor, int* pTcpSocketFileDescriptor, int* pUdpSocketFileDescriptor);
+int setupLowLatencyMode(int tcpSocketFileDescriptor, int udpSocketFileDescriptor, int busyPollTime, int cpu);
+int acceptConnections(int tcpSocketFileDescriptor, int udpSocketFileDescriptor, int busyPollTime);
+int spinOnSockets(int maxFileDescriptor, fd_set* readFileDescriptorSet, int busyPollTime);
 int registerNewSocket(int clientSocketFD, int* clientSocketFileDescriptors, int n);
-void toUppercaseString(char* input, char* output);
+int handleTcpMessage(int clientSocketFD, char* message, char* outputBuffer);
 
 /**
  * The entrance of the server application.
@@ -40,17 +88,131 @@ void toUppercaseString(char* input, char* output);
  * @return 0 if the application exited normally
  */
 int main(int argc, char* argv[]) {
-    if ( argc != 2 ) {
-        fprintf(stderr, "Usage: %s PortNumber\n", argv[0]);
+    /*
+     * Parse options.
+     *
+     * -b, --busy-poll  spin on the sockets for the number of microseconds before blocking in select,
+     *                  and busy poll the device queue with SO_BUSY_POLL
+     * -c, --cpu        the core to pin the event loop to in busy-poll mode, the current one by default
+     */
+    int busyPollTime = 0;
+    int cpu = -1;
+    struct option longOptions[] = {
+        {"busy-poll",   required_argument, NULL, 'b'},
+        {"cpu",         required_argument, NULL, 'c'},
+        {NULL,          0,                 NULL, 0}
+    };
+    int option = 0;
+    while ( (option = getopt_long(argc, argv, "b:c:", longOptions, NULL)) != -1 ) {
+        switch ( option ) {
+            case 'b':
+                if ( parseInteger(optarg, 0, INT_MAX, &busyPollTime) == -1 ) {
+                    fprintf(stderr, "[ERROR] Invalid busy-poll time: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                if ( parseInteger(optarg, 0, CPU_SETSIZE - 1, &cpu) == -1 ) {
+                    fprintf(stderr, "[ERROR] Invalid CPU, expected 0 to %d: %s\n", CPU_SETSIZE - 1, optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if ( argc - optind != 1 || (cpu >= 0 && busyPollTime == 0) ) {
+        printUsage(argv[0]);
         return EXIT_FAILURE;
-    } 
+    }
 
-    int portNumber = atoi(argv[1]);
-    if ( portNumber <= 0 ) {
-        fprintf(stderr, "Usage: %s PortNumber\n", argv[0]);
+    int portNumber = 0;
+    if ( parseInteger(argv[optind], 1, 65535, &portNumber) == -1 ) {
+        printUsage(argv[0]);
         return EXIT_FAILURE;
     }
 
+    /*
+     * The old server passes the end of a Unix socket to the new binary on upgrade.
+     */
+    int handoffSocketFileDescriptor = -1;
+    char* handoffFileDescriptor = getenv(HANDOFF_ENVIRONMENT_VARIABLE);
+    if ( handoffFileDescriptor != NULL ) {
+        handoffSocketFileDescriptor = atoi(handoffFileDescriptor);
+        unsetenv(HANDOFF_ENVIRONMENT_VARIABLE);
+    }
+    serverArguments = argv;
+
+    /*
+     * Upgrade on SIGUSR2. SA_RESTART keeps transfers going, while pselect is still interrupted.
+     */
+    struct sigaction signalAction;
+    memset(&signalAction, 0, sizeof(signalAction));
+    signalAction.sa_handler = requestUpgrade;
+    signalAction.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &signalAction, NULL);
+
+    /*
+     * Create sockets, or take over the ones of the server being upgraded.
+     */
+    int tcpSocketFileDescriptor = -1;
+    int udpSocketFileDescriptor = -1;
+    if ( handoffSocketFileDescriptor != -1 ) {
+        if ( receiveListeningSockets(handoffSocketFileDescriptor, &tcpSocketFileDescriptor, &udpSocketFileDescriptor) == -1 ) {
+            fprintf(stderr, "[ERROR] Failed to take over the sockets of the old server: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    } else if ( createServerSockets(portNumber, &tcpSocketFileDescriptor, &udpSocketFileDescriptor) == -1 ) {
+        return EXIT_FAILURE;
+    }
+
+    /*
+     * Pin the event loop and enable busy polling in low-latency mode.
+     */
+    if ( busyPollTime > 0 && setupLowLatencyMode(tcpSocketFileDescriptor, udpSocketFileDescriptor, busyPollTime, cpu) == -1 ) {
+        return EXIT_FAILURE;
+    }
+
+    /*
+     * Tell the old server that the new one is serving, so that it stops accepting.
+     */
+    if ( handoffSocketFileDescriptor != -1 ) {
+        char message = HANDOFF_READY;
+        send(handoffSocketFileDescriptor, &message, 1, MSG_NOSIGNAL);
+        close(handoffSocketFileDescriptor);
+        fprintf(stderr, "[INFO] Took over the sockets of the old server\n");
+    }
+
+    /*
+     * Prepare for handling TCP and UDP connections using select.
+     */
+    int exitCode = acceptConnections(tcpSocketFileDescriptor, udpSocketFileDescriptor, busyPollTime);
+    if ( exitCode == -1 ) {
+        fprintf(stderr, "[ERROR] Server exit with an error: %s\n", strerror(errno));
+    }
+
+    /*
+     * Close Sockets.
+     */
+    close(tcpSocketFileDescriptor);
+    close(udpSocketFileDescriptor);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Create the TCP and UDP sockets, and bind them to the port.
+ *
+ * Sockets are closed on exec, the new binary gets them by handoff on upgrade
+ * instead, so that sockets of clients aren't leaked to it either.
+ *
+ * @param  portNumber               the port number to listen to
+ * @param  pTcpSocketFileDescriptor the file descriptor of TCP socket
+ * @param  pUdpSocketFileDescriptor the file descriptor of UDP socket
+ * @return -1 if the sockets cannot be created
+ */
+int createServerSockets(int portNumber, int* pTcpSocketFileDescriptor, int* pUdpSocketFileDescriptor) {
     /*
      * Create socket file descriptor.
      * Function Prototype: int socket(int domain, int type,int protocol)
@@ -61,12 +223,12 @@ int main(int argc, char* argv[]) {
      * @param protocol  if type is specified, this parameter can be assigned to 0.
      * @return -1 if socket is failed to create
      */
-    int tcpSocketFileDescriptor = socket(AF_INET, SOCK_STREAM, 0);
-    int udpSocketFileDescriptor = socket(AF_INET, SOCK_DGRAM, 0);
+    int tcpSocketFileDescriptor = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int udpSocketFileDescriptor = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
 
     if ( tcpSocketFileDescriptor == -1 || udpSocketFileDescriptor == -1 ) {
         fprintf(stderr, "[ERROR] Failed to create socket: %s\n", strerror(errno));
-        return EXIT_FAILURE;
+        return -1;
     }
 
     /*
@@ -127,11 +289,11 @@ int main(int argc, char* argv[]) {
      */
     if ( bind(tcpSocketFileDescriptor, (struct sockaddr*)(&serverSocketAddress), sockaddrSize) == -1) {
         fprintf(stderr, "[ERROR] Failed to bind TCP socket file descriptor to specified address: %s\n", strerror(errno));
-        return EXIT_FAILURE;
+        return -1;
     }
     if ( bind(udpSocketFileDescriptor, (struct sockaddr*)(&serverSocketAddress), sockaddrSize) == -1) {
         fprintf(stderr, "[ERROR] Failed to bind UDP socket file descriptor to specified address: %s\n", strerror(errno));
-        return EXIT_FAILURE;
+        return -1;
     }
 
     /*
@@ -145,33 +307,227 @@ int main(int argc, char* argv[]) {
      */
     if ( listen(tcpSocketFileDescriptor, MAX_PENDING_CONNECTIONS) == -1 ) {
         fprintf(stderr, "[ERROR] Failed to listen to the TCP socket: %s\n", strerror(errno));
-        return EXIT_FAILURE;
+        return -1;
     }
+    *pTcpSocketFileDescriptor = tcpSocketFileDescriptor;
+    *pUdpSocketFileDescriptor = udpSocketFileDescriptor;
 
-    /*
-     * Prepare for handling TCP and UDP connections using select.
-     */
-    int exitCode = acceptConnections(tcpSocketFileDescriptor, udpSocketFileDescriptor);
-    if ( exitCode == -1 ) {
-        fprintf(stderr, "[ERROR] Server exit with an error: %s\n", strerror(errno));
+    return 0;
+}
+
+/**
+ * Ask the server to upgrade in the event loop.
+ *
+ * @param signalNumber the number of the signal
+ */
+void requestUpgrade(int signalNumber) {
+    (void) signalNumber;
+    isUpgradeRequested = TRUE;
+}
+
+/**
+ * Start the binary of the server again, and hand the TCP and UDP sockets
+ * off to it with SCM_RIGHTS over a Unix socket.
+ *
+ * Pending connections stay in the queue of the listening socket, which
+ * both servers share, so no client is refused during the upgrade. The old
+ * server keeps serving until the new one reports that it's serving.
+ *
+ * @param  tcpSocketFileDescriptor the file descriptor of TCP socket
+ * @param  udpSocketFileDescriptor the file descriptor of UDP socket
+ * @return -1 if the new server failed to take over
+ */
+int upgradeServer(int tcpSocketFileDescriptor, int udpSocketFileDescriptor) {
+    int handoffSocketFileDescriptors[2];
+    if ( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, handoffSocketFileDescriptors) == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to create the handoff socket: %s\n", strerror(errno));
+        return -1;
     }
 
-    /*
-     * Close Sockets.
-     */
-    close(tcpSocketFileDescriptor);
-    close(udpSocketFileDescriptor);
+    pid_t processId = fork();
+    if ( processId == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to start the new server: %s\n", strerror(errno));
+        close(handoffSocketFileDescriptors[0]);
+        close(handoffSocketFileDescriptors[1]);
+        return -1;
+    } else if ( processId == 0 ) {
+        // Only the end of the new server is kept across exec
+        char handoffFileDescriptor[16] = {0};
+        snprintf(handoffFileDescriptor, sizeof(handoffFileDescriptor), "%d", handoffSocketFileDescriptors[1]);
+        fcntl(handoffSocketFileDescriptors[1], F_SETFD, 0);
+        setenv(HANDOFF_ENVIRONMENT_VARIABLE, handoffFileDescriptor, TRUE);
+
+        execvp(serverArguments[0], serverArguments);
+        fprintf(stderr, "[ERROR] Failed to execute %s: %s\n", serverArguments[0], strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    close(handoffSocketFileDescriptors[1]);
+
+    // Pass both sockets in one message, along with a byte of data
+    int socketFileDescriptors[2] = {tcpSocketFileDescriptor, udpSocketFileDescriptor};
+    char message = 0;
+    struct iovec messageVector = {&message, 1};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(socketFileDescriptors))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr messageHeader;
+    memset(&messageHeader, 0, sizeof(messageHeader));
+    messageHeader.msg_iov = &messageVector;
+    messageHeader.msg_iovlen = 1;
+    messageHeader.msg_control = control.buffer;
+    messageHeader.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr* controlHeader = CMSG_FIRSTHDR(&messageHeader);
+    controlHeader->cmsg_level = SOL_SOCKET;
+    controlHeader->cmsg_type = SCM_RIGHTS;
+    controlHeader->cmsg_len = CMSG_LEN(sizeof(socketFileDescriptors));
+    memcpy(CMSG_DATA(controlHeader), socketFileDescriptors, sizeof(socketFileDescriptors));
+
+    // Wait for the new server to be serving
+    int isTakenOver = FALSE;
+    if ( sendmsg(handoffSocketFileDescriptors[0], &messageHeader, MSG_NOSIGNAL) == 1 ) {
+        struct pollfd handoffSocket = {handoffSocketFileDescriptors[0], POLLIN, 0};
+        if ( poll(&handoffSocket, 1, HANDOFF_TIMEOUT * 1000) == 1 && 
+                recv(handoffSocketFileDescriptors[0], &message, 1, 0) == 1 && message == HANDOFF_READY ) {
+            isTakenOver = TRUE;
+        }
+    }
+    close(handoffSocketFileDescriptors[0]);
 
-    return EXIT_SUCCESS;
+    if ( !isTakenOver ) {
+        fprintf(stderr, "[ERROR] The new server failed to take over the sockets, keep serving\n");
+        kill(processId, SIGTERM);
+        waitpid(processId, NULL, 0);
+        return -1;
+    }
+    fprintf(stderr, "[INFO] The new server (PID %d) is serving, draining connections\n", (int) processId);
+
+    return 0;
+}
+
+/**
+ * Receive the TCP and UDP sockets from the old server.
+ *
+ * @param  handoffSocketFileDescriptor the Unix socket connected to the old server
+ * @param  pTcpSocketFileDescriptor    the file descriptor of TCP socket
+ * @param  pUdpSocketFileDescriptor    the file descriptor of UDP socket
+ * @return -1 if the sockets cannot be received
+ */
+int receiveListeningSockets(int handoffSocketFileDescriptor, int* pTcpSocketFileDescriptor, int* pUdpSocketFileDescriptor) {
+    int socketFileDescriptors[2];
+    char message = 0;
+    struct iovec messageVector = {&message, 1};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(socketFileDescriptors))];
+    } control;
+
+    struct msghdr messageHeader;
+    memset(&messageHeader, 0, sizeof(messageHeader));
+    messageHeader.msg_iov = &messageVector;
+    messageHeader.msg_iovlen = 1;
+    messageHeader.msg_control = control.buffer;
+    messageHeader.msg_controllen = sizeof(control.buffer);
+
+    // The sockets are closed on exec again, as the ones created by the server
+    if ( recvmsg(handoffSocketFileDescriptor, &messageHeader, MSG_CMSG_CLOEXEC) != 1 ) {
+        return -1;
+    }
+    struct cmsghdr* controlHeader = CMSG_FIRSTHDR(&messageHeader);
+    if ( controlHeader == NULL || controlHeader->cmsg_level != SOL_SOCKET || controlHeader->cmsg_type != SCM_RIGHTS || 
+            controlHeader->cmsg_len != CMSG_LEN(sizeof(socketFileDescriptors)) ) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(socketFileDescriptors, CMSG_DATA(controlHeader), sizeof(socketFileDescriptors));
+    *pTcpSocketFileDescriptor = socketFileDescriptors[0];
+    *pUdpSocketFileDescriptor = socketFileDescriptors[1];
+
+    return 0;
+}
+
+/**
+ * Print the usage of the server.
+ *
+ * @param programName the name of the program
+ */
+void printUsage(char* programName) {
+    fprintf(stderr, "Usage: %s [--busy-poll Microseconds [--cpu N]] PortNumber\n", programName);
+    fprintf(stderr, "Send SIGUSR2 to hand the sockets off to a new binary at the same path.\n");
+}
+
+/**
+ * Parse a decimal integer, the whole text must be the number.
+ *
+ * @param  text    the text to parse
+ * @param  minimum the minimum value allowed
+ * @param  maximum the maximum value allowed
+ * @param  pValue  the value parsed
+ * @return -1 if the text isn't an integer in the range
+ */
+int parseInteger(const char* text, long minimum, long maximum, int* pValue) {
+    char* pEnd = NULL;
+    errno = 0;
+    long value = strtol(text, &pEnd, 10);
+    if ( errno != 0 || pEnd == text || *pEnd != 0 || value < minimum || value > maximum ) {
+        return -1;
+    }
+    *pValue = (int) value;
+    return 0;
+}
+
+/**
+ * Pin the event loop to a core, and busy poll the device queue when the
+ * sockets are read, instead of waiting for the interrupt.
+ *
+ * Sockets accepted later inherit the options of the listening socket.
+ * Options that need CAP_NET_ADMIN only print a warning without it, since
+ * spinning on the sockets still saves the wakeup of select.
+ *
+ * @param  tcpSocketFileDescriptor the file descriptor of TCP socket
+ * @param  udpSocketFileDescriptor the file descriptor of UDP socket
+ * @param  busyPollTime            the time to busy poll in microseconds
+ * @param  cpu                     the core to pin to, -1 for the current one
+ * @return -1 if the event loop cannot be pinned
+ */
+int setupLowLatencyMode(int tcpSocketFileDescriptor, int udpSocketFileDescriptor, int busyPollTime, int cpu) {
+    if ( cpu < 0 && (cpu = sched_getcpu()) == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to get the current CPU: %s\n", strerror(errno));
+        return -1;
+    }
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+    if ( sched_setaffinity(0, sizeof(cpuSet), &cpuSet) == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to pin the server to CPU %d: %s\n", cpu, strerror(errno));
+        return -1;
+    }
+
+    int preferBusyPoll = 1;
+    int socketFileDescriptors[2] = {tcpSocketFileDescriptor, udpSocketFileDescriptor};
+    int i = 0;
+    for ( i = 0; i < 2; ++ i ) {
+        if ( setsockopt(socketFileDescriptors[i], SOL_SOCKET, SO_BUSY_POLL, &busyPollTime, sizeof(busyPollTime)) == -1 ||
+                setsockopt(socketFileDescriptors[i], SOL_SOCKET, SO_PREFER_BUSY_POLL, &preferBusyPoll, sizeof(preferBusyPoll)) == -1 ) {
+            fprintf(stderr, "[WARN] Failed to enable busy polling on the socket: %s\n", strerror(errno));
+        }
+    }
+    fprintf(stderr, "[INFO] Low-latency mode: pinned to CPU %d, spinning for %d us before blocking\n", cpu, busyPollTime);
+
+    return 0;
 }
 
 /**
  * Connections handler for the server.
  * @param  tcpSocketFileDescriptor the file descriptor of TCP socket
  * @param  udpSocketFileDescriptor the file descriptor of UDP socket
- * @return -1 if a severe error occurred in this procedure
+ * @param  busyPollTime            the time to spin before blocking in microseconds, 0 for blocking at once
+ * @return -1 if a severe error occurred in this procedure, 0 if the server was upgraded and drained
  */
-int acceptConnections(int tcpSocketFileDescriptor, int udpSocketFileDescriptor) {
+int acceptConnections(int tcpSocketFileDescriptor, int udpSocketFileDescriptor, int busyPollTime) {
     /**
      * The file descriptor used to check readability, if characters become available for reading.
      */
@@ -190,40 +546,90 @@ int acceptConnections(int tcpSocketFileDescriptor, int udpSocketFileDescriptor)
     struct sockaddr_in clientSocketAddress;
     int clientSocketFileDescriptors[MAX_CONNECTIONS] = {0};
 
+    /**
+     * Bytes received from each client that don't form a complete message yet.
+     */
+    static char pendingBuffers[MAX_CONNECTIONS][BUFFER_SIZE];
+    int pendingBufferSizes[MAX_CONNECTIONS] = {0};
+
+    /**
+     * After the sockets are handed off, only the connected clients are served until they disconnect.
+     */
+    int isDraining = FALSE;
+    time_t drainStartTime = 0;
+
+    /**
+     * SIGUSR2 is only delivered while waiting in pselect, otherwise a signal
+     * arriving after the check of isUpgradeRequested would be left until the
+     * next activity on the sockets.
+     */
+    sigset_t upgradeSignalSet, waitSignalSet;
+    sigemptyset(&upgradeSignalSet);
+    sigaddset(&upgradeSignalSet, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &upgradeSignalSet, &waitSignalSet);
+    sigdelset(&waitSignalSet, SIGUSR2);
+
     /**
      * Handle TCP and UDP connections.
      */
     while ( TRUE ) {
+        if ( isUpgradeRequested ) {
+            isUpgradeRequested = FALSE;
+            if ( !isDraining && upgradeServer(tcpSocketFileDescriptor, udpSocketFileDescriptor) == 0 ) {
+                isDraining = TRUE;
+                drainStartTime = time(NULL);
+            }
+        }
+
         /**
          * Clear the read file descriptor set.
          */
         FD_ZERO(&readFileDescriptorSet);
 
         /**
-         * Add file descriptor of TCP and UDP to the set.
+         * Add file descriptor of TCP and UDP to the set, unless the new server has taken them over.
          */
-        FD_SET(tcpSocketFileDescriptor, &readFileDescriptorSet);
-        FD_SET(udpSocketFileDescriptor, &readFileDescriptorSet);
-        int maxFileDescriptor = max(tcpSocketFileDescriptor, udpSocketFileDescriptor);
+        int maxFileDescriptor = -1;
+        if ( !isDraining ) {
+            FD_SET(tcpSocketFileDescriptor, &readFileDescriptorSet);
+            FD_SET(udpSocketFileDescriptor, &readFileDescriptorSet);
+            maxFileDescriptor = max(tcpSocketFileDescriptor, udpSocketFileDescriptor);
+        }
 
         /**
          * Add valid socket file descriptor to the read set.
          */
         int i = 0;
+        int numberOfClients = 0;
         for ( i = 0; i < MAX_CONNECTIONS; ++ i ) {
             int clientSocketFD = clientSocketFileDescriptors[i];
 
             if ( clientSocketFD > 0 ) {
                 FD_SET(clientSocketFD, &readFileDescriptorSet);
+                ++ numberOfClients;
             }
             if ( clientSocketFD > maxFileDescriptor ) {
                 maxFileDescriptor = clientSocketFD;
             }
         }
+        if ( isDraining && numberOfClients == 0 ) {
+            fprintf(stderr, "[INFO] All connections are drained, exiting\n");
+            return 0;
+        } else if ( isDraining && time(NULL) - drainStartTime >= DRAIN_TIMEOUT ) {
+            fprintf(stderr, "[WARN] %d connections are still open after %d seconds, closing them\n", 
+                numberOfClients, DRAIN_TIMEOUT);
+            for ( i = 0; i < MAX_CONNECTIONS; ++ i ) {
+                if ( clientSocketFileDescriptors[i] > 0 ) {
+                    close(clientSocketFileDescriptors[i]);
+                }
+            }
+            return 0;
+        }
 
         /*
          * Wait for an activity on one of the sockets, timeout is NULL, so wait indefinitely.
-         * Function Prototype: int select(int nfds, fd_set *readset, fd_set *writeset,fd_set* exceptset, struct tim *timeout);
+         * Function Prototype: int pselect(int nfds, fd_set *readset, fd_set *writeset, fd_set* exceptset, 
+         *                                 const struct timespec *timeout, const sigset_t *sigmask);
          * Defined in sys/select.h
          *
          * @param nfds      the max ID of file descriptor to check
@@ -231,17 +637,28 @@ int acceptConnections(int tcpSocketFileDescriptor, int udpSocketFileDescriptor)
          * @param writeset  the file descriptor used to check writability
          * @param exceptset the file descriptor used to check exceptions
          * @param timeout   the interval to be rounded up
+         * @param sigmask   the signal mask while waiting, which unblocks SIGUSR2 atomically
          * @return the number of file descriptors contained in the three returned descriptor sets
          */
-        int events = select(maxFileDescriptor + 1, &readFileDescriptorSet, NULL, NULL, NULL);
-        if ( events == -1 && errno != EINTR ) {
-            fprintf(stderr, "[ERROR] An error occurred while monitoring sockets: %s\n", strerror(errno));
+        int events = spinOnSockets(maxFileDescriptor, &readFileDescriptorSet, busyPollTime);
+        if ( events == 0 ) {
+            // Wake up once a second while draining, to check the timeout
+            struct timespec drainTimeout = {1, 0};
+            events = pselect(maxFileDescriptor + 1, &readFileDescriptorSet, NULL, NULL, 
+                        isDraining ? &drainTimeout : NULL, &waitSignalSet);
+        }
+        if ( events <= 0 ) {
+            // The set is undefined after an error, e.g. interrupted by SIGUSR2
+            if ( events == -1 && errno != EINTR ) {
+                fprintf(stderr, "[ERROR] An error occurred while monitoring sockets: %s\n", strerror(errno));
+            }
+            continue;
         }
 
-        // New incoming TCP connection
-        if ( FD_ISSET(tcpSocketFileDescriptor, &readFileDescriptorSet) ) {
+        // New incoming TCP connection, closed on exec so that it isn't leaked to the new server on upgrade
+        if ( !isDraining && FD_ISSET(tcpSocketFileDescriptor, &readFileDescriptorSet) ) {
             // Establish connection with client
-            int clientSocketFD = accept(tcpSocketFileDescriptor, (struct sockaddr *)(&clientSocketAddress), &sockaddrSize);
+            int clientSocketFD = accept4(tcpSocketFileDescriptor, (struct sockaddr *)(&clientSocketAddress), &sockaddrSize, SOCK_CLOEXEC);
 
             if ( clientSocketFD == -1 ) {
                 fprintf(stderr, "[WARN][TCP] Failed to accpet a socket from client: %s\n", strerror(errno));
@@ -262,7 +679,7 @@ int acceptConnections(int tcpSocketFileDescriptor, int udpSocketFileDescriptor)
         }
         
         // New incoming UDP connection
-        if ( FD_ISSET(udpSocketFileDescriptor, &readFileDescriptorSet) ) {
+        if ( !isDraining && FD_ISSET(udpSocketFileDescriptor, &readFileDescriptorSet) ) {
             // Receive a message from client
             int readBytes = recvfrom(udpSocketFileDescriptor, inputBuffer, BUFFER_SIZE, 0, (struct sockaddr *)(&clientSocketAddress), &sockaddrSize);
 
@@ -271,11 +688,14 @@ int acceptConnections(int tcpSocketFileDescriptor, int udpSocketFileDescriptor)
                     inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), strerror(errno));
                 continue;
             }
+            inputBuffer[readBytes < BUFFER_SIZE ? readBytes : BUFFER_SIZE - 1] = 0;
             fprintf(stderr, "[INFO][UDP] Received a message from client %s:%d: %s\n", 
                 inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), inputBuffer);
 
-            // Send a message to client
-            toUppercaseString(inputBuffer, outputBuffer);
+            // Send a message to client, the sequence tag of the datagram is echoed back as it is
+            int tagSize = getDatagramTagSize(inputBuffer);
+            memcpy(outputBuffer, inputBuffer, tagSize);
+            toUppercaseString(inputBuffer + tagSize, outputBuffer + tagSize);
             if ( sendto(udpSocketFileDescriptor, outputBuffer, strlen(outputBuffer), 0, (struct sockaddr *)(&clientSocketAddress), sockaddrSize) == -1 ) {
                 fprintf(stderr, "[ERROR][UDP] An error occurred while sending message to the client %s:%d: %s\nThe connection is going to close.\n", 
                     inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), strerror(errno));
@@ -287,63 +707,132 @@ int acceptConnections(int tcpSocketFileDescriptor, int udpSocketFileDescriptor)
             int clientSocketFD = clientSocketFileDescriptors[i];
 
             if ( FD_ISSET(clientSocketFD, &readFileDescriptorSet) ) {
-                // Receive a message from client
-                int readBytes = recv(clientSocketFD, inputBuffer, BUFFER_SIZE, 0);
+                // Receive messages from client, following the bytes left by the last read
+                char* pendingBuffer = pendingBuffers[i];
+                int readBytes = recv(clientSocketFD, pendingBuffer + pendingBufferSizes[i], 
+                                    BUFFER_SIZE - 1 - pendingBufferSizes[i], 0);
                 
                 if ( readBytes < 0 ) {
                     fprintf(stderr, "[ERROR][TCP] An error occurred while sending message to the client %s:%d: %s\nThe connection is going to close.\n", 
                         inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), strerror(errno));
                     continue;
                 }
-                fprintf(stderr, "[INFO][TCP] Received a message from client %s:%d: %s\n", 
-                    inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), inputBuffer);
+                pendingBufferSizes[i] += readBytes;
+
+                // Messages are terminated by '\0', and a client may pipeline several of them in one read
+                int isDisconnected = (readBytes == 0);
+                int offset = 0;
+                while ( !isDisconnected && offset < pendingBufferSizes[i] ) {
+                    char* pMessageEnd = memchr(pendingBuffer + offset, 0, pendingBufferSizes[i] - offset);
+                    if ( pMessageEnd == NULL ) {
+                        // A message without terminator that fills the whole buffer is handled as it is
+                        if ( offset != 0 || pendingBufferSizes[i] < BUFFER_SIZE - 1 ) {
+                            break;
+                        }
+                        pendingBuffer[BUFFER_SIZE - 1] = 0;
+                        pMessageEnd = pendingBuffer + BUFFER_SIZE - 1;
+                    }
+                    fprintf(stderr, "[INFO][TCP] Received a message from client %s:%d: %s\n", 
+                        inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), pendingBuffer + offset);
 
-                // Handler for TCP messages
-                if ( readBytes == 0 || strcmp("BYE", inputBuffer) == 0 ) {
+                    isDisconnected = handleTcpMessage(clientSocketFD, pendingBuffer + offset, outputBuffer);
+                    offset = pMessageEnd - pendingBuffer + 1;
+                }
+
+                if ( isDisconnected ) {
                     // Complete receiving message from client
                     close(clientSocketFD);
                     clientSocketFileDescriptors[i] = 0;
+                    pendingBufferSizes[i] = 0;
                     fprintf(stderr, "[INFO][TCP] Client %s:%d disconnected.\n", 
                         inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port));
 
                     continue;
-                } else if ( strncmp("GET", inputBuffer, 3) ==0 ) {
-                    // Send file stream to the client
-                    char filePath[BUFFER_SIZE] = {0};
-                    memcpy(filePath, &inputBuffer[4], strlen(inputBuffer) - 4);
-                    FILE* inputFile = fopen(filePath, "rb");
-
-                    char* pMessage = "ACCEPT";
-                    if ( inputFile == NULL ) {
-                        pMessage = "REJECT";
-                    }
-                    send(clientSocketFD, pMessage, strlen(pMessage), 0);
-
-                    // Send file stream
-                    int readBytes = 0;
-                    while ( (readBytes = fread(outputBuffer, sizeof(char), BUFFER_SIZE, inputFile)) > 0 ) {
-                        send(clientSocketFD, outputBuffer, readBytes, 0);
-                        fprintf(stderr, "[INFO] Sent %lu bytes\n", strlen(outputBuffer));
-                        memset(outputBuffer, 0, BUFFER_SIZE);
-                    }
-                    fclose(inputFile);
-                    fprintf(stderr, "[INFO][TCP] Send file stream to client %s:%d: %s\n", 
-                        inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), inputBuffer);
-                } else {
-                    // Send a message to client
-                    toUppercaseString(inputBuffer, outputBuffer);
-                    if ( send(clientSocketFD, outputBuffer, strlen(outputBuffer), 0) == -1 ) {
-                        clientSocketFileDescriptors[i] = 0;
-
-                        fprintf(stderr, "[ERROR] An error occurred while sending message to the client %s:%d: %s\nThe connection is going to close.\n", 
-                            inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), strerror(errno));
-                    }
                 }
+
+                // Keep the incomplete message for the next read
+                if ( offset > pendingBufferSizes[i] ) {
+                    offset = pendingBufferSizes[i];
+                }
+                memmove(pendingBuffer, pendingBuffer + offset, pendingBufferSizes[i] - offset);
+                pendingBufferSizes[i] -= offset;
             }
         }
     }
 }
 
+/**
+ * Poll the sockets without blocking until one of them is readable, or the
+ * time runs out. A request arriving while spinning is handled without the
+ * sleep and wakeup of select.
+ *
+ * SIGUSR2 is blocked while spinning, so the spin stops once it's pending,
+ * and pselect delivers it, otherwise busy sockets would put off the upgrade.
+ *
+ * @param  maxFileDescriptor     the max ID of file descriptor to check
+ * @param  readFileDescriptorSet the sockets to check, only the readable ones are kept if any
+ * @param  busyPollTime          the time to spin in microseconds
+ * @return the number of readable sockets, 0 if none is readable in time or SIGUSR2 is pending
+ */
+int spinOnSockets(int maxFileDescriptor, fd_set* readFileDescriptorSet, int busyPollTime) {
+    if ( busyPollTime <= 0 ) {
+        return 0;
+    }
+    struct timespec startTime, currentTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    do {
+        sigset_t pendingSignalSet;
+        if ( sigpending(&pendingSignalSet) == 0 && sigismember(&pendingSignalSet, SIGUSR2) ) {
+            return 0;
+        }
+        fd_set readySet = *readFileDescriptorSet;
+        struct timeval timeout = {0, 0};
+        int events = select(maxFileDescriptor + 1, &readySet, NULL, NULL, &timeout);
+        if ( events > 0 ) {
+            *readFileDescriptorSet = readySet;
+            return events;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &currentTime);
+    } while ( (currentTime.tv_sec - startTime.tv_sec) * 1000000 + (currentTime.tv_nsec - startTime.tv_nsec) / 1000 < busyPollTime );
+
+    return 0;
+}
+
+/**
+ * Handle a message received from a TCP client.
+ * @param  clientSocketFD the file descriptor of the client socket
+ * @param  message        the message terminated by '\0'
+ * @param  outputBuffer   the buffer for sending data
+ * @return TRUE if the connection should be closed
+ */
+int handleTcpMessage(int clientSocketFD, char* message, char* outputBuffer) {
+    if ( strcmp("BYE", message) == 0 ) {
+        return TRUE;
+    } else if ( strncmp("GET", message, 3) == 0 ) {
+        // Send file stream to the client
+        char filePath[BUFFER_SIZE] = {0};
+        if ( strlen(message) > 4 ) {
+            strncpy(filePath, &message[4], BUFFER_SIZE - 1);
+        }
+        if ( sendFileStream(clientSocketFD, filePath, outputBuffer) == -1 ) {
+            fprintf(stderr, "[ERROR][TCP] An error occurred while sending file stream %s: %s\nThe connection is going to close.\n", 
+                filePath, strerror(errno));
+            return TRUE;
+        }
+        fprintf(stderr, "[INFO][TCP] Send file stream to client: %s\n", filePath);
+    } else {
+        // Send a message to client
+        toUppercaseString(message, outputBuffer);
+        if ( sendBuffer(clientSocketFD, outputBuffer, strlen(outputBuffer)) == -1 ) {
+            fprintf(stderr, "[ERROR] An error occurred while sending message to the client: %s\nThe connection is going to close.\n", 
+                strerror(errno));
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
 /**
  * Register a new file descriptor for new connections.
  * @param  clientSocketFD              the file descriptor to register
@@ -362,21 +851,3 @@ int registerNewSocket(int clientSocketFD, int* clientSocketFileDescriptors, int
     }
     return -1;
 }
-
-/**
- * Convert all lower case characters to upper case.
- * @param input  the string for input
- * @param output the string for output
- */
-void toUppercaseString(char* input, char* output) {
-    for ( ; *input; ++ input, ++ output ) {
-        *output = *input;
-
-        if ( *input >= 'a' && *input <= 'z' ) {
-            *output = *input - 'a' + 'A';
-        }
-    }
-
-    // Add the end character of at the end of string
-    *output = 0;
-}
\ No newline at end of file
@@ -1,14 +1,78 @@
+#define _GNU_SOURCE     // for splice and fallocate
+
 #include <errno.h>
 #include <fcntl.h>      // for opening socket
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <netdb.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>     // for closing socket
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
-#define BUFFER_SIZE 1024
+#define TRUE                        1
+#define FALSE                       0
+
+#define BUFFER_SIZE                 1024
+#define FAST_RECEIVE_BUFFER_SIZE    (4 * 1024 * 1024)
+#define BATCH_BUFFER_SIZE           (64 * 1024)
+#define DEFAULT_PIPELINE_DEPTH      8
+#define MAX_PIPELINE_DEPTH          64
+#define MAX_BATCH_CONNECTIONS       16
+
+/**
+ * Returned by receiveResponseHeader when no complete header is received.
+ */
+#define RESPONSE_HEADER_ERROR       -2
+
+/**
+ * A file to download in batch mode.
+ */
+struct BatchRequest {
+    char remotePath[BUFFER_SIZE];
+    char localPath[BUFFER_SIZE];
+    int outputFileDescriptor;
+    long long fileSize;
+    long long receivedBytes;
+    double startTime;
+    int isSucceeded;
+};
+
+/**
+ * A connection to the server in batch mode.
+ * Responses arrive in the order of requests, so the requests in flight are
+ * kept in a FIFO queue, and the one at the head is being received.
+ */
+struct BatchConnection {
+    int socketFileDescriptor;
+    int pendingRequests[MAX_PIPELINE_DEPTH];
+    int pendingRequestHead;
+    int pendingRequestCount;
+    int isReceivingHeader;
+    char inputBuffer[BATCH_BUFFER_SIZE];
+    int inputBufferSize;
+};
+
+/**
+ * Prototypes of functions.
+ */
+void printUsage(char* programName);
+int connectToServer(struct sockaddr_in* serverSocketAddress, int receiveBufferSize);
+long long receiveResponseHeader(int tcpSocketFileDescriptor, char* header, int n);
+long long receiveFileStream(int tcpSocketFileDescriptor, FILE* outputFile, long long fileSize);
+long long receiveFileStreamFast(int tcpSocketFileDescriptor, int outputFileDescriptor, long long fileSize, int bufferSize);
+void printProgress(long long receivedBytes, long long fileSize, int isFinished);
+int runBatchMode(char* manifestPath, struct sockaddr_in* serverSocketAddress, 
+        int receiveBufferSize, int pipelineDepth, int connections);
+int loadBatchManifest(char* manifestPath, struct BatchRequest** requests);
+int sendBatchRequest(struct BatchConnection* connection, struct BatchRequest* requests, int requestIndex);
+int receiveBatchResponses(struct BatchConnection* connection, struct BatchRequest* requests);
+void finishBatchRequest(struct BatchConnection* connection, struct BatchRequest* requests, int isSucceeded);
+double getCurrentTime();
 
 /**
  * The entrance of the server application.
@@ -18,35 +82,66 @@
  * @return 0 if the application exited normally
  */
 int main(int argc, char *argv[]) {
-    if ( argc != 3 ) {
-        fprintf(stderr," Usage: %s Host PortNumber\n",argv[0]);
+    /*
+     * Parse options.
+     *
+     * -f, --fast         download files with splice(2) through a pipe instead of recv/fwrite
+     * -b, --buffer-size  the size of the socket receive buffer and the pipe in fast mode
+     * -m, --batch        download the files listed in the manifest without prompting
+     * -p, --pipeline     the number of requests in flight on each connection in batch mode
+     * -c, --connections  the number of connections to the server in batch mode
+     */
+    int isFastMode = FALSE;
+    int receiveBufferSize = FAST_RECEIVE_BUFFER_SIZE;
+    char* manifestPath = NULL;
+    int pipelineDepth = DEFAULT_PIPELINE_DEPTH;
+    int connections = 1;
+    struct option longOptions[] = {
+        {"fast",        no_argument,       NULL, 'f'},
+        {"buffer-size", required_argument, NULL, 'b'},
+        {"batch",       required_argument, NULL, 'm'},
+        {"pipeline",    required_argument, NULL, 'p'},
+        {"connections", required_argument, NULL, 'c'},
+        {NULL,          0,                 NULL, 0}
+    };
+    int option = 0;
+    while ( (option = getopt_long(argc, argv, "fb:m:p:c:", longOptions, NULL)) != -1 ) {
+        switch ( option ) {
+            case 'f':
+                isFastMode = TRUE;
+                break;
+            case 'b':
+                receiveBufferSize = atoi(optarg);
+                break;
+            case 'm':
+                manifestPath = optarg;
+                break;
+            case 'p':
+                pipelineDepth = atoi(optarg);
+                break;
+            case 'c':
+                connections = atoi(optarg);
+                break;
+            default:
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if ( argc - optind != 2 || receiveBufferSize <= 0 || 
+            pipelineDepth <= 0 || pipelineDepth > MAX_PIPELINE_DEPTH ||
+            connections <= 0 || connections > MAX_BATCH_CONNECTIONS ) {
+        printUsage(argv[0]);
         return EXIT_FAILURE;
     }
     
-    struct hostent* pHost = gethostbyname(argv[1]);
+    struct hostent* pHost = gethostbyname(argv[optind]);
     if ( pHost == NULL ) {
-        fprintf(stderr, "Usage: %s Host PortNumber\n", argv[0]);
+        printUsage(argv[0]);
         return EXIT_FAILURE;
     }
-    int portNumber = atoi(argv[2]);
+    int portNumber = atoi(argv[optind + 1]);
     if ( portNumber <= 0 ) {
-        fprintf(stderr, "Usage: %s Host PortNumber\n", argv[0]);
-        return EXIT_FAILURE;
-    }
-
-    /*
-     * Create socket file descriptor.
-     * Function Prototype: int socket(int domain, int type,int protocol)
-     * Defined in sys/socket.h
-     *
-     * @param domain:   AF_INET stands for Internet, AF_UNIX can only communicate between UNIX systems.
-     * @param type      the prototype to use, SOCK_STREAM stands for TCP and SOCK_DGRAM stands for UDP
-     * @param protocol  if type is specified, this parameter can be assigned to 0.
-     * @return -1 if socket is failed to create
-     */
-    int tcpSocketFileDescriptor = socket(AF_INET, SOCK_STREAM, 0);
-    if ( tcpSocketFileDescriptor == -1 ) {
-        fprintf(stderr, "[ERROR] Failed to create socket: %s\n", strerror(errno));
+        printUsage(argv[0]);
         return EXIT_FAILURE;
     }
 
@@ -79,17 +174,15 @@ int main(int argc, char *argv[]) {
     serverSocketAddress.sin_port = htons(portNumber);
 
     /*
-     * Connect to server.
-     * Function prototype: int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
-     * Defined in sys/socket.h and sys/types.h
-     *
-     * @param sockfd  the socket file descriptor
-     * @param my_addr the specified address of server
-     * @param addrlen the size of the struct sockaddr
-     * @return -1 if the operation failed
+     * Download the files listed in the manifest in batch mode.
      */
-    if ( connect(tcpSocketFileDescriptor, (struct sockaddr *)(&serverSocketAddress), sockaddrSize) == -1 ) {
-        fprintf(stderr, "[ERROR] Failed to connect to server: %s\n", strerror(errno));
+    if ( manifestPath != NULL ) {
+        return runBatchMode(manifestPath, &serverSocketAddress, 
+                    isFastMode ? receiveBufferSize : 0, pipelineDepth, connections);
+    }
+
+    int tcpSocketFileDescriptor = connectToServer(&serverSocketAddress, isFastMode ? receiveBufferSize : 0);
+    if ( tcpSocketFileDescriptor == -1 ) {
         return EXIT_FAILURE;
     }
 
@@ -113,8 +206,12 @@ int main(int argc, char *argv[]) {
             break;
         } else if ( strncmp("GET", outputBuffer, 3) ==0 ) {
             // Receive a message to confirm whether the file exists
-            recv(tcpSocketFileDescriptor, inputBuffer, BUFFER_SIZE, 0);
-            if ( strncmp("ACCEPT", inputBuffer, 6) != 0 ) {
+            long long fileSize = receiveResponseHeader(tcpSocketFileDescriptor, inputBuffer, BUFFER_SIZE);
+            if ( fileSize == RESPONSE_HEADER_ERROR ) {
+                fprintf(stderr, "[ERROR] Failed to receive the response header from the server: %s\nThe connection is going to close.\n", 
+                    errno == 0 ? "Connection closed by server" : strerror(errno));
+                break;
+            } else if ( strncmp("ACCEPT", inputBuffer, 6) != 0 ) {
                 fprintf(stderr, "[WARN] Server refused to send this file. Maybe file does not exist.\n");
                 continue;
             }
@@ -123,18 +220,26 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "> Save to: ");
             scanf("%s", outputBuffer);
             FILE* outputFile = fopen(outputBuffer, "wb");
+            if ( outputFile == NULL ) {
+                fprintf(stderr, "[ERROR] Failed to open %s: %s\nThe connection is going to close.\n", outputBuffer, strerror(errno));
+                break;
+            }
 
-            int readBytes = 0;
-            while ( (readBytes = recv(tcpSocketFileDescriptor, inputBuffer, BUFFER_SIZE, 0)) > 0 ) {
-                fprintf(stderr, "[INFO] Received %lu bytes\n", strlen(inputBuffer));
-                fwrite(inputBuffer, sizeof(char), readBytes, outputFile);
-                memset(inputBuffer, 0, BUFFER_SIZE);
-
-                if ( readBytes < BUFFER_SIZE ) {
-                    break;
-                }
+            long long receivedBytes = 0;
+            if ( isFastMode && fileSize >= 0 ) {
+                receivedBytes = receiveFileStreamFast(tcpSocketFileDescriptor, fileno(outputFile), fileSize, receiveBufferSize);
+            } else {
+                receivedBytes = receiveFileStream(tcpSocketFileDescriptor, outputFile, fileSize);
             }
             fclose(outputFile);
+
+            if ( receivedBytes < 0 ) {
+                fprintf(stderr, "[ERROR] An error occurred while receiving file stream from the server: %s\nThe connection is going to close.\n", strerror(errno));
+                break;
+            } else if ( fileSize >= 0 && receivedBytes < fileSize ) {
+                fprintf(stderr, "[ERROR] The server closed the connection after %lld of %lld bytes.\n", receivedBytes, fileSize);
+                break;
+            }
         } else {
             // Receive a message from client
             int readBytes = recv(tcpSocketFileDescriptor, inputBuffer, BUFFER_SIZE, 0);
@@ -153,4 +258,584 @@ int main(int argc, char *argv[]) {
     close(tcpSocketFileDescriptor);
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+/**
+ * Print the usage of the application.
+ *
+ * @param programName the name of the application
+ */
+void printUsage(char* programName) {
+    fprintf(stderr, "Usage: %s [--fast] [--buffer-size Bytes] "
+        "[--batch Manifest [--pipeline Depth] [--connections N]] Host PortNumber\n", programName);
+}
+
+/**
+ * Create a TCP socket and connect to the server.
+ *
+ * @param  serverSocketAddress the address of the server
+ * @param  receiveBufferSize   the size of the socket receive buffer, 0 for the system default
+ * @return the file descriptor of the socket, or -1 if the operation failed
+ */
+int connectToServer(struct sockaddr_in* serverSocketAddress, int receiveBufferSize) {
+    /*
+     * Create socket file descriptor.
+     * Function Prototype: int socket(int domain, int type,int protocol)
+     * Defined in sys/socket.h
+     *
+     * @param domain:   AF_INET stands for Internet, AF_UNIX can only communicate between UNIX systems.
+     * @param type      the prototype to use, SOCK_STREAM stands for TCP and SOCK_DGRAM stands for UDP
+     * @param protocol  if type is specified, this parameter can be assigned to 0.
+     * @return -1 if socket is failed to create
+     */
+    int tcpSocketFileDescriptor = socket(AF_INET, SOCK_STREAM, 0);
+    if ( tcpSocketFileDescriptor == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /*
+     * Enlarge the receive buffer if required.
+     * It must be set before connect() so that a large enough TCP window scale is negotiated.
+     */
+    if ( receiveBufferSize > 0 ) {
+        setsockopt(tcpSocketFileDescriptor, SOL_SOCKET, SO_RCVBUF, &receiveBufferSize, sizeof(receiveBufferSize));
+    }
+
+    /*
+     * Connect to server.
+     * Function prototype: int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+     * Defined in sys/socket.h and sys/types.h
+     *
+     * @param sockfd  the socket file descriptor
+     * @param my_addr the specified address of server
+     * @param addrlen the size of the struct sockaddr
+     * @return -1 if the operation failed
+     */
+    if ( connect(tcpSocketFileDescriptor, (struct sockaddr *)(serverSocketAddress), sizeof(struct sockaddr)) == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to connect to server: %s\n", strerror(errno));
+        close(tcpSocketFileDescriptor);
+        return -1;
+    }
+    return tcpSocketFileDescriptor;
+}
+
+/**
+ * Receive the response header of a GET request.
+ *
+ * The header is terminated by '\n', e.g. "ACCEPT 1024\n" or "REJECT\n", and
+ * may arrive in several segments. It's read byte by byte up to '\n', so that
+ * no byte of the following file stream is consumed.
+ *
+ * @param  tcpSocketFileDescriptor the file descriptor of TCP socket
+ * @param  header                  the buffer for the header
+ * @param  n                       the size of the buffer
+ * @return the size of the file announced by the server, -1 if it is unknown,
+ *         or RESPONSE_HEADER_ERROR if the connection is closed or the header doesn't fit in the buffer
+ */
+long long receiveResponseHeader(int tcpSocketFileDescriptor, char* header, int n) {
+    memset(header, 0, n);
+
+    int headerSize = 0;
+    while ( headerSize == 0 || header[headerSize - 1] != '\n' ) {
+        if ( headerSize == n - 1 ) {
+            errno = EPROTO;
+            return RESPONSE_HEADER_ERROR;
+        }
+        int readBytes = recv(tcpSocketFileDescriptor, header + headerSize, 1, 0);
+        if ( readBytes <= 0 ) {
+            if ( readBytes == -1 && errno == EINTR ) {
+                continue;
+            }
+            if ( readBytes == 0 ) {
+                errno = 0;
+            }
+            return RESPONSE_HEADER_ERROR;
+        }
+        ++ headerSize;
+    }
+
+    long long fileSize = -1;
+    if ( sscanf(header, "ACCEPT %lld", &fileSize) != 1 ) {
+        return -1;
+    }
+    return fileSize;
+}
+
+/**
+ * Receive the file stream with recv and fwrite.
+ *
+ * @param  tcpSocketFileDescriptor the file descriptor of TCP socket
+ * @param  outputFile              the file to save the stream
+ * @param  fileSize                the size of the file, or -1 if it is unknown
+ * @return the number of bytes received, or -1 if an error occurred
+ */
+long long receiveFileStream(int tcpSocketFileDescriptor, FILE* outputFile, long long fileSize) {
+    char inputBuffer[BUFFER_SIZE] = {0};
+    long long receivedBytes = 0;
+
+    while ( fileSize < 0 || receivedBytes < fileSize ) {
+        int bytesToRead = BUFFER_SIZE;
+        if ( fileSize >= 0 && fileSize - receivedBytes < bytesToRead ) {
+            bytesToRead = fileSize - receivedBytes;
+        }
+
+        int readBytes = recv(tcpSocketFileDescriptor, inputBuffer, bytesToRead, 0);
+        if ( readBytes < 0 ) {
+            return -1;
+        } else if ( readBytes == 0 ) {
+            break;
+        }
+        fwrite(inputBuffer, sizeof(char), readBytes, outputFile);
+        receivedBytes += readBytes;
+        printProgress(receivedBytes, fileSize, FALSE);
+
+        // The size of file is unknown, a short read is treated as the end of file
+        if ( fileSize < 0 && readBytes < BUFFER_SIZE ) {
+            break;
+        }
+    }
+    printProgress(receivedBytes, fileSize, TRUE);
+
+    return receivedBytes;
+}
+
+/**
+ * Receive the file stream without copying it into user space.
+ *
+ * The data is spliced from the socket into a pipe, and then from the pipe
+ * into the output file. The output file is preallocated with fallocate, so
+ * that the file system doesn't need to extend it for every chunk.
+ *
+ * @param  tcpSocketFileDescriptor the file descriptor of TCP socket
+ * @param  outputFileDescriptor    the file descriptor of the output file
+ * @param  fileSize                the size of the file
+ * @param  bufferSize              the size of the pipe
+ * @return the number of bytes received, which is less than the size of the
+ *         file if the connection is closed too early, or -1 if an error occurred
+ */
+long long receiveFileStreamFast(int tcpSocketFileDescriptor, int outputFileDescriptor, long long fileSize, int bufferSize) {
+    // Preallocate the file, it's okay if the file system doesn't support it
+    if ( fileSize > 0 && fallocate(outputFileDescriptor, 0, 0, fileSize) == -1 ) {
+        fprintf(stderr, "[WARN] Failed to preallocate the file: %s\n", strerror(errno));
+    }
+
+    int pipeFileDescriptors[2] = {0};
+    if ( pipe(pipeFileDescriptors) == -1 ) {
+        return -1;
+    }
+    // The kernel may round the size of the pipe up, or refuse to enlarge it
+    int pipeSize = fcntl(pipeFileDescriptors[1], F_SETPIPE_SZ, bufferSize);
+    if ( pipeSize == -1 ) {
+        pipeSize = fcntl(pipeFileDescriptors[1], F_GETPIPE_SZ);
+    }
+
+    long long receivedBytes = 0;
+    while ( receivedBytes < fileSize ) {
+        size_t bytesToRead = pipeSize;
+        if ( fileSize - receivedBytes < bytesToRead ) {
+            bytesToRead = fileSize - receivedBytes;
+        }
+
+        ssize_t readBytes = splice(tcpSocketFileDescriptor, NULL, pipeFileDescriptors[1], NULL, 
+                                bytesToRead, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if ( readBytes == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            close(pipeFileDescriptors[0]);
+            close(pipeFileDescriptors[1]);
+            ftruncate(outputFileDescriptor, receivedBytes);
+            return -1;
+        } else if ( readBytes == 0 ) {
+            break;
+        }
+
+        // Drain the pipe into the file
+        ssize_t pendingBytes = readBytes;
+        while ( pendingBytes > 0 ) {
+            ssize_t writtenBytes = splice(pipeFileDescriptors[0], NULL, outputFileDescriptor, NULL, 
+                                    pendingBytes, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if ( writtenBytes <= 0 ) {
+                if ( writtenBytes == -1 && errno == EINTR ) {
+                    continue;
+                }
+                close(pipeFileDescriptors[0]);
+                close(pipeFileDescriptors[1]);
+                return -1;
+            }
+            pendingBytes -= writtenBytes;
+        }
+        receivedBytes += readBytes;
+        printProgress(receivedBytes, fileSize, FALSE);
+    }
+    printProgress(receivedBytes, fileSize, TRUE);
+
+    close(pipeFileDescriptors[0]);
+    close(pipeFileDescriptors[1]);
+
+    // Drop the preallocated space if the connection is closed too early
+    if ( receivedBytes < fileSize ) {
+        ftruncate(outputFileDescriptor, receivedBytes);
+    }
+    return receivedBytes;
+}
+
+/**
+ * Print the progress of the download on a single line.
+ * The line is only refreshed when the percentage changes (or every 1 MiB
+ * if the size of file is unknown).
+ *
+ * @param receivedBytes the number of bytes received
+ * @param fileSize      the size of the file, or -1 if it is unknown
+ * @param isFinished    whether the download is finished
+ */
+void printProgress(long long receivedBytes, long long fileSize, int isFinished) {
+    static long long lastStep = -1;
+
+    long long step = fileSize > 0 ? receivedBytes * 100 / fileSize : receivedBytes >> 20;
+    if ( step == lastStep && !isFinished ) {
+        return;
+    }
+    lastStep = isFinished ? -1 : step;
+
+    if ( fileSize >= 0 ) {
+        fprintf(stderr, "\r[INFO] Received %lld / %lld bytes (%lld%%)", receivedBytes, fileSize, 
+            fileSize > 0 ? receivedBytes * 100 / fileSize : 100);
+    } else {
+        fprintf(stderr, "\r[INFO] Received %lld bytes", receivedBytes);
+    }
+    if ( isFinished ) {
+        fprintf(stderr, "\n");
+    }
+}
+
+/**
+ * Download the files listed in the manifest without prompting.
+ *
+ * Each line of the manifest is "GET <Path in server> <Path to save>". Blank
+ * lines and lines starting with '#' are ignored. Up to pipelineDepth requests
+ * are kept in flight on each connection, so the next file is already on the
+ * way while the current one is being received.
+ *
+ * @param  manifestPath        the path to the manifest
+ * @param  serverSocketAddress the address of the server
+ * @param  receiveBufferSize   the size of the socket receive buffer, 0 for the system default
+ * @param  pipelineDepth       the number of requests in flight on each connection
+ * @param  connections         the number of connections to the server
+ * @return EXIT_SUCCESS if all files are downloaded
+ */
+int runBatchMode(char* manifestPath, struct sockaddr_in* serverSocketAddress, 
+        int receiveBufferSize, int pipelineDepth, int connections) {
+    struct BatchRequest* requests = NULL;
+    int totalRequests = loadBatchManifest(manifestPath, &requests);
+    if ( totalRequests < 0 ) {
+        return EXIT_FAILURE;
+    }
+    if ( connections > totalRequests ) {
+        connections = totalRequests > 0 ? totalRequests : 1;
+    }
+
+    struct BatchConnection* batchConnections = calloc(connections, sizeof(struct BatchConnection));
+    struct pollfd pollFileDescriptors[MAX_BATCH_CONNECTIONS];
+    int i = 0;
+    for ( i = 0; i < connections; ++ i ) {
+        batchConnections[i].socketFileDescriptor = connectToServer(serverSocketAddress, receiveBufferSize);
+        batchConnections[i].isReceivingHeader = TRUE;
+        if ( batchConnections[i].socketFileDescriptor == -1 ) {
+            free(batchConnections);
+            free(requests);
+            return EXIT_FAILURE;
+        }
+    }
+    fprintf(stderr, "[INFO] Downloading %d files with %d connection(s), %d request(s) in flight on each.\n", 
+        totalRequests, connections, pipelineDepth);
+
+    double startTime = getCurrentTime();
+    int nextRequest = 0, finishedRequests = 0;
+    while ( finishedRequests < totalRequests ) {
+        // Keep the pipeline of each connection full
+        int activeConnections = 0;
+        for ( i = 0; i < connections; ++ i ) {
+            struct BatchConnection* connection = &batchConnections[i];
+            if ( connection->socketFileDescriptor == -1 ) {
+                continue;
+            }
+            while ( connection->pendingRequestCount < pipelineDepth && nextRequest < totalRequests ) {
+                if ( sendBatchRequest(connection, requests, nextRequest ++) == -1 ) {
+                    // The connection is broken, so are the requests in flight on it
+                    finishedRequests += 1 + connection->pendingRequestCount;
+                    while ( connection->pendingRequestCount > 0 ) {
+                        finishBatchRequest(connection, requests, FALSE);
+                    }
+                    close(connection->socketFileDescriptor);
+                    connection->socketFileDescriptor = -1;
+                    break;
+                }
+            }
+            if ( connection->socketFileDescriptor == -1 ) {
+                continue;
+            }
+            if ( connection->pendingRequestCount > 0 ) {
+                pollFileDescriptors[activeConnections].fd = connection->socketFileDescriptor;
+                pollFileDescriptors[activeConnections].events = POLLIN;
+                ++ activeConnections;
+            }
+        }
+        if ( activeConnections == 0 ) {
+            // All connections are lost, the rest requests cannot be sent
+            finishedRequests += totalRequests - nextRequest;
+            nextRequest = totalRequests;
+            break;
+        }
+
+        if ( poll(pollFileDescriptors, activeConnections, -1) == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            fprintf(stderr, "[ERROR] An error occurred while waiting for the server: %s\n", strerror(errno));
+            break;
+        }
+
+        // Receive responses from readable connections
+        int j = 0;
+        for ( i = 0, j = 0; i < connections; ++ i ) {
+            struct BatchConnection* connection = &batchConnections[i];
+            if ( connection->socketFileDescriptor == -1 || connection->pendingRequestCount == 0 ) {
+                continue;
+            }
+            if ( pollFileDescriptors[j ++].revents == 0 ) {
+                continue;
+            }
+
+            int pendingRequestCount = connection->pendingRequestCount;
+            if ( receiveBatchResponses(connection, requests) == -1 ) {
+                fprintf(stderr, "[ERROR] Connection #%d to the server is lost: %s\n", i, 
+                    errno == 0 ? "Connection closed by server" : strerror(errno));
+                while ( connection->pendingRequestCount > 0 ) {
+                    finishBatchRequest(connection, requests, FALSE);
+                }
+                close(connection->socketFileDescriptor);
+                connection->socketFileDescriptor = -1;
+            }
+            finishedRequests += pendingRequestCount - connection->pendingRequestCount;
+        }
+    }
+    double elapsedTime = getCurrentTime() - startTime;
+
+    // Say goodbye to the server
+    for ( i = 0; i < connections; ++ i ) {
+        if ( batchConnections[i].socketFileDescriptor != -1 ) {
+            send(batchConnections[i].socketFileDescriptor, "BYE", 4, 0);
+            close(batchConnections[i].socketFileDescriptor);
+        }
+    }
+
+    // Print the summary
+    int succeededRequests = 0;
+    long long receivedBytes = 0;
+    for ( i = 0; i < totalRequests; ++ i ) {
+        if ( requests[i].isSucceeded ) {
+            ++ succeededRequests;
+            receivedBytes += requests[i].receivedBytes;
+        }
+    }
+    fprintf(stderr, "[INFO] %d of %d files downloaded, %lld bytes in %.3f ms (%.2f MiB/s)\n", 
+        succeededRequests, totalRequests, receivedBytes, elapsedTime * 1000, 
+        elapsedTime > 0 ? receivedBytes / elapsedTime / (1 << 20) : 0);
+
+    free(batchConnections);
+    free(requests);
+    return succeededRequests == totalRequests ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Load the requests from the manifest.
+ *
+ * @param  manifestPath the path to the manifest
+ * @param  requests     a pointer to the array of requests, which should be freed by the caller
+ * @return the number of requests, or -1 if the manifest cannot be read
+ */
+int loadBatchManifest(char* manifestPath, struct BatchRequest** requests) {
+    FILE* manifestFile = fopen(manifestPath, "r");
+    if ( manifestFile == NULL ) {
+        fprintf(stderr, "[ERROR] Failed to open the manifest %s: %s\n", manifestPath, strerror(errno));
+        return -1;
+    }
+
+    char line[BUFFER_SIZE * 3] = {0};
+    char command[BUFFER_SIZE] = {0};
+    int totalRequests = 0, capacity = 0, lineNumber = 0;
+    *requests = NULL;
+
+    while ( fgets(line, sizeof(line), manifestFile) != NULL ) {
+        ++ lineNumber;
+        if ( sscanf(line, "%1023s", command) != 1 || command[0] == '#' ) {
+            continue;
+        }
+
+        if ( totalRequests == capacity ) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            struct BatchRequest* newRequests = realloc(*requests, capacity * sizeof(struct BatchRequest));
+            if ( newRequests == NULL ) {
+                fprintf(stderr, "[ERROR] Failed to load the manifest %s: %s\n", manifestPath, strerror(errno));
+                free(*requests);
+                *requests = NULL;
+                fclose(manifestFile);
+                return -1;
+            }
+            *requests = newRequests;
+        }
+        struct BatchRequest* request = &(*requests)[totalRequests];
+        memset(request, 0, sizeof(struct BatchRequest));
+
+        // Only files can be transferred in batch mode, messages have no terminator in responses
+        if ( sscanf(line, "%1023s %1023s %1023s", command, request->remotePath, request->localPath) != 3 || 
+                strcmp("GET", command) != 0 ) {
+            fprintf(stderr, "[WARN] Line %d of the manifest is ignored, expected \"GET <Remote Path> <Local Path>\".\n", lineNumber);
+            continue;
+        }
+        request->outputFileDescriptor = -1;
+        ++ totalRequests;
+    }
+    fclose(manifestFile);
+
+    return totalRequests;
+}
+
+/**
+ * Send a GET request on the connection and append it to the queue of pending requests.
+ *
+ * @param  connection   the connection to the server
+ * @param  requests     the array of requests
+ * @param  requestIndex the index of the request to send
+ * @return -1 if the request failed to send
+ */
+int sendBatchRequest(struct BatchConnection* connection, struct BatchRequest* requests, int requestIndex) {
+    struct BatchRequest* request = &requests[requestIndex];
+    char message[BUFFER_SIZE + 8] = {0};
+    int messageSize = snprintf(message, sizeof(message), "GET %s", request->remotePath) + 1;
+
+    request->startTime = getCurrentTime();
+    if ( send(connection->socketFileDescriptor, message, messageSize, MSG_NOSIGNAL) == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to request %s: %s\n", request->remotePath, strerror(errno));
+        return -1;
+    }
+
+    int tail = (connection->pendingRequestHead + connection->pendingRequestCount) % MAX_PIPELINE_DEPTH;
+    connection->pendingRequests[tail] = requestIndex;
+    ++ connection->pendingRequestCount;
+
+    return 0;
+}
+
+/**
+ * Receive the data available on the connection, and dispatch it to the
+ * pending requests in order.
+ *
+ * @param  connection the connection to the server
+ * @param  requests   the array of requests
+ * @return -1 if the connection is closed or broken
+ */
+int receiveBatchResponses(struct BatchConnection* connection, struct BatchRequest* requests) {
+    int readBytes = recv(connection->socketFileDescriptor, connection->inputBuffer + connection->inputBufferSize, 
+                        BATCH_BUFFER_SIZE - connection->inputBufferSize - 1, 0);
+    if ( readBytes <= 0 ) {
+        if ( readBytes == 0 ) {
+            errno = 0;
+        }
+        return -1;
+    }
+    connection->inputBufferSize += readBytes;
+
+    int offset = 0;
+    while ( connection->pendingRequestCount > 0 && offset < connection->inputBufferSize ) {
+        struct BatchRequest* request = &requests[connection->pendingRequests[connection->pendingRequestHead]];
+        char* pData = connection->inputBuffer + offset;
+        int availableBytes = connection->inputBufferSize - offset;
+
+        if ( connection->isReceivingHeader ) {
+            char* pLineEnd = memchr(pData, '\n', availableBytes);
+            if ( pLineEnd == NULL ) {
+                break;
+            }
+            *pLineEnd = 0;
+            offset += pLineEnd - pData + 1;
+
+            if ( sscanf(pData, "ACCEPT %lld", &request->fileSize) != 1 ) {
+                fprintf(stderr, "[WARN] GET %s: Server refused to send this file. Maybe file does not exist.\n", request->remotePath);
+                finishBatchRequest(connection, requests, FALSE);
+                continue;
+            }
+            request->outputFileDescriptor = open(request->localPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if ( request->outputFileDescriptor == -1 ) {
+                fprintf(stderr, "[WARN] GET %s: Failed to open %s: %s\n", request->remotePath, request->localPath, strerror(errno));
+            }
+            connection->isReceivingHeader = FALSE;
+        } else {
+            int bytesToWrite = availableBytes;
+            if ( request->fileSize - request->receivedBytes < bytesToWrite ) {
+                bytesToWrite = request->fileSize - request->receivedBytes;
+            }
+            // The stream is still consumed if the file cannot be saved, to keep the pipeline in sync
+            if ( request->outputFileDescriptor != -1 && write(request->outputFileDescriptor, pData, bytesToWrite) != bytesToWrite ) {
+                fprintf(stderr, "[WARN] GET %s: Failed to write %s: %s\n", request->remotePath, request->localPath, strerror(errno));
+                close(request->outputFileDescriptor);
+                request->outputFileDescriptor = -1;
+            }
+            request->receivedBytes += bytesToWrite;
+            offset += bytesToWrite;
+        }
+
+        if ( !connection->isReceivingHeader && request->receivedBytes == request->fileSize ) {
+            finishBatchRequest(connection, requests, request->outputFileDescriptor != -1);
+        }
+    }
+
+    // Keep the incomplete header for the next read
+    memmove(connection->inputBuffer, connection->inputBuffer + offset, connection->inputBufferSize - offset);
+    connection->inputBufferSize -= offset;
+    if ( connection->inputBufferSize == BATCH_BUFFER_SIZE - 1 ) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Finish the request at the head of the queue, and print its timing.
+ *
+ * @param connection  the connection to the server
+ * @param requests    the array of requests
+ * @param isSucceeded whether the file is downloaded
+ */
+void finishBatchRequest(struct BatchConnection* connection, struct BatchRequest* requests, int isSucceeded) {
+    struct BatchRequest* request = &requests[connection->pendingRequests[connection->pendingRequestHead]];
+    double elapsedTime = getCurrentTime() - request->startTime;
+
+    if ( request->outputFileDescriptor != -1 ) {
+        close(request->outputFileDescriptor);
+        request->outputFileDescriptor = -1;
+    }
+    request->isSucceeded = isSucceeded;
+    if ( isSucceeded ) {
+        fprintf(stderr, "[INFO] GET %s -> %s: %lld bytes in %.3f ms\n", 
+            request->remotePath, request->localPath, request->receivedBytes, elapsedTime * 1000);
+    }
+
+    connection->pendingRequestHead = (connection->pendingRequestHead + 1) % MAX_PIPELINE_DEPTH;
+    -- connection->pendingRequestCount;
+    connection->isReceivingHeader = TRUE;
+}
+
+/**
+ * Get the current time from a monotonic clock.
+ *
+ * @return the current time in seconds
+ */
+double getCurrentTime() {
+    struct timespec currentTime;
+    clock_gettime(CLOCK_MONOTONIC, &currentTime);
+
+    return currentTime.tv_sec + currentTime.tv_nsec / 1e9;
+}
@@ -0,0 +1,520 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tcp-reassembly.h"
+
+#define FALSE                   0
+#define TRUE                    1
+
+/**
+ * Compare sequence numbers with wraparound, e.g. SEQUENCE_BEFORE(a, b) is
+ * true if a comes before b in the sequence space.
+ */
+#define SEQUENCE_DIFFERENCE(a, b)   ((int32_t) ((uint32_t) (a) - (uint32_t) (b)))
+#define SEQUENCE_BEFORE(a, b)       (SEQUENCE_DIFFERENCE(a, b) < 0)
+
+/**
+ * The largest window with window scaling, see RFC 7323.
+ */
+#define TCP_MAX_WINDOW_SIZE         (1 << 30)
+
+/**
+ * Prototypes of functions.
+ */
+static int createTcpSegmentPool(struct TcpSegmentPool* pool, uint32_t numberOfSegments);
+static struct TcpSegment* allocateTcpSegment(struct TcpSegmentPool* pool);
+static void freeTcpSegment(struct TcpSegmentPool* pool, struct TcpSegment* segment);
+static uint32_t getStreamHash(const struct FlowKey* key);
+static struct TcpStream* findTcpStream(struct TcpReassembler* reassembler, const struct FlowKey* key, int* direction);
+static struct TcpStream* createTcpStream(struct TcpReassembler* reassembler, const struct FlowKey* key, uint64_t timestamp);
+static void closeTcpStream(struct TcpReassembler* reassembler, struct TcpStream* stream);
+static void addStreamData(struct TcpReassembler* reassembler, struct TcpStream* stream, int direction,
+        uint32_t sequenceNumber, const unsigned char* data, uint32_t length);
+static void deliverStreamData(struct TcpReassembler* reassembler, struct TcpStream* stream, int direction,
+        uint32_t sequenceNumber, const unsigned char* data, uint32_t length);
+static void drainOutOfOrderSegments(struct TcpReassembler* reassembler, struct TcpStream* stream, int direction);
+static void skipToNextSegment(struct TcpReassembler* reassembler, struct TcpStream* stream, int direction);
+static void bufferOutOfOrderData(struct TcpReassembler* reassembler, struct TcpStream* stream, int direction,
+        uint32_t sequenceNumber, const unsigned char* data, uint32_t length);
+
+/**
+ * Allocate the pools of streams and segments.
+ *
+ * @param  reassembler      the reassembler
+ * @param  maxStreams       the maximum number of streams tracked at the same time
+ * @param  numberOfSegments the number of segments for out-of-order data, shared by all streams
+ * @param  maxBufferedBytes the maximum bytes of out-of-order data buffered for each direction of a stream
+ * @param  idleTimeout      the time in nanoseconds before an idle stream is closed
+ * @param  callback         the function receiving data and events of streams
+ * @param  context          the argument passed to the callback
+ * @return -1 if the memory cannot be allocated
+ */
+int createTcpReassembler(struct TcpReassembler* reassembler, uint32_t maxStreams, uint32_t numberOfSegments,
+        uint32_t maxBufferedBytes, uint64_t idleTimeout, TcpStreamCallback callback, void* context) {
+    memset(reassembler, 0, sizeof(struct TcpReassembler));
+    reassembler->maxStreams = maxStreams;
+    reassembler->maxBufferedBytes = maxBufferedBytes;
+    reassembler->idleTimeout = idleTimeout;
+    reassembler->callback = callback;
+    reassembler->context = context;
+
+    reassembler->numberOfBuckets = 1;
+    while ( reassembler->numberOfBuckets < maxStreams ) {
+        reassembler->numberOfBuckets <<= 1;
+    }
+    reassembler->buckets = calloc(reassembler->numberOfBuckets, sizeof(struct TcpStream*));
+    reassembler->streams = calloc(maxStreams, sizeof(struct TcpStream));
+    if ( reassembler->buckets == NULL || reassembler->streams == NULL ||
+            createTcpSegmentPool(&reassembler->segmentPool, numberOfSegments) == -1 ) {
+        destroyTcpReassembler(reassembler);
+        return -1;
+    }
+
+    uint32_t i = 0;
+    for ( i = 0; i < maxStreams; ++ i ) {
+        reassembler->streams[i].next = i + 1 < maxStreams ? &reassembler->streams[i + 1] : NULL;
+    }
+    reassembler->freeStreams = reassembler->streams;
+    return 0;
+}
+
+/**
+ * Release the memory of the reassembler, streams still open are not
+ * delivered to the callback.
+ *
+ * @param reassembler the reassembler
+ */
+void destroyTcpReassembler(struct TcpReassembler* reassembler) {
+    free(reassembler->buckets);
+    free(reassembler->streams);
+    free(reassembler->segmentPool.segments);
+    reassembler->buckets = NULL;
+    reassembler->streams = NULL;
+    reassembler->segmentPool.segments = NULL;
+}
+
+/**
+ * Feed a decoded packet to the reassembler.
+ *
+ * @param  reassembler the reassembler
+ * @param  packet      the decoded packet
+ * @param  timestamp   the time when the packet was captured in nanoseconds
+ * @return -1 if the packet doesn't carry a complete TCP header over IPv4
+ */
+int processTcpSegment(struct TcpReassembler* reassembler, const struct DecodedPacket* packet, uint64_t timestamp) {
+    struct FlowKey key;
+    if ( packet->protocol != IPPROTO_TCP || packet->transportOffset == 0 || extractFlowKey(packet, &key) == -1 ) {
+        return -1;
+    }
+    const struct tcphdr* tcph = (const struct tcphdr*) (packet->frame + packet->transportOffset);
+    uint32_t payloadLength = packet->payloadLength;
+
+    int direction = TCP_STREAM_CLIENT_TO_SERVER;
+    struct TcpStream* stream = findTcpStream(reassembler, &key, &direction);
+    if ( stream == NULL ) {
+        // Only SYN or data opens a stream, so trailing segments of a closed stream are ignored
+        if ( tcph->rst || (!tcph->syn && payloadLength == 0) ) {
+            return 0;
+        }
+        // The stream is oriented from the endpoint sending SYN
+        if ( tcph->syn && tcph->ack ) {
+            struct FlowKey reversedKey = key;
+            reversedKey.sourceAddress = key.destinationAddress;
+            reversedKey.destinationAddress = key.sourceAddress;
+            reversedKey.sourcePort = key.destinationPort;
+            reversedKey.destinationPort = key.sourcePort;
+            key = reversedKey;
+            direction = TCP_STREAM_SERVER_TO_CLIENT;
+        }
+        stream = createTcpStream(reassembler, &key, timestamp);
+        if ( stream == NULL ) {
+            ++ reassembler->untrackedSegments;
+            return 0;
+        }
+    }
+    stream->lastSeen = timestamp;
+
+    if ( tcph->rst ) {
+        closeTcpStream(reassembler, stream);
+        return 0;
+    }
+
+    // SYN takes one sequence number, the stream is joined at the first segment otherwise
+    struct TcpHalfStream* half = &stream->halves[direction];
+    uint32_t sequenceNumber = ntohl(tcph->seq);
+    if ( tcph->syn ) {
+        ++ sequenceNumber;
+    }
+    if ( !half->isSynchronized ) {
+        half->nextSequenceNumber = sequenceNumber;
+        half->isSynchronized = TRUE;
+    }
+    if ( payloadLength != 0 ) {
+        addStreamData(reassembler, stream, direction, sequenceNumber, packet->frame + packet->payloadOffset, payloadLength);
+    }
+
+    // The direction is finished once all data before FIN is delivered
+    if ( tcph->fin && !half->isFinReceived ) {
+        half->isFinReceived = TRUE;
+        half->finSequenceNumber = sequenceNumber + payloadLength;
+    }
+    if ( half->isFinReceived && !half->isFinished &&
+            !SEQUENCE_BEFORE(half->nextSequenceNumber, half->finSequenceNumber) ) {
+        half->isFinished = TRUE;
+    }
+    if ( stream->halves[TCP_STREAM_CLIENT_TO_SERVER].isFinished &&
+            stream->halves[TCP_STREAM_SERVER_TO_CLIENT].isFinished ) {
+        closeTcpStream(reassembler, stream);
+    }
+    return 0;
+}
+
+/**
+ * Close the streams idle for longer than the timeout.
+ *
+ * @param reassembler the reassembler
+ * @param currentTime the current time in nanoseconds
+ */
+void expireTcpStreams(struct TcpReassembler* reassembler, uint64_t currentTime) {
+    uint32_t i = 0;
+
+    for ( i = 0; i < reassembler->numberOfBuckets; ++ i ) {
+        struct TcpStream* stream = reassembler->buckets[i];
+
+        while ( stream != NULL ) {
+            struct TcpStream* nextStream = stream->next;
+            if ( currentTime > stream->lastSeen && currentTime - stream->lastSeen > reassembler->idleTimeout ) {
+                closeTcpStream(reassembler, stream);
+            }
+            stream = nextStream;
+        }
+    }
+    reassembler->lastExpireTime = currentTime;
+}
+
+/**
+ * Allocate all segments of the pool at once, and chain them into the free list.
+ *
+ * @param  pool             the segment pool
+ * @param  numberOfSegments the number of segments
+ * @return -1 if the memory cannot be allocated
+ */
+static int createTcpSegmentPool(struct TcpSegmentPool* pool, uint32_t numberOfSegments) {
+    pool->segments = malloc((size_t) numberOfSegments * sizeof(struct TcpSegment));
+    if ( pool->segments == NULL ) {
+        return -1;
+    }
+    uint32_t i = 0;
+    for ( i = 0; i < numberOfSegments; ++ i ) {
+        pool->segments[i].next = i + 1 < numberOfSegments ? &pool->segments[i + 1] : NULL;
+    }
+    pool->freeSegments = numberOfSegments != 0 ? pool->segments : NULL;
+    pool->capacity = numberOfSegments;
+    pool->numberOfFreeSegments = numberOfSegments;
+    return 0;
+}
+
+/**
+ * Take a segment from the pool.
+ *
+ * @param  pool the segment pool
+ * @return the segment, or NULL if the pool is exhausted
+ */
+static struct TcpSegment* allocateTcpSegment(struct TcpSegmentPool* pool) {
+    struct TcpSegment* segment = pool->freeSegments;
+
+    if ( segment != NULL ) {
+        pool->freeSegments = segment->next;
+        -- pool->numberOfFreeSegments;
+    }
+    return segment;
+}
+
+/**
+ * Return a segment to the pool.
+ *
+ * @param pool    the segment pool
+ * @param segment the segment
+ */
+static void freeTcpSegment(struct TcpSegmentPool* pool, struct TcpSegment* segment) {
+    segment->next = pool->freeSegments;
+    pool->freeSegments = segment;
+    ++ pool->numberOfFreeSegments;
+}
+
+/**
+ * Hash the key of a stream, both directions of the stream get the same hash.
+ *
+ * @param  key the 5-tuple of either direction
+ * @return the hash of the stream
+ */
+static uint32_t getStreamHash(const struct FlowKey* key) {
+    uint32_t hash = (key->sourceAddress ^ key->destinationAddress) * 0x9E3779B1u;
+
+    hash ^= (uint32_t) (key->sourcePort ^ key->destinationPort) * 0x85EBCA6Bu;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/**
+ * Look up the stream that a segment belongs to.
+ *
+ * @param  reassembler the reassembler
+ * @param  key         the 5-tuple of the segment
+ * @param  direction   the direction of the segment in the stream
+ * @return the stream, or NULL if the stream isn't tracked
+ */
+static struct TcpStream* findTcpStream(struct TcpReassembler* reassembler, const struct FlowKey* key, int* direction) {
+    struct TcpStream* stream = reassembler->buckets[getStreamHash(key) & (reassembler->numberOfBuckets - 1)];
+
+    for ( ; stream != NULL; stream = stream->next ) {
+        const struct FlowKey* streamKey = &stream->key;
+
+        if ( streamKey->sourceAddress == key->sourceAddress && streamKey->destinationAddress == key->destinationAddress &&
+                streamKey->sourcePort == key->sourcePort && streamKey->destinationPort == key->destinationPort ) {
+            *direction = TCP_STREAM_CLIENT_TO_SERVER;
+            return stream;
+        }
+        if ( streamKey->sourceAddress == key->destinationAddress && streamKey->destinationAddress == key->sourceAddress &&
+                streamKey->sourcePort == key->destinationPort && streamKey->destinationPort == key->sourcePort ) {
+            *direction = TCP_STREAM_SERVER_TO_CLIENT;
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Take a stream from the pool, idle streams are closed to make room. Closing
+ * them walks all buckets, so it's done at most once per timeout, otherwise
+ * every segment of unknown streams would walk them while the pool is empty.
+ *
+ * @param  reassembler the reassembler
+ * @param  key         the 5-tuple oriented from client to server
+ * @param  timestamp   the time when the segment was captured in nanoseconds
+ * @return the stream, or NULL if all streams are in use
+ */
+static struct TcpStream* createTcpStream(struct TcpReassembler* reassembler, const struct FlowKey* key, uint64_t timestamp) {
+    if ( reassembler->freeStreams == NULL ) {
+        if ( timestamp < reassembler->lastExpireTime ) {
+            // The clock stepped backwards, wait for a whole timeout from now
+            reassembler->lastExpireTime = timestamp;
+        } else if ( timestamp - reassembler->lastExpireTime >= reassembler->idleTimeout ) {
+            expireTcpStreams(reassembler, timestamp);
+        }
+        if ( reassembler->freeStreams == NULL ) {
+            return NULL;
+        }
+    }
+    struct TcpStream* stream = reassembler->freeStreams;
+    reassembler->freeStreams = stream->next;
+
+    uint32_t bucket = getStreamHash(key) & (reassembler->numberOfBuckets - 1);
+    memset(stream, 0, sizeof(struct TcpStream));
+    stream->key = *key;
+    stream->lastSeen = timestamp;
+    stream->next = reassembler->buckets[bucket];
+    reassembler->buckets[bucket] = stream;
+    ++ reassembler->numberOfStreams;
+
+    return stream;
+}
+
+/**
+ * Deliver the data still buffered in a stream, notify the callback, and
+ * return the stream to the pool.
+ *
+ * @param reassembler the reassembler
+ * @param stream      the stream
+ */
+static void closeTcpStream(struct TcpReassembler* reassembler, struct TcpStream* stream) {
+    int direction = 0;
+
+    for ( direction = 0; direction < 2; ++ direction ) {
+        while ( stream->halves[direction].outOfOrderSegments != NULL ) {
+            skipToNextSegment(reassembler, stream, direction);
+        }
+    }
+    reassembler->callback(stream, TCP_STREAM_CLIENT_TO_SERVER, TCP_STREAM_EVENT_CLOSED, NULL, 0, reassembler->context);
+
+    struct TcpStream** pStream = &reassembler->buckets[getStreamHash(&stream->key) & (reassembler->numberOfBuckets - 1)];
+    while ( *pStream != stream ) {
+        pStream = &(*pStream)->next;
+    }
+    *pStream = stream->next;
+    stream->next = reassembler->freeStreams;
+    reassembler->freeStreams = stream;
+    -- reassembler->numberOfStreams;
+    ++ reassembler->closedStreams;
+}
+
+/**
+ * Deliver the data if it's in order, or buffer it until the bytes before it arrive.
+ *
+ * @param reassembler    the reassembler
+ * @param stream         the stream
+ * @param direction      the direction of the data
+ * @param sequenceNumber the sequence number of the first byte
+ * @param data           the payload of the segment
+ * @param length         the length of the payload
+ */
+static void addStreamData(struct TcpReassembler* reassembler, struct TcpStream* stream, int direction,
+        uint32_t sequenceNumber, const unsigned char* data, uint32_t length) {
+    struct TcpHalfStream* half = &stream->halves[direction];
+
+    // Data beyond the largest window can't be valid, e.g. a corrupted segment
+    if ( SEQUENCE_DIFFERENCE(sequenceNumber, half->nextSequenceNumber) > TCP_MAX_WINDOW_SIZE ) {
+        return;
+    }
+    if ( SEQUENCE_BEFORE(half->nextSequenceNumber, sequenceNumber) ) {
+        bufferOutOfOrderData(reassembler, stream, direction, sequenceNumber, data, length);
+        return;
+    }
+    deliverStreamData(reassembler, stream, direction, sequenceNumber, data, length);
+    drainOutOfOrderSegments(reassembler, stream, direction);
+}
+
+/**
+ * Deliver the part of data after the bytes already delivered.
+ *
+ * @param reassembler    the reassembler
+ * @param stream         the stream
+ * @param direction      the direction of the data
+ * @param sequenceNumber the sequence number of the first byte, not after the next expected byte
+ * @param data           the data
+ * @param length         the length of the data
+ */
+static void deliverStreamData(struct TcpReassembler* reassembler, struct TcpStream* stream, int direction,
+        uint32_t sequenceNumber, const unsigned char* data, uint32_t length) {
+    struct TcpHalfStream* half = &stream->halves[direction];
+    int32_t newBytes = SEQUENCE_DIFFERENCE(sequenceNumber + length, half->nextSequenceNumber);
+
+    // Retransmitted bytes are delivered only once
+    if ( newBytes <= 0 ) {
+        return;
+    }
+    reassembler->callback(stream, direction, TCP_STREAM_EVENT_DATA,
+        data + length - newBytes, newBytes, reassembler->context);
+    half->nextSequenceNumber += newBytes;
+    half->deliveredBytes += newBytes;
+}
+
+/**
+ * Deliver the buffered segments that are in order now.
+ *
+ * @param reassembler the reassembler
+ * @param stream      the stream
+ * @param direction   the direction of the segments
+ */
+static void drainOutOfOrderSegments(struct TcpReassembler* reassembler, struct TcpStream* stream, int direction) {
+    struct TcpHalfStream* half = &stream->halves[direction];
+
+    while ( half->outOfOrderSegments != NULL &&
+            !SEQUENCE_BEFORE(half->nextSequenceNumber, half->outOfOrderSegments->sequenceNumber) ) {
+        struct TcpSegment* segment = half->outOfOrderSegments;
+
+        half->outOfOrderSegments = segment->next;
+        half->bufferedBytes -= segment->length;
+        deliverStreamData(reassembler, stream, direction, segment->sequenceNumber, segment->data, segment->length);
+        freeTcpSegment(&reassembler->segmentPool, segment);
+    }
+}
+
+/**
+ * Give up waiting for the missing bytes before the first buffered segment,
+ * and deliver the data from that segment on.
+ *
+ * @param reassembler the reassembler
+ * @param stream      the stream
+ * @param direction   the direction with buffered segments
+ */
+static void skipToNextSegment(struct TcpReassembler* reassembler, struct TcpStream* stream, int direction) {
+    struct TcpHalfStream* half = &stream->halves[direction];
+    uint32_t gapLength = half->outOfOrderSegments->sequenceNumber - half->nextSequenceNumber;
+
+    reassembler->callback(stream, direction, TCP_STREAM_EVENT_GAP, NULL, gapLength, reassembler->context);
+    reassembler->gapBytes += gapLength;
+    half->nextSequenceNumber = half->outOfOrderSegments->sequenceNumber;
+    drainOutOfOrderSegments(reassembler, stream, direction);
+}
+
+/**
+ * Copy out-of-order data into pooled segments, sorted by sequence number.
+ *
+ * When the direction exceeds its buffer limit, or the pool is exhausted,
+ * the missing bytes before the earliest buffered segment are skipped, so
+ * memory stays bounded and the stream keeps moving.
+ *
+ * @param reassembler    the reassembler
+ * @param stream         the stream
+ * @param direction      the direction of the data
+ * @param sequenceNumber the sequence number of the first byte, after the next expected byte
+ * @param data           the data
+ * @param length         the length of the data
+ */
+static void bufferOutOfOrderData(struct TcpReassembler* reassembler, struct TcpStream* stream, int direction,
+        uint32_t sequenceNumber, const unsigned char* data, uint32_t length) {
+    struct TcpHalfStream* half = &stream->halves[direction];
+
+    while ( length != 0 ) {
+        uint32_t chunkLength = length < TCP_SEGMENT_DATA_SIZE ? length : TCP_SEGMENT_DATA_SIZE;
+
+        // Look for the last buffered segment starting at or before the chunk
+        struct TcpSegment** pNext = &half->outOfOrderSegments;
+        struct TcpSegment* previous = NULL;
+        while ( *pNext != NULL && !SEQUENCE_BEFORE(sequenceNumber, (*pNext)->sequenceNumber) ) {
+            previous = *pNext;
+            pNext = &(*pNext)->next;
+        }
+
+        // Skip chunks buffered already, e.g. retransmissions
+        int isDuplicate = previous != NULL &&
+            !SEQUENCE_BEFORE(previous->sequenceNumber + previous->length, sequenceNumber + chunkLength);
+
+        struct TcpSegment* segment = NULL;
+        if ( !isDuplicate ) {
+            while ( half->outOfOrderSegments != NULL &&
+                    (half->bufferedBytes + chunkLength > reassembler->maxBufferedBytes ||
+                     reassembler->segmentPool.freeSegments == NULL) ) {
+                skipToNextSegment(reassembler, stream, direction);
+            }
+            // Skipping may have delivered the bytes before the chunk
+            if ( !SEQUENCE_BEFORE(half->nextSequenceNumber, sequenceNumber) ) {
+                addStreamData(reassembler, stream, direction, sequenceNumber, data, length);
+                return;
+            }
+            pNext = &half->outOfOrderSegments;
+            while ( *pNext != NULL && !SEQUENCE_BEFORE(sequenceNumber, (*pNext)->sequenceNumber) ) {
+                pNext = &(*pNext)->next;
+            }
+            if ( chunkLength <= reassembler->maxBufferedBytes ) {
+                segment = allocateTcpSegment(&reassembler->segmentPool);
+            }
+        }
+
+        if ( segment != NULL ) {
+            segment->sequenceNumber = sequenceNumber;
+            segment->length = chunkLength;
+            memcpy(segment->data, data, chunkLength);
+            segment->next = *pNext;
+            *pNext = segment;
+            half->bufferedBytes += chunkLength;
+            ++ reassembler->outOfOrderSegments;
+        } else if ( !isDuplicate ) {
+            // Nothing can be buffered, so the missing bytes are skipped right away
+            uint32_t gapLength = sequenceNumber - half->nextSequenceNumber;
+
+            reassembler->callback(stream, direction, TCP_STREAM_EVENT_GAP, NULL, gapLength, reassembler->context);
+            reassembler->gapBytes += gapLength;
+            half->nextSequenceNumber = sequenceNumber;
+            addStreamData(reassembler, stream, direction, sequenceNumber, data, length);
+            return;
+        }
+        sequenceNumber += chunkLength;
+        data += chunkLength;
+        length -= chunkLength;
+    }
+}
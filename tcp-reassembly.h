@@ -0,0 +1,109 @@
+#ifndef TCP_REASSEMBLY_H
+#define TCP_REASSEMBLY_H
+
+#include <stdint.h>
+
+#include "flow-table.h"
+#include "packet-decoder.h"
+
+/**
+ * The size of data carried by a pooled segment, larger payloads are split
+ * into several segments. A segment takes 2 KiB in total.
+ */
+#define TCP_SEGMENT_DATA_SIZE       (2048 - 16)
+
+/**
+ * Directions of a TCP stream, relative to the endpoint that opened it.
+ */
+#define TCP_STREAM_CLIENT_TO_SERVER 0
+#define TCP_STREAM_SERVER_TO_CLIENT 1
+
+/**
+ * Events delivered to the callback of the reassembler.
+ */
+#define TCP_STREAM_EVENT_DATA       0   // contiguous data of one direction
+#define TCP_STREAM_EVENT_GAP        1   // data lost or evicted, length is the number of bytes skipped
+#define TCP_STREAM_EVENT_CLOSED     2   // closed by FIN, RST or idle timeout, no data
+
+/**
+ * A chunk of out-of-order data, allocated from the segment pool.
+ */
+struct TcpSegment {
+    struct TcpSegment* next;
+    uint32_t sequenceNumber;
+    uint32_t length;
+    unsigned char data[TCP_SEGMENT_DATA_SIZE];
+};
+
+/**
+ * A fixed number of segments allocated at once, and recycled through a free list.
+ */
+struct TcpSegmentPool {
+    struct TcpSegment* segments;
+    struct TcpSegment* freeSegments;
+    uint32_t capacity;
+    uint32_t numberOfFreeSegments;
+};
+
+/**
+ * The state of one direction of a TCP stream.
+ */
+struct TcpHalfStream {
+    uint32_t nextSequenceNumber;        // the next byte to deliver
+    uint32_t finSequenceNumber;
+    struct TcpSegment* outOfOrderSegments;  // sorted by sequence number
+    uint32_t bufferedBytes;
+    uint64_t deliveredBytes;
+    uint8_t isSynchronized;
+    uint8_t isFinReceived;
+    uint8_t isFinished;
+};
+
+/**
+ * A bidirectional TCP stream, the key is oriented from client to server.
+ */
+struct TcpStream {
+    struct TcpStream* next;             // in the hash bucket or the free list
+    struct FlowKey key;
+    struct TcpHalfStream halves[2];
+    uint64_t lastSeen;                  // in nanoseconds
+    void* userData;                     // owned by the callback
+};
+
+typedef void (*TcpStreamCallback)(struct TcpStream* stream, int direction, int event,
+        const unsigned char* data, uint32_t length, void* context);
+
+/**
+ * Reassembles TCP streams of one capture worker. Streams and segments come
+ * from pools allocated once, so no memory is allocated while capturing.
+ */
+struct TcpReassembler {
+    struct TcpStream** buckets;
+    uint32_t numberOfBuckets;           // a power of 2
+    struct TcpStream* streams;
+    struct TcpStream* freeStreams;
+    uint32_t numberOfStreams;
+    uint32_t maxStreams;
+    uint32_t maxBufferedBytes;          // per direction of a stream
+    uint64_t idleTimeout;               // in nanoseconds
+    uint64_t lastExpireTime;            // in nanoseconds
+    struct TcpSegmentPool segmentPool;
+    TcpStreamCallback callback;
+    void* context;
+
+    uint64_t outOfOrderSegments;
+    uint64_t gapBytes;
+    uint64_t untrackedSegments;
+    uint64_t closedStreams;
+};
+
+/**
+ * Prototypes of functions.
+ */
+int createTcpReassembler(struct TcpReassembler* reassembler, uint32_t maxStreams, uint32_t numberOfSegments,
+        uint32_t maxBufferedBytes, uint64_t idleTimeout, TcpStreamCallback callback, void* context);
+void destroyTcpReassembler(struct TcpReassembler* reassembler);
+int processTcpSegment(struct TcpReassembler* reassembler, const struct DecodedPacket* packet, uint64_t timestamp);
+void expireTcpStreams(struct TcpReassembler* reassembler, uint64_t currentTime);
+
+#endif
@@ -3,12 +3,71 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <getopt.h>
 #include <netdb.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>     // for closing socket
 #include <sys/socket.h>
 #include <sys/types.h>
 
-#define BUFFER_SIZE 1024
+#define TRUE                    1
+#define FALSE                   0
+
+#define BUFFER_SIZE             1024
+#define DEFAULT_WINDOW_SIZE     16
+#define MAX_WINDOW_SIZE         1024
+#define MAX_RETRANSMISSIONS     5
+
+/**
+ * Retransmission timeouts in seconds, see RFC 6298.
+ */
+#define INITIAL_RTO             1.0
+#define MIN_RTO                 0.02
+#define MAX_RTO                 8.0
+#define CLOCK_GRANULARITY       0.001
+
+/**
+ * A request in flight in async mode.
+ */
+struct PendingRequest {
+    int isInUse;
+    unsigned int sequenceId;
+    int messageIndex;
+    double firstSentTime;
+    double lastSentTime;
+    double expireTime;
+    int retransmissions;
+};
+
+/**
+ * The estimator of retransmission timeout and the statistics of async mode.
+ */
+struct TransferStatistics {
+    double smoothedRtt;
+    double rttVariation;
+    double retransmissionTimeout;
+    int sentRequests;
+    int receivedReplies;
+    int retransmissions;
+    int lostRequests;
+    int unexpectedReplies;
+    double* latencies;
+};
+
+/**
+ * Prototypes of functions.
+ */
+void printUsage(char* programName);
+int runAsyncMode(int udpSocketFileDescriptor, struct sockaddr_in* serverSocketAddress, int windowSize, int totalRequests);
+int loadMessages(char*** messages);
+void freeMessages(char** messages, int totalMessages);
+int sendTaggedRequest(int udpSocketFileDescriptor, struct PendingRequest* request, char* message, 
+        double currentTime, double retransmissionTimeout);
+void updateRetransmissionTimeout(struct TransferStatistics* statistics, double rtt);
+void printTransferStatistics(struct TransferStatistics* statistics, double elapsedTime);
+int compareLatencies(const void* a, const void* b);
+double getCurrentTime();
 
 /**
  * The entrance of the server application.
@@ -18,19 +77,52 @@
  * @return 0 if the application exited normally
  */
 int main(int argc, char *argv[]) {
-    if ( argc != 3 ) {
-        fprintf(stderr," Usage: %s Host PortNumber\n",argv[0]);
+    /*
+     * Parse options.
+     *
+     * -a, --async   send the lines from stdin with several requests in flight
+     * -w, --window  the maximum number of requests in flight in async mode
+     * -n, --count   the number of requests to send in async mode, the lines are reused cyclically
+     */
+    int isAsyncMode = FALSE;
+    int windowSize = DEFAULT_WINDOW_SIZE;
+    int totalRequests = 0;
+    struct option longOptions[] = {
+        {"async",  no_argument,       NULL, 'a'},
+        {"window", required_argument, NULL, 'w'},
+        {"count",  required_argument, NULL, 'n'},
+        {NULL,     0,                 NULL, 0}
+    };
+    int option = 0;
+    while ( (option = getopt_long(argc, argv, "aw:n:", longOptions, NULL)) != -1 ) {
+        switch ( option ) {
+            case 'a':
+                isAsyncMode = TRUE;
+                break;
+            case 'w':
+                windowSize = atoi(optarg);
+                break;
+            case 'n':
+                totalRequests = atoi(optarg);
+                break;
+            default:
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if ( argc - optind != 2 || windowSize <= 0 || windowSize > MAX_WINDOW_SIZE || totalRequests < 0 ) {
+        printUsage(argv[0]);
         return EXIT_FAILURE;
     }
     
-    struct hostent* pHost = gethostbyname(argv[1]);
+    struct hostent* pHost = gethostbyname(argv[optind]);
     if ( pHost == NULL ) {
-        fprintf(stderr, "Usage: %s Host PortNumber\n", argv[0]);
+        printUsage(argv[0]);
         return EXIT_FAILURE;
     }
-    int portNumber = atoi(argv[2]);
+    int portNumber = atoi(argv[optind + 1]);
     if ( portNumber <= 0 ) {
-        fprintf(stderr, "Usage: %s Host PortNumber\n", argv[0]);
+        printUsage(argv[0]);
         return EXIT_FAILURE;
     }
 
@@ -78,6 +170,16 @@ int main(int argc, char *argv[]) {
     serverSocketAddress.sin_addr=*((struct in_addr *)pHost->h_addr);
     serverSocketAddress.sin_port = htons(portNumber);
 
+    /*
+     * Send requests without waiting for each reply in async mode.
+     */
+    if ( isAsyncMode ) {
+        int exitCode = runAsyncMode(udpSocketFileDescriptor, &serverSocketAddress, windowSize, totalRequests);
+        close(udpSocketFileDescriptor);
+
+        return exitCode;
+    }
+
     char inputBuffer[BUFFER_SIZE] = {0};
     char outputBuffer[BUFFER_SIZE] = {0};
     fprintf(stderr, "[INFO] Congratulations! Connection established with server.\nType \'BYE\' to disconnect.\n");
@@ -116,4 +218,323 @@ int main(int argc, char *argv[]) {
 
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+/**
+ * Print the usage of the application.
+ *
+ * @param programName the name of the application
+ */
+void printUsage(char* programName) {
+    fprintf(stderr, "Usage: %s [--async [--window Size] [--count N]] Host PortNumber\n", programName);
+}
+
+/**
+ * Send the lines from stdin with up to windowSize requests in flight.
+ *
+ * Each datagram is tagged as "#<id>:<message>", and the server echoes the tag
+ * back, so replies are matched by id regardless of their order. A request
+ * without reply is retransmitted when its timeout expires, the timeout is
+ * estimated from the RTT samples as RFC 6298 describes.
+ *
+ * @param  udpSocketFileDescriptor the file descriptor of UDP socket
+ * @param  serverSocketAddress     the address of the server
+ * @param  windowSize              the maximum number of requests in flight
+ * @param  totalRequests           the number of requests to send, 0 for sending each line once
+ * @return EXIT_SUCCESS if all requests are answered
+ */
+int runAsyncMode(int udpSocketFileDescriptor, struct sockaddr_in* serverSocketAddress, int windowSize, int totalRequests) {
+    char** messages = NULL;
+    int totalMessages = loadMessages(&messages);
+    if ( totalMessages == -1 ) {
+        return EXIT_FAILURE;
+    } else if ( totalMessages == 0 ) {
+        fprintf(stderr, "[ERROR] No message to send, messages are read from stdin line by line in async mode.\n");
+        return EXIT_FAILURE;
+    }
+    if ( totalRequests == 0 ) {
+        totalRequests = totalMessages;
+    }
+
+    // Connect the socket, so that the kernel drops datagrams from other hosts
+    if ( connect(udpSocketFileDescriptor, (struct sockaddr *)(serverSocketAddress), sizeof(struct sockaddr_in)) == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to connect the socket to the server: %s\n", strerror(errno));
+        freeMessages(messages, totalMessages);
+        return EXIT_FAILURE;
+    }
+
+    struct PendingRequest requests[MAX_WINDOW_SIZE];
+    memset(requests, 0, sizeof(requests));
+    struct TransferStatistics statistics;
+    memset(&statistics, 0, sizeof(statistics));
+    statistics.retransmissionTimeout = INITIAL_RTO;
+    statistics.latencies = malloc(totalRequests * sizeof(double));
+    if ( statistics.latencies == NULL ) {
+        fprintf(stderr, "[ERROR] Failed to allocate the statistics of %d requests: %s\n", totalRequests, strerror(errno));
+        freeMessages(messages, totalMessages);
+        return EXIT_FAILURE;
+    }
+
+    char inputBuffer[BUFFER_SIZE] = {0};
+    int nextRequest = 0, finishedRequests = 0, pendingRequests = 0;
+    double startTime = getCurrentTime();
+    while ( finishedRequests < totalRequests ) {
+        double currentTime = getCurrentTime();
+        int i = 0;
+
+        // Fill the window with new requests
+        for ( i = 0; i < windowSize && nextRequest < totalRequests && pendingRequests < windowSize; ++ i ) {
+            struct PendingRequest* request = &requests[i];
+            if ( request->isInUse ) {
+                continue;
+            }
+            request->isInUse = TRUE;
+            request->sequenceId = nextRequest;
+            request->messageIndex = nextRequest % totalMessages;
+            request->firstSentTime = currentTime;
+            request->retransmissions = 0;
+            ++ nextRequest;
+            ++ pendingRequests;
+            ++ statistics.sentRequests;
+
+            if ( sendTaggedRequest(udpSocketFileDescriptor, request, messages[request->messageIndex], 
+                    currentTime, statistics.retransmissionTimeout) == -1 ) {
+                fprintf(stderr, "[ERROR] An error occurred while sending message to the server: %s\n", strerror(errno));
+            }
+        }
+
+        // Wait for replies until the earliest request expires
+        double nearestExpireTime = currentTime + MAX_RTO;
+        for ( i = 0; i < windowSize; ++ i ) {
+            if ( requests[i].isInUse && requests[i].expireTime < nearestExpireTime ) {
+                nearestExpireTime = requests[i].expireTime;
+            }
+        }
+        struct pollfd pollFileDescriptor = {udpSocketFileDescriptor, POLLIN, 0};
+        int timeout = (int) ((nearestExpireTime - currentTime) * 1000 + 1);
+        if ( poll(&pollFileDescriptor, 1, timeout > 0 ? timeout : 0) == -1 && errno != EINTR ) {
+            fprintf(stderr, "[ERROR] An error occurred while waiting for the server: %s\n", strerror(errno));
+            break;
+        }
+
+        // Match all available replies to the requests by id
+        int readBytes = 0;
+        while ( (readBytes = recv(udpSocketFileDescriptor, inputBuffer, BUFFER_SIZE - 1, MSG_DONTWAIT)) >= 0 ) {
+            inputBuffer[readBytes] = 0;
+            unsigned int sequenceId = 0;
+            if ( sscanf(inputBuffer, "#%u:", &sequenceId) != 1 ) {
+                ++ statistics.unexpectedReplies;
+                continue;
+            }
+
+            struct PendingRequest* request = NULL;
+            for ( i = 0; i < windowSize; ++ i ) {
+                if ( requests[i].isInUse && requests[i].sequenceId == sequenceId ) {
+                    request = &requests[i];
+                    break;
+                }
+            }
+            if ( request == NULL ) {
+                // A duplicated reply of a retransmitted request, or a reply arrived too late
+                ++ statistics.unexpectedReplies;
+                continue;
+            }
+
+            double receivedTime = getCurrentTime();
+            // Karn's algorithm: RTT is not sampled from retransmitted requests
+            if ( request->retransmissions == 0 ) {
+                updateRetransmissionTimeout(&statistics, receivedTime - request->lastSentTime);
+            }
+            statistics.latencies[statistics.receivedReplies ++] = receivedTime - request->firstSentTime;
+            request->isInUse = FALSE;
+            -- pendingRequests;
+            ++ finishedRequests;
+        }
+
+        // Retransmit the expired requests
+        currentTime = getCurrentTime();
+        for ( i = 0; i < windowSize; ++ i ) {
+            struct PendingRequest* request = &requests[i];
+            if ( !request->isInUse || request->expireTime > currentTime ) {
+                continue;
+            }
+
+            if ( request->retransmissions == MAX_RETRANSMISSIONS ) {
+                fprintf(stderr, "[WARN] Request #%u is lost after %d retransmissions.\n", 
+                    request->sequenceId, request->retransmissions);
+                request->isInUse = FALSE;
+                -- pendingRequests;
+                ++ finishedRequests;
+                ++ statistics.lostRequests;
+                continue;
+            }
+            // Back off the timer of this request, see RFC 6298 section 5.5.
+            // The shared estimation is kept, since other requests in flight may not be lost.
+            ++ request->retransmissions;
+            ++ statistics.retransmissions;
+            double retransmissionTimeout = statistics.retransmissionTimeout * (1 << request->retransmissions);
+            sendTaggedRequest(udpSocketFileDescriptor, request, messages[request->messageIndex], currentTime, 
+                retransmissionTimeout < MAX_RTO ? retransmissionTimeout : MAX_RTO);
+        }
+    }
+    printTransferStatistics(&statistics, getCurrentTime() - startTime);
+
+    freeMessages(messages, totalMessages);
+    free(statistics.latencies);
+
+    return statistics.receivedReplies == totalRequests ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Read the messages from stdin line by line.
+ *
+ * @param  messages a pointer to the array of messages, which should be freed with freeMessages
+ * @return the number of messages, or -1 if the messages cannot be stored
+ */
+int loadMessages(char*** messages) {
+    char inputBuffer[BUFFER_SIZE] = {0};
+    int totalMessages = 0, capacity = 0;
+    *messages = NULL;
+
+    while ( fgets(inputBuffer, BUFFER_SIZE, stdin) != NULL ) {
+        inputBuffer[strcspn(inputBuffer, "\n")] = 0;
+        if ( totalMessages == capacity ) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            char** newMessages = realloc(*messages, capacity * sizeof(char*));
+            if ( newMessages == NULL ) {
+                break;
+            }
+            *messages = newMessages;
+        }
+        if ( ((*messages)[totalMessages] = strdup(inputBuffer)) == NULL ) {
+            break;
+        }
+        ++ totalMessages;
+    }
+    if ( !feof(stdin) ) {
+        fprintf(stderr, "[ERROR] Failed to read the messages from stdin: %s\n", strerror(errno));
+        freeMessages(*messages, totalMessages);
+        *messages = NULL;
+        return -1;
+    }
+    return totalMessages;
+}
+
+/**
+ * Free the messages read from stdin.
+ *
+ * @param messages      the array of messages
+ * @param totalMessages the number of messages
+ */
+void freeMessages(char** messages, int totalMessages) {
+    int i = 0;
+    for ( i = 0; i < totalMessages; ++ i ) {
+        free(messages[i]);
+    }
+    free(messages);
+}
+
+/**
+ * Send a request tagged with its sequence id to the connected server.
+ *
+ * @param  udpSocketFileDescriptor the file descriptor of UDP socket
+ * @param  request                 the request to send
+ * @param  message                 the message of the request
+ * @param  currentTime             the current time in seconds
+ * @param  retransmissionTimeout   the timeout before the request is retransmitted
+ * @return -1 if the operation failed
+ */
+int sendTaggedRequest(int udpSocketFileDescriptor, struct PendingRequest* request, char* message, 
+        double currentTime, double retransmissionTimeout) {
+    char outputBuffer[BUFFER_SIZE] = {0};
+    int messageSize = snprintf(outputBuffer, BUFFER_SIZE, "#%u:%s", request->sequenceId, message);
+    if ( messageSize >= BUFFER_SIZE ) {
+        messageSize = BUFFER_SIZE - 1;
+    }
+
+    request->lastSentTime = currentTime;
+    request->expireTime = currentTime + retransmissionTimeout;
+
+    return send(udpSocketFileDescriptor, outputBuffer, messageSize + 1, 0) == -1 ? -1 : 0;
+}
+
+/**
+ * Update the retransmission timeout with a new RTT sample, see RFC 6298 section 2.
+ *
+ * @param statistics the estimator of retransmission timeout
+ * @param rtt        the round-trip time in seconds
+ */
+void updateRetransmissionTimeout(struct TransferStatistics* statistics, double rtt) {
+    if ( statistics->smoothedRtt == 0 ) {
+        statistics->smoothedRtt = rtt;
+        statistics->rttVariation = rtt / 2;
+    } else {
+        double deviation = statistics->smoothedRtt - rtt;
+        statistics->rttVariation = 0.75 * statistics->rttVariation + 0.25 * (deviation < 0 ? -deviation : deviation);
+        statistics->smoothedRtt = 0.875 * statistics->smoothedRtt + 0.125 * rtt;
+    }
+
+    double variation = 4 * statistics->rttVariation;
+    statistics->retransmissionTimeout = statistics->smoothedRtt + 
+        (variation > CLOCK_GRANULARITY ? variation : CLOCK_GRANULARITY);
+    if ( statistics->retransmissionTimeout < MIN_RTO ) {
+        statistics->retransmissionTimeout = MIN_RTO;
+    } else if ( statistics->retransmissionTimeout > MAX_RTO ) {
+        statistics->retransmissionTimeout = MAX_RTO;
+    }
+}
+
+/**
+ * Print the loss and latency statistics of async mode.
+ *
+ * @param statistics  the statistics of async mode
+ * @param elapsedTime the time spent in seconds
+ */
+void printTransferStatistics(struct TransferStatistics* statistics, double elapsedTime) {
+    fprintf(stderr, "[INFO] %d requests sent, %d replies received, %d retransmissions, %d lost (%.2f%%), %d unexpected replies\n", 
+        statistics->sentRequests, statistics->receivedReplies, statistics->retransmissions, statistics->lostRequests, 
+        statistics->sentRequests > 0 ? 100.0 * statistics->lostRequests / statistics->sentRequests : 0, 
+        statistics->unexpectedReplies);
+    fprintf(stderr, "[INFO] %.0f requests/s in %.3f s, RTO %.3f ms, SRTT %.3f ms\n", 
+        elapsedTime > 0 ? statistics->receivedReplies / elapsedTime : 0, elapsedTime, 
+        statistics->retransmissionTimeout * 1000, statistics->smoothedRtt * 1000);
+
+    int n = statistics->receivedReplies;
+    if ( n == 0 ) {
+        return;
+    }
+    qsort(statistics->latencies, n, sizeof(double), compareLatencies);
+
+    double totalLatency = 0;
+    int i = 0;
+    for ( i = 0; i < n; ++ i ) {
+        totalLatency += statistics->latencies[i];
+    }
+    fprintf(stderr, "[INFO] Latency: min %.3f ms, avg %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", 
+        statistics->latencies[0] * 1000, totalLatency / n * 1000, statistics->latencies[n / 2] * 1000, 
+        statistics->latencies[(int) (n * 0.99)] * 1000, statistics->latencies[n - 1] * 1000);
+}
+
+/**
+ * Compare two latencies for sorting.
+ *
+ * @param  a the pointer to the first latency
+ * @param  b the pointer to the second latency
+ * @return a negative value if a is less than b
+ */
+int compareLatencies(const void* a, const void* b) {
+    double difference = *(const double*) a - *(const double*) b;
+    return (difference > 0) - (difference < 0);
+}
+
+/**
+ * Get the current time from a monotonic clock.
+ *
+ * @return the current time in seconds
+ */
+double getCurrentTime() {
+    struct timespec currentTime;
+    clock_gettime(CLOCK_MONOTONIC, &currentTime);
+
+    return currentTime.tv_sec + currentTime.tv_nsec / 1e9;
+}